@@ -0,0 +1,68 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <limits>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "bpe.h"
+
+namespace bpe::bench {
+
+using Benchmark = void (*)();
+
+// Register the benchmark. Returns true to initialize the static registration flag.
+bool register_benchmark(const char* name, Benchmark benchmark);
+
+// Define and register the benchmark function.
+#define BPE_BENCHMARK(name) \
+	static void bench_##name(); \
+	[[maybe_unused]] static const bool bench_##name##_registered = ::bpe::bench::register_benchmark(#name, bench_##name); \
+	static void bench_##name()
+
+// Read the size from the environment variable, or return the default value.
+size_t env_size(const char* name, size_t default_value);
+
+// Load tests/test_corpus.txt.
+std::string load_test_corpus();
+// Repeat the text up to the size bytes. Copies are separated by new lines.
+std::string replicate(std::string_view text, size_t size);
+// Distinct words of the test corpus and their numbered copies, count words in the random order.
+std::vector<std::string> distinct_words(size_t count);
+
+// Tokenizer attached to its own buffer.
+struct TrainedTokenizer {
+	ByteBuffer buffer;
+	Tokenizer tokenizer;
+};
+
+// Train tokenizer on the test corpus.
+std::unique_ptr<TrainedTokenizer> train_tokenizer(const TokenizerTrainer::Config& config);
+
+// Print the single result row. bytes and items are processed by the single iteration, 0 - not reported.
+void report(std::string_view name, double seconds, size_t bytes, size_t items = 0);
+
+// Run the function repeatedly for at least min_seconds and return the best time of the single run.
+template<typename F>
+double measure(F&& function, double min_seconds = 0.5)
+{
+	using Clock = std::chrono::steady_clock;
+
+	double best = std::numeric_limits<double>::max();
+	double total = 0;
+	size_t runs = 0;
+	while (total < min_seconds || runs < 3) {
+		const auto start = Clock::now();
+		function();
+		const double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+		best = std::min(best, seconds);
+		total += seconds;
+		runs++;
+	}
+	return best;
+}
+
+} // namespace bpe::bench
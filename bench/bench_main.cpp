@@ -0,0 +1,120 @@
+#include "bench.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <unordered_set>
+#include <vector>
+
+namespace bpe::bench {
+
+struct RegisteredBenchmark {
+	const char* name;
+	Benchmark benchmark;
+};
+
+static std::vector<RegisteredBenchmark>& benchmarks()
+{
+	static std::vector<RegisteredBenchmark> registered;
+	return registered;
+}
+
+bool register_benchmark(const char* name, Benchmark benchmark)
+{
+	benchmarks().push_back(RegisteredBenchmark{ name, benchmark });
+	return true;
+}
+
+size_t env_size(const char* name, size_t default_value)
+{
+	const char* value = std::getenv(name);
+	if (value == nullptr || *value == '\0') {
+		return default_value;
+	}
+	return static_cast<size_t>(std::strtoull(value, nullptr, 10));
+}
+
+std::string load_test_corpus()
+{
+	std::ifstream file{ std::filesystem::path(TEST_DATA_DIR) / "test_corpus.txt", std::ios::binary };
+	std::stringstream stream;
+	stream << file.rdbuf();
+	return stream.str();
+}
+
+std::string replicate(std::string_view text, size_t size)
+{
+	std::string result;
+	result.reserve(size + text.size() + 1);
+	while (result.size() < size) {
+		result += text;
+		result += '\n';
+	}
+	return result;
+}
+
+std::vector<std::string> distinct_words(size_t count)
+{
+	const std::string corpus = load_test_corpus();
+	std::unordered_set<std::string_view> corpus_words;
+	for (const auto word : words(corpus)) {
+		corpus_words.insert(word);
+	}
+
+	std::unordered_set<std::string> result;
+	const std::vector<std::string_view> base(corpus_words.begin(), corpus_words.end());
+	for (size_t copy = 0; result.size() < count; copy++) {
+		for (size_t i = 0; i < base.size() && result.size() < count; i++) {
+			result.insert(copy == 0 ? std::string{ base[i] } : std::string{ base[i] } + std::to_string(copy));
+		}
+	}
+
+	std::vector<std::string> shuffled(result.begin(), result.end());
+	std::mt19937 generator{ 1 };
+	std::shuffle(shuffled.begin(), shuffled.end(), generator);
+	return shuffled;
+}
+
+std::unique_ptr<TrainedTokenizer> train_tokenizer(const TokenizerTrainer::Config& config)
+{
+	TokenizerTrainer trainer{ config };
+	trainer.train_on_corpus((std::filesystem::path(TEST_DATA_DIR) / "test_corpus.txt").string(), 0);
+	trainer.build_bpe();
+
+	auto result = std::make_unique<TrainedTokenizer>();
+	result->buffer = trainer.save();
+	result->tokenizer.attach(result->buffer.data(), result->buffer.size());
+	return result;
+}
+
+void report(std::string_view name, double seconds, size_t bytes, size_t items)
+{
+	std::printf("%-48.*s %12.3f ms", static_cast<int>(name.size()), name.data(), seconds * 1e3);
+	if (bytes != 0) {
+		std::printf(" %10.1f MB/s", static_cast<double>(bytes) / seconds / 1e6);
+	}
+	if (items != 0) {
+		std::printf(" %10.1f ns/item", seconds * 1e9 / static_cast<double>(items));
+	}
+	std::printf("\n");
+	std::fflush(stdout);
+}
+
+} // namespace bpe::bench
+
+// Usage: bpe_bench [filter]. Runs the benchmarks which names contain the filter.
+int main(int argc, char** argv)
+{
+	const std::string_view filter = argc > 1 ? argv[1] : "";
+	for (const auto& [name, benchmark] : bpe::bench::benchmarks()) {
+		if (std::string_view{ name }.find(filter) == std::string_view::npos) {
+			continue;
+		}
+		std::printf("== %s\n", name);
+		benchmark();
+	}
+	return 0;
+}
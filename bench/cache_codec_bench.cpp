@@ -0,0 +1,63 @@
+#include "bench.h"
+
+#include <cstdio>
+#include <random>
+#include <unordered_map>
+
+using namespace bpe;
+using namespace bpe::bench;
+
+// Size and hits of the cache with the raw aligned ids read in place and with the compact codec,
+// for the vocabulary that fits u16 and for the large one stored by group varint.
+BPE_BENCHMARK(cache_codec)
+{
+	using Raw = MappedMap<std::string_view, std::vector<u32>, DefaultMapConfig<std::string_view, std::vector<u32>,
+		StringHash, std::equal_to<std::string_view>, PaddedStringSerializer, DataSerializer<std::vector<u32>>,
+		MapLayout::swiss>>;
+
+	const std::vector<std::string> keys = distinct_words(env_size("BPE_BENCH_CACHE_WORDS", 1 << 19));
+	std::vector<std::string_view> words(keys.begin(), keys.end());
+
+	for (const u32 vocab_size : { 1u << 15, 1u << 18 }) {
+		// Cached words have about one token per 3 bytes.
+		std::mt19937 random{ 1 };
+		std::unordered_map<std::string, std::vector<u32>> cached;
+		for (const auto& key : keys) {
+			std::vector<u32> ids(key.size() / 3 + 1);
+			for (u32& id : ids) {
+				id = static_cast<u32>(random() % vocab_size);
+			}
+			cached.emplace(key, std::move(ids));
+		}
+
+		ByteBuffer raw_buffer;
+		Raw::write_to_buffer(cached, raw_buffer);
+		const Raw raw{ raw_buffer.data() };
+		ByteBuffer compact_buffer;
+		Cache::write_to_buffer(cached, compact_buffer);
+		const Cache compact{ compact_buffer.data() };
+		std::printf("%zu words, vocabulary %u, raw %zu bytes, compact %zu bytes\n",
+			cached.size(), vocab_size, raw_buffer.size(), compact_buffer.size());
+
+		std::vector<u32> ids;
+		const double raw_seconds = measure([&] {
+			ids.clear();
+			for (const auto word : words) {
+				raw.get_append(word, ids);
+			}
+		});
+		report("raw hits", raw_seconds, 0, words.size());
+		const size_t raw_count = ids.size();
+
+		const double compact_seconds = measure([&] {
+			ids.clear();
+			for (const auto word : words) {
+				compact.get_append(word, ids);
+			}
+		});
+		report("compact hits", compact_seconds, 0, words.size());
+		if (ids.size() != raw_count) {
+			std::printf("Lookups differ\n");
+		}
+	}
+}
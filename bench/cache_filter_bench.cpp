@@ -0,0 +1,81 @@
+#include "bench.h"
+
+#include <cstdio>
+#include <unordered_map>
+
+using namespace bpe;
+using namespace bpe::bench;
+
+// Miss path of the mapped cache with and without the Bloom filter in front of it,
+// then the encoding of the test corpus by the models with and without the filter.
+BPE_BENCHMARK(cache_filter)
+{
+	// Every other word is cached, the rest are the misses.
+	const std::vector<std::string> keys = distinct_words(2 * env_size("BPE_BENCH_CACHE_WORDS", 1 << 19));
+	std::unordered_map<std::string, std::vector<u32>> cached;
+	std::vector<std::string_view> misses;
+	for (size_t i = 0; i < keys.size(); i++) {
+		if (i % 2 == 0) {
+			cached.emplace(keys[i], std::vector<u32>(keys[i].size() / 3 + 1, static_cast<u32>(i)));
+		} else {
+			misses.push_back(keys[i]);
+		}
+	}
+
+	ByteBuffer cache_buffer;
+	Cache::write_to_buffer(cached, cache_buffer);
+	const Cache cache{ cache_buffer.data() };
+
+	std::vector<std::string_view> cached_words;
+	for (const auto& [word, ids] : cached) {
+		cached_words.push_back(word);
+	}
+	ByteBuffer filter_buffer;
+	MappedBloomFilter::write_to_buffer(cached_words, 10, filter_buffer);
+	MappedBloomFilter filter;
+	filter.attach(filter_buffer.data());
+
+	size_t false_positives = 0;
+	for (const auto word : misses) {
+		false_positives += filter.may_contain(word);
+	}
+	std::printf("%zu cached words, filter %zu bytes, %.2f%% false positives\n",
+		cached.size(), filter_buffer.size(), 100.0 * static_cast<double>(false_positives) / static_cast<double>(misses.size()));
+
+	size_t found = 0;
+	const double cache_seconds = measure([&] {
+		found = 0;
+		for (const auto word : misses) {
+			found += cache.find(word) != nullptr;
+		}
+	});
+	report("cache misses", cache_seconds, 0, misses.size());
+
+	const double filter_seconds = measure([&] {
+		found = 0;
+		for (const auto word : misses) {
+			if (filter.may_contain(word)) {
+				found += cache.find(word) != nullptr;
+			}
+		}
+	});
+	report("filter + cache misses", filter_seconds, 0, misses.size());
+	if (found != 0) {
+		std::printf("Misses found\n");
+	}
+
+	// Whole encoding, the test corpus words are mostly cached or short.
+	TokenizerTrainer::Config config;
+	config.size = 16384;
+	config.cache_size = 4096;
+	const auto without_filter = train_tokenizer(config);
+	config.cache_filter_bits = 10;
+	const auto with_filter = train_tokenizer(config);
+
+	const std::string text = replicate(load_test_corpus(), 16 << 20);
+	std::vector<u32> ids;
+	const double without_seconds = measure([&] { ids = without_filter->tokenizer.encode(text); });
+	report("encode without filter", without_seconds, text.size(), ids.size());
+	const double with_seconds = measure([&] { ids = with_filter->tokenizer.encode(text); });
+	report("encode with filter", with_seconds, text.size(), ids.size());
+}
@@ -0,0 +1,46 @@
+#include "bench.h"
+
+#include <cstdio>
+
+using namespace bpe;
+using namespace bpe::bench;
+
+// Decoding of the encoded test corpus: the whole text, the short sequences into the reused string
+// and the same sequences as the batch.
+BPE_BENCHMARK(decode)
+{
+	TokenizerTrainer::Config config;
+	config.size = 16384;
+	config.cache_size = 1000;
+	const auto trained = train_tokenizer(config);
+	const Tokenizer& tokenizer = trained->tokenizer;
+
+	const std::string text = replicate(load_test_corpus(), 64 << 20);
+	const std::vector<u32> ids = tokenizer.encode(text);
+
+	std::string decoded;
+	const double text_seconds = measure([&] { decoded = tokenizer.decode(ids); });
+	report("decode text", text_seconds, decoded.size(), ids.size());
+	if (decoded != text) {
+		std::printf("Decoded text differs\n");
+	}
+
+	// Generated sequences are short.
+	static constexpr size_t sequence_size = 32;
+	std::vector<std::span<const u32>> sequences;
+	for (size_t pos = 0; pos < ids.size(); pos += sequence_size) {
+		sequences.push_back(std::span<const u32>{ ids }.subspan(pos, std::min(sequence_size, ids.size() - pos)));
+	}
+
+	const double into_seconds = measure([&] {
+		for (const auto sequence : sequences) {
+			decoded.clear();
+			tokenizer.decode_into(sequence, decoded);
+		}
+	});
+	report("decode_into sequences", into_seconds, text.size(), ids.size());
+
+	DecodedBatch batch;
+	const double batch_seconds = measure([&] { batch = tokenizer.decode_batch(sequences); });
+	report("decode_batch sequences", batch_seconds, batch.text.size(), ids.size());
+}
@@ -0,0 +1,98 @@
+#include "bench.h"
+#include "thread_pool.h"
+
+#include <cstdio>
+#include <thread>
+
+using namespace bpe;
+using namespace bpe::bench;
+
+// Scaling of the single text encoding with the number of threads.
+// The test corpus is replicated up to BPE_BENCH_CORPUS_MB megabytes (1 GB by default).
+BPE_BENCHMARK(encode_parallel_scaling)
+{
+	TokenizerTrainer::Config config;
+	config.size = 16384;
+	config.cache_size = 1000;
+	const auto trained = train_tokenizer(config);
+	const Tokenizer& tokenizer = trained->tokenizer;
+
+	const std::string text = replicate(load_test_corpus(), env_size("BPE_BENCH_CORPUS_MB", 1024) << 20);
+
+	const size_t max_threads = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+	ThreadPool pool{ max_threads };
+
+	std::vector<size_t> thread_counts;
+	for (size_t threads = 1; threads < max_threads; threads *= 2) {
+		thread_counts.push_back(threads);
+	}
+	thread_counts.push_back(max_threads);
+
+	const std::vector<u32> serial = tokenizer.encode(text);
+	double serial_seconds = 0;
+	for (const size_t threads : thread_counts) {
+		EncodeOptions options;
+		options.threads = threads;
+		options.pool = &pool;
+
+		std::vector<u32> ids;
+		const double seconds = measure([&] { ids = tokenizer.encode(text, options); }, 0);
+		if (ids != serial) {
+			std::printf("Output of %zu threads differs from the serial encoding\n", threads);
+			return;
+		}
+
+		if (threads == 1) {
+			serial_seconds = seconds;
+		}
+		report("threads=" + std::to_string(threads), seconds, text.size(), ids.size());
+		std::printf("%48s %12.2fx\n", "speedup", serial_seconds / seconds);
+	}
+}
+
+// Token counting and the truncated encoding against the full encoding of the replicated corpus.
+BPE_BENCHMARK(count_tokens)
+{
+	TokenizerTrainer::Config config;
+	config.size = 16384;
+	config.cache_size = 4096;
+	const auto trained = train_tokenizer(config);
+	const Tokenizer& tokenizer = trained->tokenizer;
+
+	const std::string text = replicate(load_test_corpus(), 64 << 20);
+
+	std::vector<u32> ids;
+	const double encode_seconds = measure([&] { ids = tokenizer.encode(text); });
+	report("encode", encode_seconds, text.size(), ids.size());
+
+	size_t count = 0;
+	const double count_seconds = measure([&] { count = tokenizer.count_tokens(text); });
+	report("count_tokens", count_seconds, text.size(), count);
+	if (count != ids.size()) {
+		std::printf("Token count differs\n");
+	}
+
+	std::vector<u32> prefix;
+	const double prefix_seconds = measure([&] { prefix = tokenizer.encode_prefix(text, 4096); });
+	report("encode_prefix 4096", prefix_seconds, 0, prefix.size());
+}
+
+// Encoding of the replicated corpus to the wide and the narrow ids.
+BPE_BENCHMARK(encode_narrow_ids)
+{
+	TokenizerTrainer::Config config;
+	config.size = 16384;
+	config.cache_size = 4096;
+	const auto trained = train_tokenizer(config);
+	const Tokenizer& tokenizer = trained->tokenizer;
+
+	const std::string text = replicate(load_test_corpus(), 64 << 20);
+
+	std::vector<u32> wide;
+	const double wide_seconds = measure([&] { wide = tokenizer.encode(text); });
+	report("encode u32", wide_seconds, text.size(), wide.size());
+	std::vector<u16> narrow;
+	const double narrow_seconds = measure([&] { narrow = tokenizer.encode<u16>(text); });
+	report("encode u16", narrow_seconds, text.size(), narrow.size());
+	std::printf("ids: u32 %zu bytes, u16 %zu bytes\n", wide.size() * sizeof(u32), narrow.size() * sizeof(u16));
+}
@@ -0,0 +1,78 @@
+#include "bench.h"
+
+#include <cstdio>
+#include <unordered_map>
+
+using namespace bpe;
+using namespace bpe::bench;
+
+// Build time and lookups of the corpus words in all MappedMap layouts, hits and misses separately.
+BPE_BENCHMARK(mapped_map)
+{
+	using Chained = MappedMap<std::string_view, std::vector<u32>, DefaultMapConfig<std::string_view, std::vector<u32>,
+		std::hash<std::string_view>, std::equal_to<std::string_view>, PaddedStringSerializer>>;
+	using Swiss = MappedMap<std::string_view, std::vector<u32>, DefaultMapConfig<std::string_view, std::vector<u32>,
+		StringHash, std::equal_to<std::string_view>, PaddedStringSerializer, DataSerializer<std::vector<u32>>,
+		MapLayout::swiss>>;
+	using Perfect = MappedMap<std::string_view, std::vector<u32>, DefaultMapConfig<std::string_view, std::vector<u32>,
+		StringHash, std::equal_to<std::string_view>, PaddedStringSerializer, DataSerializer<std::vector<u32>>,
+		MapLayout::perfect>>;
+
+	// Every other word is stored in the map, the rest are looked up as misses.
+	const std::vector<std::string> keys = distinct_words(env_size("BPE_BENCH_MAP_WORDS", 1 << 20));
+	std::unordered_map<std::string, std::vector<u32>> stored;
+	std::vector<std::string_view> hits;
+	std::vector<std::string_view> misses;
+	for (size_t i = 0; i < keys.size(); i++) {
+		if (i % 2 == 0) {
+			stored.emplace(keys[i], std::vector<u32>(keys[i].size() / 3 + 1, static_cast<u32>(i)));
+			hits.push_back(keys[i]);
+		} else {
+			misses.push_back(keys[i]);
+		}
+	}
+
+	auto build = [&](auto write, std::string_view name) {
+		ByteBuffer buffer;
+		const double seconds = measure([&] {
+			buffer.clear();
+			write(stored, buffer);
+		}, 0);
+		report(name, seconds, 0, stored.size());
+		return buffer;
+	};
+	const ByteBuffer chained_buffer = build(
+		[](const auto& data, ByteBuffer& buffer) { Chained::write_to_buffer(data, buffer); }, "chained build");
+	const ByteBuffer swiss_buffer = build(
+		[](const auto& data, ByteBuffer& buffer) { Swiss::write_to_buffer(data, buffer); }, "swiss build");
+	const ByteBuffer perfect_buffer = build(
+		[](const auto& data, ByteBuffer& buffer) { Perfect::write_to_buffer(data, buffer); }, "perfect build");
+	build([](const auto& data, ByteBuffer& buffer) { Perfect::write_to_buffer(data, buffer, &ThreadPool::shared()); },
+		"perfect parallel build");
+	const Chained chained{ chained_buffer.data() };
+	const Swiss swiss{ swiss_buffer.data() };
+	const Perfect perfect{ perfect_buffer.data() };
+	std::printf("%zu words, chained %zu bytes, swiss %zu bytes, perfect %zu bytes\n",
+		stored.size(), chained_buffer.size(), swiss_buffer.size(), perfect_buffer.size());
+
+	auto run = [](const auto& map, const std::vector<std::string_view>& keys, std::string_view name) {
+		size_t found = 0;
+		const double seconds = measure([&] {
+			found = 0;
+			for (const auto key : keys) {
+				found += map.get_view(key).size();
+			}
+		});
+		report(name, seconds, 0, keys.size());
+		return found;
+	};
+
+	const size_t found = run(chained, hits, "chained hits");
+	if (run(swiss, hits, "swiss hits") != found || run(perfect, hits, "perfect hits") != found) {
+		std::printf("Lookups differ\n");
+	}
+	if (run(chained, misses, "chained misses") != 0 || run(swiss, misses, "swiss misses") != 0
+		|| run(perfect, misses, "perfect misses") != 0) {
+		std::printf("Misses found\n");
+	}
+}
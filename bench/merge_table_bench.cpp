@@ -0,0 +1,93 @@
+#include "bench.h"
+
+#include <cstdio>
+#include <random>
+
+using namespace bpe;
+using namespace bpe::bench;
+
+// Merge lookups of the hash MergeTable against the MergeRanksMappedTable, then the whole encoding with both.
+BPE_BENCHMARK(merge_table)
+{
+	TokenizerTrainer::Config config;
+	config.size = 16384;
+	config.cache_size = 0;
+	TokenizerTrainer trainer{ config };
+	trainer.train_on_corpus(std::string(TEST_DATA_DIR) + "/test_corpus.txt", 0);
+	trainer.build_bpe();
+	const auto& merges = trainer.get_merge_table();
+	const size_t token_count = trainer.get_id_to_seq().size();
+
+	ByteBuffer table_buffer;
+	MergeTable::write_to_buffer(merges, table_buffer);
+	const MergeTable table{ table_buffer.data() };
+
+	ByteBuffer ranks_buffer;
+	MergeRanksMappedTable::write_to_buffer(merges, token_count, ranks_buffer);
+	MergeRanksMappedTable ranks;
+	ranks.attach(ranks_buffer.data());
+
+	// Half of the pairs are merges, the others are random pairs of tokens.
+	std::vector<Pair> pairs;
+	for (const auto& [pair, rank] : merges) {
+		pairs.push_back(pair);
+	}
+	std::mt19937 generator{ 1 };
+	std::uniform_int_distribution<u32> token{ 0, static_cast<u32>(token_count - 1) };
+	const size_t merge_count = pairs.size();
+	for (size_t i = 0; i < merge_count; i++) {
+		pairs.emplace_back(token(generator), token(generator));
+	}
+	std::shuffle(pairs.begin(), pairs.end(), generator);
+
+	for (const auto& pair : pairs) {
+		const std::optional<u32> expected = table.contains(pair) ? std::optional<u32>{ table.get(pair) } : std::nullopt;
+		if (ranks.get(pair.first, pair.second) != expected) {
+			std::printf("Lookups differ\n");
+			return;
+		}
+	}
+
+	u64 checksum = 0;
+	const double table_seconds = measure([&] {
+		checksum = 0;
+		for (const auto& pair : pairs) {
+			if (table.contains(pair)) {
+				checksum += table.get(pair);
+			}
+		}
+	});
+	report("MergeTable contains + get", table_seconds, 0, pairs.size());
+
+	u64 ranks_checksum = 0;
+	const double ranks_seconds = measure([&] {
+		ranks_checksum = 0;
+		for (const auto& pair : pairs) {
+			ranks_checksum += ranks.get(pair.first, pair.second).value_or(0);
+		}
+	});
+	report("MergeRanksMappedTable get", ranks_seconds, 0, pairs.size());
+	if (checksum != ranks_checksum) {
+		std::printf("Checksums differ\n");
+	}
+
+	// Encoding of the text without the cache, so every word is merged.
+	const ByteBuffer ranks_model_buffer = trainer.save();
+	Tokenizer ranks_tokenizer;
+	ranks_tokenizer.attach(ranks_model_buffer.data(), ranks_model_buffer.size());
+
+	config.merge_ranks = false;
+	TokenizerTrainer table_trainer{ config };
+	table_trainer.train_on_corpus(std::string(TEST_DATA_DIR) + "/test_corpus.txt", 0);
+	table_trainer.build_bpe();
+	const ByteBuffer table_model_buffer = table_trainer.save();
+	Tokenizer table_tokenizer;
+	table_tokenizer.attach(table_model_buffer.data(), table_model_buffer.size());
+
+	const std::string text = replicate(load_test_corpus(), 16 << 20);
+	std::vector<u32> ids;
+	const double table_encode_seconds = measure([&] { ids = table_tokenizer.encode(text); });
+	report("encode with MergeTable", table_encode_seconds, text.size(), ids.size());
+	const double ranks_encode_seconds = measure([&] { ids = ranks_tokenizer.encode(text); });
+	report("encode with MergeRanksMappedTable", ranks_encode_seconds, text.size(), ids.size());
+}
@@ -0,0 +1,162 @@
+#include "bench.h"
+
+#include <cstdio>
+#include <unordered_set>
+
+using namespace bpe;
+using namespace bpe::bench;
+
+// Size of the text for the pre-tokenizer benchmarks.
+static constexpr size_t pretokenizer_text_size = 64 << 20;
+
+// Initial implementation of split_by_words: the space intervals pass, the split points pass,
+// then prefix, body and suffix of every word with the std::unordered_set punctuation lookup.
+static bool reference_is_punctuation(char c)
+{
+	static const std::unordered_set<char> punctuations_set{ ',', '.', '?', '-', '"', ':', ';', '(', ')', '[', ']', '<', '>', '{', '}', '%', '\'', '!', '/', '#', '$', '^', '&', '*', '~', '|', '+', '=', '_' };
+	return punctuations_set.find(c) != punctuations_set.end();
+}
+
+static bool reference_is_space(char c)
+{
+	return c == ' ' || c == '\r' || c == '\n' || c == '\t';
+}
+
+static PrefixBodySuffix reference_split_prefix_body_suffix(std::string_view word)
+{
+	size_t begin = 0;
+	while (begin < word.size() && reference_is_space(word[begin])) {
+		begin++;
+	}
+	if (begin == word.size()) {
+		return {"", word, ""};
+	}
+	size_t body_start = begin;
+	while (body_start < word.size() && reference_is_punctuation(word[body_start])) {
+		body_start++;
+	}
+	if (body_start == word.size()) {
+		return {"", word, ""};
+	}
+	size_t end = word.size();
+	while (end > body_start && reference_is_space(word[end - 1])) {
+		end--;
+	}
+	if (end == body_start) {
+		return {"", word, ""};
+	}
+	size_t body_end = end;
+	while (body_end > body_start && reference_is_punctuation(word[body_end - 1])) {
+		body_end--;
+	}
+	if (body_end == body_start) {
+		return {"", word, ""};
+	}
+	const std::string_view prefix = (body_start > begin) ? word.substr(0, body_start) : "";
+	const std::string_view suffix = (body_end < end) ? word.substr(body_end, word.size()) : "";
+	const std::string_view body = word.substr(prefix.size(), word.size() - prefix.size() - suffix.size());
+	return {prefix, body, suffix};
+}
+
+static std::vector<std::string_view> reference_split_by_words(std::string_view text)
+{
+	std::vector<std::pair<size_t, size_t>> spaces;
+	// Start of the current run of spaces, npos outside of the runs.
+	size_t begin = std::string_view::npos;
+	for (size_t i = 0; i < text.size(); i++) {
+		if (reference_is_space(text[i])) {
+			if (begin == std::string_view::npos) {
+				begin = i;
+			}
+			continue;
+		}
+		if (begin != std::string_view::npos) {
+			spaces.emplace_back(begin, i);
+			begin = std::string_view::npos;
+		}
+	}
+
+	std::vector<size_t> split_points;
+	split_points.push_back(0);
+	for (const auto& space : spaces) {
+		for (size_t i = space.first; i < space.second; i++) {
+			split_points.push_back(i);
+		}
+	}
+	split_points.push_back(text.size());
+
+	std::vector<std::string_view> words;
+	words.reserve(split_points.size());
+	for (size_t i = 0; i + 1 < split_points.size(); i++) {
+		const std::string_view word{ text.data() + split_points[i], split_points[i + 1] - split_points[i] };
+		const auto [prefix, body, suffix] = reference_split_prefix_body_suffix(word);
+		for (const auto part : { prefix, body, suffix }) {
+			if (!part.empty()) {
+				words.push_back(part);
+			}
+		}
+	}
+	return words;
+}
+
+// Initial three-pass split against the single-pass table-driven split with the SIMD space search.
+BPE_BENCHMARK(split_by_words)
+{
+	const std::string text = replicate(load_test_corpus(), pretokenizer_text_size);
+
+	std::vector<std::string_view> words;
+	split_by_words(text, words);
+	if (words != reference_split_by_words(text)) {
+		std::printf("split_by_words differs from the reference\n");
+		return;
+	}
+
+	report("reference", measure([&] { words = reference_split_by_words(text); }), text.size(), words.size());
+	report("split_by_words", measure([&] { words = split_by_words(text); }), text.size(), words.size());
+	report("split_by_words (reused vector)", measure([&] { split_by_words(text, words); }), text.size(), words.size());
+
+	size_t total_size = 0;
+	report("words (lazy)", measure([&] {
+		total_size = 0;
+		for (const auto word : bpe::words(text)) {
+			total_size += word.size();
+		}
+	}), text.size(), words.size());
+	if (total_size != text.size()) {
+		std::printf("words() lost some text\n");
+	}
+}
+
+// Space search kernels. Dense spaces of the corpus text and sparse spaces of the glued words.
+BPE_BENCHMARK(find_space)
+{
+	const std::string corpus = replicate(load_test_corpus(), pretokenizer_text_size);
+	std::string glued = corpus;
+	for (size_t i = 0; i < glued.size(); i++) {
+		if (is_space(glued[i]) && i % 256 != 0) {
+			glued[i] = '_';
+		}
+	}
+
+	static constexpr std::pair<SimdLevel, const char*> levels[] = {
+		{ SimdLevel::scalar, "scalar" },
+		{ SimdLevel::sse2, "sse2" },
+		{ SimdLevel::avx2, "avx2" },
+	};
+
+	for (const auto& [name, text] : { std::pair<const char*, const std::string*>{ "dense", &corpus }, { "sparse", &glued } }) {
+		for (const auto& [level, level_name] : levels) {
+			if (level > detect_simd_level()) {
+				continue;
+			}
+			size_t count = 0;
+			const double seconds = measure([&] {
+				count = 0;
+				for (size_t i = find_space(*text, 0, level); i < text->size(); i = find_space(*text, i + 1, level)) {
+					count++;
+				}
+			});
+			report(std::string(name) + " " + level_name, seconds, text->size(), count);
+		}
+	}
+}
@@ -0,0 +1,40 @@
+#include "bench.h"
+
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <thread>
+
+using namespace bpe;
+using namespace bpe::bench;
+
+// Word counting of train_on_corpus on the replicated test corpus with one and all hardware threads.
+BPE_BENCHMARK(corpus_vocabulary)
+{
+	const std::string text = replicate(load_test_corpus(), env_size("BPE_BENCH_VOCAB_MB", 256) << 20);
+	const auto path = std::filesystem::temp_directory_path() / "bpe_bench_corpus_vocabulary.txt";
+	{
+		std::ofstream file(path, std::ios::binary);
+		file.write(text.data(), static_cast<std::streamsize>(text.size()));
+	}
+
+	const u32 hardware_threads = std::max(std::thread::hardware_concurrency(), 1u);
+	for (const u32 max_worker : { 1u, hardware_threads }) {
+		size_t words = 0;
+		size_t bytes = 0;
+		const double seconds = measure([&] {
+			TokenizerTrainer::Config config;
+			config.max_worker = max_worker;
+			TokenizerTrainer trainer{ config };
+			trainer.train_on_corpus(path.string(), 0);
+			words = trainer.get_word_vocab().size();
+			bytes = trainer.get_word_vocab().get_memory_usage();
+		}, 0);
+		char name[64];
+		std::snprintf(name, sizeof(name), "train_on_corpus %u threads", max_worker);
+		report(name, seconds, text.size());
+		std::printf("  %zu distinct words, %.1f counter bytes per word\n", words,
+			static_cast<double>(bytes) / static_cast<double>(std::max<size_t>(words, 1)));
+	}
+	std::filesystem::remove(path);
+}
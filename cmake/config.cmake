@@ -26,3 +26,6 @@ endif(NOT APPLE)
 
 # Add our tests to default build
 set(BPE_TESTS 1)
+
+# Add our benchmarks to default build
+set(BPE_BENCHMARKS 1)
@@ -2,12 +2,25 @@
 
 #include <utility>
 #include <vector>
+#include <memory>
+#include <stdexcept>
+#include <filesystem>
 #include <unordered_map>
 #include <string>
 #include <tuple>
 #include <optional>
+#include <iterator>
+#include <span>
+#include <limits>
+#include <type_traits>
 
 #include "mapped_storages.h"
+#include "model_file.h"
+#include "pretokenizer.h"
+#include "word_cache.h"
+#include "word_counter.h"
+#include "word_runs.h"
+#include "word_sketch.h"
 
 namespace bpe {
 
@@ -16,19 +29,94 @@ using PrefixBodySuffix = std::tuple<std::string_view, std::string_view, std::str
 // Split word str to prefix, body, suffix with respect to the start and finish spaces.
 PrefixBodySuffix split_prefix_body_suffix(std::string_view word);
 
+// Forward iterator over the words of the text, see split_by_words().
+// Words are found on demand, the iterator uses O(1) memory.
+class WordIterator {
+public:
+	using iterator_category = std::forward_iterator_tag;
+	using value_type = std::string_view;
+	using difference_type = std::ptrdiff_t;
+	using pointer = const std::string_view*;
+	using reference = const std::string_view&;
+
+	WordIterator() : tail(0), next(0), part(0), part_count(0) {}
+	explicit WordIterator(std::string_view _text);
+
+	reference operator*() const { return parts[part]; }
+	pointer operator->() const { return &parts[part]; }
+
+	WordIterator& operator++()
+	{
+		part++;
+		if (part == part_count) {
+			next_segment();
+		}
+		return *this;
+	}
+	WordIterator operator++(int)
+	{
+		WordIterator prev = *this;
+		++*this;
+		return prev;
+	}
+
+	bool operator==(const WordIterator& other) const
+		{ return part_count == other.part_count && next == other.next && part == other.part; }
+	bool operator==(std::default_sentinel_t) const { return part_count == 0; }
+
+private:
+	std::string_view text;
+	// Text without the trailing spaces.
+	size_t tail;
+	// Begin of the next segment between the split points, text.size() + 1 after the last one.
+	size_t next;
+	// Non-empty prefix, body and suffix of the current segment.
+	std::array<std::string_view, 3> parts;
+	size_t part;
+	size_t part_count;
+
+	void next_segment();
+};
+
+// Range of the words of the text.
+struct Words {
+	std::string_view text;
+
+	WordIterator begin() const { return WordIterator{ text }; }
+	std::default_sentinel_t end() const { return std::default_sentinel; }
+};
+
+// Lazy split text by words. Initial spaces will be glued to the right word.
+inline Words words(std::string_view text) { return Words{ text }; }
+
 // Split text by words. Initial spaces will be glued to the right word.
 std::vector<std::string_view> split_by_words(std::string_view text);
+// Split text by words into the words vector. The vector is cleared, its capacity is reused.
+void split_by_words(std::string_view text, std::vector<std::string_view>& words);
+
+// Find the first position >= pos where the text can be cut into two parts, which are split by words
+// independently with the same result as the whole text. Return text.size() if there is no such position.
+size_t find_word_boundary(std::string_view text, size_t pos);
 
 // Pair of two consecutive indices.
 using Pair = std::pair<u32, u32>;
 
 // Hash for the pair.
 struct PairHash {
+	// Identifier of the hash function stored in the files.
+	static constexpr u32 id = 2;
+
 	size_t operator() (const Pair& pair) const { return pair.first | (static_cast<size_t>(pair.second) << 32); }
 };
 
-using MergeTable = MappedMap<Pair, u32, DefaultMapConfig<Pair, u32, PairHash>>;
-using Cache = MappedMap<std::string_view, std::vector<u32>, DefaultMapConfig<std::string_view, std::vector<u32>>>;
+// Merge lookups read the single slot of the perfect hash.
+using MergeTable = MappedMap<Pair, u32, DefaultMapConfig<Pair, u32, PairHash, std::equal_to<Pair>,
+	DataSerializer<Pair>, DataSerializer<u32>, MapLayout::perfect>>;
+// Cached ids are stored by the compact codec, so a cached word costs about 2 bytes per token.
+// Most looked up words are missing in the cache, the swiss layout rejects them by the slot tags.
+using Cache = MappedMap<std::string_view, std::vector<u32>, DefaultMapConfig<std::string_view, std::vector<u32>,
+	StringHash, std::equal_to<std::string_view>, DataSerializer<std::string_view>, CompactIdsSerializer,
+	MapLayout::swiss>>;
 
 // Bpe tokenizer trainer.
 class TokenizerTrainer {
@@ -42,14 +130,50 @@ public:
 		u32 max_worker;
 		// Bpe cache size. Cache is the map of the cache_size most frequent words into the precalculated ids.
 		size_t cache_size;
+		// Save the merge ranks table for the faster merge lookups.
+		bool merge_ranks;
+		// Save the checksum of the model.
+		bool checksum;
+		// Bits per word of the Bloom filter of the cache words, 0 - no filter. The filter rejects the cache misses
+		// reading one cache line, it pays off for the large caches when most of the words miss the cache.
+		// 10 bits give about 1% of false positives.
+		size_t cache_filter_bits;
+		// Memory budget of the word counts of train_on_* methods in bytes, 0 - no limit. Counts over the budget
+		// are spilled as the sorted runs into spill_directory and merged by build_bpe(), which keeps only
+		// the words with min_count. Sorting the counts for the spill takes 24 more bytes per word.
+		size_t memory_budget;
+		// Directory of the spilled runs, empty - the system temporary directory.
+		std::filesystem::path spill_directory;
+		// Number of the most frequent words counted approximately in the fixed memory, 0 - exact counting.
+		// The words are found by the Count-Min sketch of sketch_width x sketch_depth counters per worker,
+		// see WordSketch. The long tail of the words is lost, so min_count should leave out most of the words.
+		// Can not be combined with memory_budget, the constructor throws std::invalid_argument.
+		size_t sketch_words;
+		// Counters per sketch row. The counts exceed the true ones by at most e / sketch_width
+		// of all words of the corpus.
+		size_t sketch_width;
+		// Sketch rows. The counts exceed the error bound with probability exp(-sketch_depth).
+		size_t sketch_depth;
 
-		Config() : size(256), min_count(1), max_worker(1), cache_size(0) {}
+		Config() : size(256), min_count(1), max_worker(1), cache_size(0), merge_ranks(true), checksum(true),
+			cache_filter_bits(0), memory_budget(0), sketch_words(0), sketch_width(1 << 20), sketch_depth(4) {}
 	};
 
-	explicit TokenizerTrainer(const Config& _config) : config(_config) 
+	explicit TokenizerTrainer(const Config& _config) :
+		config(_config),
+		word_vocab(_config.max_worker),
+		spiller(_config.memory_budget > 0
+			? std::make_unique<WordRunSpiller>(_config.spill_directory, _config.memory_budget)
+			: nullptr),
+		sketch(_config.sketch_words > 0
+			? std::make_unique<WordSketch>(_config.sketch_words, _config.sketch_width, _config.sketch_depth)
+			: nullptr)
 	{ 
 		assert(config.size >= byte_count); 
 		assert(config.max_worker >= 1);
+		if (config.memory_budget > 0 && config.sketch_words > 0) {
+			throw std::invalid_argument("TokenizerTrainer: memory_budget and sketch_words can not be combined");
+		}
 	}
 
 	// Train bpe methods. These methods can be called multiple times.
@@ -64,6 +188,13 @@ public:
 
 	const std::unordered_map<Pair, u32, PairHash>& get_merge_table() const { return merge_table; }
 	const std::vector<std::string>& get_id_to_seq() const { return id_to_seq; }
+	// Counts of the words of the train_on_* methods.
+	// With the memory budget the counts over it are spilled to the runs: the vocabulary is partial, and empty
+	// after the multi-threaded train_on_corpus(), until build_bpe() merges the runs and keeps only the words
+	// with min_count. With the sketch the vocabulary is empty until build_bpe() fills it from the sketch.
+	const ShardedWordCounter& get_word_vocab() const { return word_vocab; }
+	// Approximate counts with their error bounds, nullptr for the exact counting.
+	const WordSketch* get_word_sketch() const { return sketch.get(); }
 
 	// Save tokenizer to a byte array.
 	std::vector<u8> save() const;
@@ -94,8 +225,12 @@ private:
 	};
 	using Vocab = std::vector<VocabEntry>;
 
-	// Vocabulary.
-	std::unordered_map<std::string, u64> word_vocab;
+	// Vocabulary, one shard per worker.
+	ShardedWordCounter word_vocab;
+	// Runs of the word counts over the memory budget, nullptr if there is no budget.
+	std::unique_ptr<WordRunSpiller> spiller;
+	// Approximate counts of the most frequent words, nullptr for the exact counting.
+	std::unique_ptr<WordSketch> sketch;
 	Vocab vocab;
 
 	void train_bpe();
@@ -103,40 +238,219 @@ private:
 	void build_vocabulary_on_text(const std::string& text);
 	void init_id_to_seq();
 	void create_vocab_from_word_vocab();
+	void merge_spilled_word_vocab();
+	void fill_word_vocab_from_sketch();
 	void build_vocabulary(const std::string& path, size_t symbols_count);
 };
 
 
+class ThreadPool;
+
+// Type of the output token ids: u32, or u16 for the vocabularies of at most 65536 tokens.
+template<typename Id>
+concept TokenId = std::is_same_v<Id, u32> || std::is_same_v<Id, u16>;
+
+// Token ids of the batch of texts in the ragged layout.
+template<TokenId Id>
+struct BasicEncodedBatch {
+	// Ids of all texts, one after another.
+	std::vector<Id> ids;
+	// Ids of the text i are ids[offsets[i], offsets[i + 1]). Size is the number of texts + 1.
+	std::vector<size_t> offsets;
+
+	// Number of texts.
+	size_t size() const { return offsets.empty() ? 0 : offsets.size() - 1; }
+	// Ids of the single text.
+	std::span<const Id> operator[](size_t index) const
+		{ return std::span<const Id>{ ids }.subspan(offsets[index], offsets[index + 1] - offsets[index]); }
+};
+
+using EncodedBatch = BasicEncodedBatch<u32>;
+
+// Texts of the batch of decoded id sequences in the ragged layout.
+struct DecodedBatch {
+	// Texts of all sequences, one after another.
+	std::string text;
+	// Text of the sequence i is text[offsets[i], offsets[i + 1]). Size is the number of sequences + 1.
+	std::vector<size_t> offsets;
+
+	// Number of sequences.
+	size_t size() const { return offsets.empty() ? 0 : offsets.size() - 1; }
+	// Text of the single sequence.
+	std::string_view operator[](size_t index) const
+		{ return std::string_view{ text }.substr(offsets[index], offsets[index + 1] - offsets[index]); }
+};
+
+// Options of the single text encoding.
+struct EncodeOptions {
+	// Maximum number of threads encoding the text. The text is cut at word boundaries into that many parts.
+	size_t threads = 1;
+	// Pool encoding the parts, nullptr for the shared pool.
+	ThreadPool* pool = nullptr;
+	// Texts shorter than this are encoded on the calling thread.
+	size_t min_parallel_size = 1 << 20;
+};
+
+// Reusable working memory for the Tokenizer encoding.
+// Once the buffers have grown to the largest text, encoding does not allocate.
+// Scratch must not be shared between threads.
+class EncodeScratch {
+public:
+	EncodeScratch() = default;
+
+private:
+	friend class Tokenizer;
+
+	// Symbol of the word being encoded.
+	struct Symbol {
+		// Token id, none if the symbol was merged into its left neighbor.
+		u32 id;
+		// Previous alive symbol.
+		u32 prev;
+		// Next alive symbol.
+		u32 next;
+	};
+
+	// Merge candidate for the pair of neighboring symbols.
+	struct Candidate {
+		// Merge rank which is the id of the merged token.
+		u32 new_id;
+		// Position of the left symbol.
+		u32 left;
+		// Position of the right symbol.
+		u32 right;
+		// Ids of the symbols when the candidate was created.
+		u32 left_id;
+		u32 right_id;
+
+		// The earliest merge first, leftmost position on ties.
+		bool operator>(const Candidate& other) const
+			{ return new_id != other.new_id ? new_id > other.new_id : left > other.left; }
+	};
+
+	std::vector<Symbol> symbols;
+	std::vector<Candidate> heap;
+	// Ids of the single word for the span output.
+	std::vector<u32> word_ids;
+};
+
 // Byte pair encoding on UTF-8 text.
 class Tokenizer {
 public:
-	explicit Tokenizer(const std::filesystem::path& path);
+	explicit Tokenizer(const std::filesystem::path& path, const MapOptions& options = {});
 	Tokenizer() = default;
 
-	// Load tokenizer from memory.
-	void load(const std::filesystem::path& path);
-	// Attach external buffer. Do not copy data!
-	void attach(const u8* data);
+	// Map tokenizer file to memory and attach it. The file is not copied.
+	// Throws std::runtime_error if the file is not the tokenizer model.
+	void load(const std::filesystem::path& path, const MapOptions& options = {});
+	// Attach external buffer, its size is read from the model header. Do not copy data!
+	// The buffer must be aligned to 16 bytes. Return false if the buffer is not the tokenizer model.
+	bool attach(const u8* data);
+	// Attach external buffer of the known size. Do not copy data!
+	// The buffer must be aligned to 16 bytes. Return false if the buffer is not the tokenizer model.
+	bool attach(const u8* data, size_t size);
+	// Whether the attached model has the checksum and it matches the model data. Reads the whole model.
+	bool verify_checksum() const { return model.verify_checksum(); }
+
+	// Whether every token id of the attached vocabulary fits the Id type.
+	template<TokenId Id>
+	bool supports_ids() const { return id_to_seq.size() <= size_t{ std::numeric_limits<Id>::max() } + 1; }
+
+	// Encoding methods return the ids of the Id type, u32 by default. They throw std::length_error
+	// if the vocabulary does not fit the Id type, see supports_ids().
 
 	// Encode text.
-	std::vector<u32> encode(std::string_view text) const;
+	template<TokenId Id = u32>
+	std::vector<Id> encode(std::string_view text) const;
+	// Encode text with options. The result is the same as encode(text).
+	template<TokenId Id = u32>
+	std::vector<Id> encode(std::string_view text, const EncodeOptions& options) const;
+	// Encode text and append ids to the end of the ids vector. Uses the thread-local scratch.
+	template<TokenId Id>
+	void encode_into(std::string_view text, std::vector<Id>& ids) const;
+	// Encode text and append ids to the end of the ids vector.
+	template<TokenId Id>
+	void encode_into(std::string_view text, std::vector<Id>& ids, EncodeScratch& scratch) const;
+	// Encode text into the ids span and return the number of tokens in the text.
+	// If the result is greater than ids.size(), only the first ids.size() tokens are written.
+	template<TokenId Id>
+	size_t encode_into(std::string_view text, std::span<Id> ids, EncodeScratch& scratch) const;
+	// Number of tokens of the text, the same as encode(text).size(). Uses the thread-local scratch.
+	// Ids are not stored and the cached words are counted by the stored lengths.
+	size_t count_tokens(std::string_view text) const;
+	// Number of tokens of the text, the same as encode(text).size().
+	size_t count_tokens(std::string_view text, EncodeScratch& scratch) const;
+	// First max_tokens ids of encode(text). Encoding stops at the word which reaches the limit.
+	template<TokenId Id = u32>
+	std::vector<Id> encode_prefix(std::string_view text, size_t max_tokens) const;
+	// Encode the batch of texts in parallel on the shared thread pool.
+	template<TokenId Id = u32>
+	BasicEncodedBatch<Id> encode_batch(std::span<const std::string_view> texts) const;
+	// Encode the batch of texts in parallel on the thread pool.
+	template<TokenId Id = u32>
+	BasicEncodedBatch<Id> encode_batch(std::span<const std::string_view> texts, ThreadPool& pool) const;
+	// Enable the runtime cache of the encoded words which are missing in the mapped cache.
+	// Must not be called concurrently with encoding.
+	void enable_runtime_cache(const WordCache::Config& config);
+	// Runtime cache counters. All zeros if the runtime cache is disabled.
+	WordCache::Stats get_runtime_cache_stats() const;
+
 	// Decode sequence of token ids.
-	std::string decode(const std::vector<u32>& ids) const;
+	std::string decode(std::span<const u32> ids) const;
+	std::string decode(std::span<const u16> ids) const;
+	// Decode sequence of token ids and append the text to the end of the text string.
+	// Token lengths are summed first, so the text grows once.
+	void decode_into(std::span<const u32> ids, std::string& text) const;
+	void decode_into(std::span<const u16> ids, std::string& text) const;
+	// Decode the batch of id sequences into the single text.
+	DecodedBatch decode_batch(std::span<const std::span<const u32>> batch) const;
 	// Decode the single token.
 	std::string_view decode_token(u32 id) const;
 	
 private:
-	// Memory holding all tokenizer data.
-	std::vector<u8> memory;
+	// Mapped file holding all tokenizer data.
+	MappedFile file;
+	// Header and sections of the attached model.
+	ModelFile model;
 	// Tokens sequences.
 	ShortStringsMappedArray id_to_seq;
 	// Merge table.
 	MergeTable merge_table;
+	// Optional merge ranks table, it replaces the merge table lookups when present.
+	MergeRanksMappedTable merge_ranks;
+	// Optional filter of the cache words, it is checked before the cache lookup.
+	MappedBloomFilter cache_filter;
 	// Cache for most frequent words.
 	Cache cache;
+	// Optional runtime cache for words missing in the mapped cache.
+	std::unique_ptr<WordCache> runtime_cache;
 
-	std::vector<u32> encode_word(std::string_view text) const;
+	// Throw std::length_error if the vocabulary does not fit the Id type.
+	template<TokenId Id>
+	void check_ids() const;
+	// Encode the single word using the caches and append ids to the end of the ids vector.
+	template<TokenId Id>
+	void encode_cached_word(std::string_view word, std::vector<Id>& ids, EncodeScratch& scratch) const;
+	// Encode the single word and append ids to the end of the ids vector.
+	template<TokenId Id>
+	void encode_word(std::string_view text, std::vector<Id>& ids, EncodeScratch& scratch) const;
+	// Encode the single word missing in the mapped cache and append ids to the end of the ids vector.
+	template<TokenId Id>
+	void encode_uncached_word(std::string_view word, std::vector<Id>& ids, EncodeScratch& scratch) const;
+	// Find the serialized cached ids of the word. Return nullptr if the word is not cached.
+	const u8* find_cached(std::string_view word) const;
+	// Number of tokens of the single word. Cached ids are not decoded.
+	size_t count_word_tokens(std::string_view word, EncodeScratch& scratch) const;
 	std::optional<u32> get_merge_id(u32 first, u32 second) const;
+	// Decode sequence of token ids and append the text to the end of the text string.
+	template<TokenId Id>
+	void decode_ids_into(std::span<const Id> ids, std::string& text) const;
+	// Total length of the token strings.
+	template<TokenId Id>
+	size_t get_decoded_size(std::span<const Id> ids) const;
+	// Copy the token strings to the output, which must have ShortStringsMappedArray::padding bytes after them.
+	template<TokenId Id>
+	void copy_tokens(std::span<const Id> ids, char* output) const;
 };
 
 } // namespace bpe
@@ -0,0 +1,16 @@
+#pragma once
+
+namespace bpe {
+
+// Instruction sets of the SIMD kernels, every level includes the previous ones.
+enum class SimdLevel {
+	scalar,
+	sse2,
+	ssse3,
+	avx2,
+};
+
+// The best instruction set supported by the CPU.
+SimdLevel detect_simd_level();
+
+} // namespace bpe
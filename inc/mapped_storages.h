@@ -11,7 +11,19 @@
 #include <algorithm>
 #include <cstring>
 #include <climits>
-
+#include <iterator>
+#include <optional>
+#include <stdexcept>
+#include <span>
+#include <bit>
+#include <limits>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#define BPE_MAPPED_MAP_SSE2 1
+#include <emmintrin.h>
+#endif
+
+#include "thread_pool.h"
 #include "to.h"
 
 
@@ -22,7 +34,46 @@ using ByteBuffer = std::vector<u8>;
 // Load entire file to a buffer.
 ByteBuffer load_file_to_buffer(const std::filesystem::path& path);
 
+// Options of the file memory mapping.
+struct MapOptions {
+	// Read the whole file into the page cache while mapping (MAP_POPULATE).
+	bool populate = false;
+	// Advise the kernel that the whole file will be needed soon (MADV_WILLNEED).
+	bool will_need = false;
+	// Advise the kernel to back the mapping with huge pages where supported (MADV_HUGEPAGE).
+	bool huge_pages = false;
+	// Advise the kernel that the file will be read sequentially (MADV_SEQUENTIAL).
+	bool sequential = false;
+};
+
+// Read-only memory mapping of the entire file. The mapping is shared with other processes through the page cache.
+// Throws std::system_error if the file can not be mapped.
+class MappedFile {
+public:
+	MappedFile() : mapping(nullptr), mapping_size(0) {}
+	explicit MappedFile(const std::filesystem::path& path, const MapOptions& options = {});
+	~MappedFile() { close(); }
+
+	MappedFile(MappedFile&& other) noexcept;
+	MappedFile& operator=(MappedFile&& other) noexcept;
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	// Mapped bytes, page aligned. nullptr for the empty file.
+	const u8* data() const { return mapping; }
+	size_t size() const { return mapping_size; }
+	bool empty() const { return mapping_size == 0; }
+
+	// Unmap the file.
+	void close();
+
+private:
+	const u8* mapping;
+	size_t mapping_size;
+};
+
 // Class that read typed values from the bytes buffer.
+// Values are copied with memcpy, so the reads are valid at any alignment.
 class BufferReader {
 public:
 	explicit BufferReader(const u8* _data) : data(_data) {}
@@ -34,19 +85,9 @@ public:
 		return *prev; 
 	}
 
-	u16 read_u16() 
-	{
-		const u8* prev = data;
-		data += sizeof(u16);
-		return *reinterpret_cast<const u16*>(prev);
-	}
+	u16 read_u16() { return read<u16>(); }
 
-	u32 read_u32() 
-	{ 
-		const u8* prev = data;
-		data += sizeof(u32);
-		return *reinterpret_cast<const u32*>(prev);
-	}
+	u32 read_u32() { return read<u32>(); }
 
 	std::string_view read_string_view()
 	{
@@ -65,9 +106,12 @@ public:
 	template<typename T>
 	T read()
 	{
-		const u8* prev = data;
+		// Pairs of the integers are not trivially copyable, but have the plain layout.
+		static_assert(std::is_standard_layout_v<T>);
+		T value;
+		::memcpy(static_cast<void*>(&value), data, sizeof(T));
 		data += sizeof(T);
-		return *reinterpret_cast<const T*>(prev);
+		return value;
 	}
 
 	template<typename T>
@@ -114,6 +158,12 @@ public:
 		data += size;
 	}
 
+	void write_bytes(const void* value, size_t size)
+	{
+		::memcpy(data, value, size);
+		data += size;
+	}
+
 	template<typename T>
 	void write(T value)
 	{
@@ -163,14 +213,30 @@ public:
 
 	std::vector<T> read(BufferReader& reader)
 	{
-		const size_t size = reader.read_u32();
 		std::vector<T> result;
-		result.reserve(size);
-		for (size_t i = 0; i < size; i++) {
-			result.push_back(reader.read<T>());
-		}
+		read_append(reader, result);
 		return result;
 	}
+	// Read the vector in place. The elements must be aligned to alignof(T).
+	std::span<const T> read_view(BufferReader& reader)
+	{
+		const size_t size = reader.read_u32();
+		const u8* elements = reader.ptr();
+		assert(reinterpret_cast<uintptr_t>(elements) % alignof(T) == 0);
+		reader.skip_count(size * sizeof(T));
+		return std::span<const T>(reinterpret_cast<const T*>(elements), size);
+	}
+	// Read the vector and append its elements to the end of the result.
+	void read_append(BufferReader& reader, std::vector<T>& result)
+	{
+		const size_t size = reader.read_u32();
+		const size_t prev_size = result.size();
+		if (size != 0) {
+			result.resize(prev_size + size);
+			::memcpy(result.data() + prev_size, reader.ptr(), size * sizeof(T));
+		}
+		reader.skip_count(size * sizeof(T));
+	}
 	void skip(BufferReader& reader)
 	{ 
 		const size_t size = reader.read_u32();
@@ -180,10 +246,155 @@ public:
 	size_t size(const std::vector<T>& value) const { return 4 + value.size() * sizeof(T); }
 };
 
+// String serializer padded to 4 bytes, so the next value of the 4-byte aligned map entry is aligned as well.
+class PaddedStringSerializer {
+public:
+	void write(std::string_view value, BufferWriter& writer)
+	{
+		writer.write_string_view(value);
+		for (size_t i = 1 + value.size(); i < size(value); i++) {
+			writer.write_u8(0);
+		}
+	}
+
+	std::string_view read(BufferReader& reader)
+	{
+		const auto value = reader.read_string_view();
+		reader.skip_count(size(value) - 1 - value.size());
+		return value;
+	}
+	void skip(BufferReader& reader) { read(reader); }
+
+	size_t size(std::string_view value) const { return (1 + value.size() + 3) / 4 * 4; }
+};
+
+// Decode count group varint ids from the data to the output and return the end of the decoded data.
+// Every group of 4 ids starts with the tag of 2-bit byte lengths minus one, the last group may be partial.
+// The output must have room for the count rounded up to 4 ids. Groups are decoded with SSSE3 when
+// the data has 16 bytes after the tag, so the reads never cross the end.
+const u8* decode_group_varint(const u8* data, const u8* end, size_t count, u32* output);
+
+// Compact serializer of the token ids. The codec of every value is chosen when it is written: 16-bit ids
+// if all ids fit, otherwise group varint. Values are not aligned, so they are decoded instead of read in place.
+/*
+	count u8 | codec u8 | ids u16 × count
+	count u8 | codec u8 | payload size u16 | groups (tag u8, 4 ids of 1..4 bytes)
+*/
+class CompactIdsSerializer {
+public:
+	enum Codec : u8 {
+		ids_u16 = 0,
+		group_varint = 1,
+	};
+
+	void write(const std::vector<u32>& value, BufferWriter& writer)
+	{
+		assert(value.size() <= 0xFF);
+		writer.write_u8(static_cast<u8>(value.size()));
+		if (fits_u16(value)) {
+			writer.write_u8(ids_u16);
+			for (const u32 id : value) {
+				writer.write_u16(static_cast<u16>(id));
+			}
+			return;
+		}
+
+		writer.write_u8(group_varint);
+		writer.write_u16(static_cast<u16>(group_varint_size(value)));
+		for (size_t group = 0; group < value.size(); group += 4) {
+			const size_t group_end = std::min(group + 4, value.size());
+			u8 tag = 0;
+			for (size_t i = group; i < group_end; i++) {
+				tag = static_cast<u8>(tag | ((byte_length(value[i]) - 1) << (2 * (i - group))));
+			}
+			writer.write_u8(tag);
+			for (size_t i = group; i < group_end; i++) {
+				for (size_t byte = 0; byte < byte_length(value[i]); byte++) {
+					writer.write_u8(static_cast<u8>(value[i] >> (8 * byte)));
+				}
+			}
+		}
+	}
+
+	std::vector<u32> read(BufferReader& reader)
+	{
+		std::vector<u32> result;
+		read_append(reader, result);
+		return result;
+	}
+	// Read the ids and append them to the end of the result. Ids are narrowed to the Id type,
+	// so the narrow result requires all ids to fit.
+	template<typename Id>
+	void read_append(BufferReader& reader, std::vector<Id>& result)
+	{
+		static_assert(std::is_unsigned_v<Id> && sizeof(Id) >= sizeof(u16) && sizeof(Id) <= sizeof(u32));
+
+		const size_t count = reader.read_u8();
+		const u8 codec = reader.read_u8();
+		const size_t prev_size = result.size();
+		if (codec == ids_u16) {
+			result.resize(prev_size + count);
+			for (size_t i = 0; i < count; i++) {
+				result[prev_size + i] = reader.read_u16();
+			}
+			return;
+		}
+
+		assert(codec == group_varint);
+		const size_t payload_size = reader.read_u16();
+		if constexpr (std::is_same_v<Id, u32>) {
+			result.resize(prev_size + (count + 3) / 4 * 4);
+			decode_group_varint(reader.ptr(), reader.ptr() + payload_size, count, result.data() + prev_size);
+			result.resize(prev_size + count);
+		} else {
+			std::array<u32, 0x100 + 3> ids;
+			decode_group_varint(reader.ptr(), reader.ptr() + payload_size, count, ids.data());
+			for (size_t i = 0; i < count; i++) {
+				assert(ids[i] <= std::numeric_limits<Id>::max());
+				result.push_back(static_cast<Id>(ids[i]));
+			}
+		}
+		reader.skip_count(payload_size);
+	}
+	// Read the number of ids without decoding them. The reader stays inside the value.
+	static size_t read_count(BufferReader& reader) { return reader.read_u8(); }
+	void skip(BufferReader& reader)
+	{
+		const size_t count = reader.read_u8();
+		const u8 codec = reader.read_u8();
+		reader.skip_count(codec == ids_u16 ? count * sizeof(u16) : reader.read_u16());
+	}
+
+	size_t size(const std::vector<u32>& value) const
+	{
+		return fits_u16(value) ? 2 + value.size() * sizeof(u16) : 4 + group_varint_size(value);
+	}
+
+private:
+	static bool fits_u16(const std::vector<u32>& value)
+	{
+		return std::all_of(value.begin(), value.end(), [](u32 id) { return id <= 0xFFFF; });
+	}
+
+	static size_t byte_length(u32 id) { return id == 0 ? 1 : (static_cast<size_t>(std::bit_width(id)) + 7) / 8; }
+
+	static size_t group_varint_size(const std::vector<u32>& value)
+	{
+		size_t size = (value.size() + 3) / 4;
+		for (const u32 id : value) {
+			size += byte_length(id);
+		}
+		return size;
+	}
+};
+
 
 // Mapped storage for short (string length <= 256) strings.
 class ShortStringsMappedArray {
 public:
+	// Zero bytes after the strings, so the strings up to this size can be read by the fixed-size copies.
+	static constexpr size_t padding = 16;
+
 	explicit ShortStringsMappedArray(const u8* data);
 	ShortStringsMappedArray();
 
@@ -195,13 +406,25 @@ public:
 
 	// Collection size.
 	size_t size() const { return element_count; }
-	// Get string by index.
-	std::string_view operator[](size_t index) const;
+	// Get string by index. The offset and the length are read independently.
+	std::string_view operator[](size_t index) const
+	{
+		assert(index < element_count);
+		const size_t offset = BufferReader{ offsets + (sizeof(u32) * index) }.read_u32();
+		return std::string_view(reinterpret_cast<const char*>(strings + offset), lengths[index]);
+	}
+	// Get string length by index, the lengths of the neighboring indices are contiguous.
+	size_t length(size_t index) const
+	{
+		assert(index < element_count);
+		return lengths[index];
+	}
 
 private:
 	size_t buffer_size;
 	u32 element_count;
 	const u8* offsets;
+	const u8* lengths;
 	const u8* strings;
 
 /*
@@ -216,21 +439,331 @@ private:
 	║ 8                ║     N × 4        ║ offsets          ║ Array of string offsets (u32 LE)      ║
 	║                  ║ (N=element_count)║                  ║ Relative to strings section start     ║
 	╠══════════════════╬══════════════════╬══════════════════╬═══════════════════════════════════════╣
-	║ 8 + N×4          ║    Variable      ║ strings          ║ Packed strings: [1-byte length][data] ║
+	║ 8 + N×4          ║        N         ║ lengths          ║ Array of string lengths (u8)          ║
+	╠══════════════════╬══════════════════╬══════════════════╬═══════════════════════════════════════╣
+	║ 8 + N×5          ║    Variable      ║ strings          ║ Packed string bytes without lengths   ║
 	║                  ║                  ║                  ║ Max length: 255, no null-terminator   ║
+	╠══════════════════╬══════════════════╬══════════════════╬═══════════════════════════════════════╣
+	║ buffer_size - 16 ║        16        ║ padding          ║ Zero bytes                            ║
 	╚══════════════════╩══════════════════╩══════════════════╩═══════════════════════════════════════╝
 */
 
 };
 
 
+// Mapped table of the bpe merge ranks: (first token, second token) -> merged token.
+// Byte pairs are looked up in the dense table, other pairs in the compressed sparse rows
+// of the first token, so any lookup touches one or two cache lines.
+class MergeRanksMappedTable {
+public:
+	MergeRanksMappedTable();
+
+	// Attach the external buffer aligned to 4 bytes and return buffer size.
+	size_t attach(const u8* data);
+
+	// Create the table from the map of the pairs to the ranks, write it to the buffer and return buffer size.
+	// token_count - number of tokens, all pair tokens are less than that.
+	template<typename Map>
+	static size_t write_to_buffer(const Map& merges, size_t token_count, std::vector<u8>& buffer);
+
+	// Whether the table is attached.
+	bool attached() const { return byte_pairs != nullptr; }
+	// Get the merged token of the pair.
+	std::optional<u32> get(u32 first, u32 second) const;
+
+private:
+	// Entry of the sparse row.
+	struct Entry {
+		u32 second;
+		u32 rank;
+	};
+
+	static constexpr size_t byte_count = 256;
+	static constexpr u32 no_rank = std::numeric_limits<u32>::max();
+	// Rows shorter than that are scanned linearly.
+	static constexpr size_t linear_search_size = 8;
+
+	size_t buffer_size;
+	u32 row_count;
+	const u32* byte_pairs;
+	const u32* row_offsets;
+	const Entry* entries;
+
+/*
+                                        Layout in the file.
+	╔══════════════════╦══════════════════╦══════════════════╦═══════════════════════════════════════════╗
+	║ Offset (bytes)   ║   Size (bytes)   ║ Field            ║ Description                               ║
+	╠══════════════════╬══════════════════╬══════════════════╬═══════════════════════════════════════════╣
+	║ 0                ║        4         ║ buffer_size      ║ Total buffer size (u32 little-endian)     ║
+	╠══════════════════╬══════════════════╬══════════════════╬═══════════════════════════════════════════╣
+	║ 4                ║        4         ║ row_count        ║ Number of rows R = number of tokens       ║
+	╠══════════════════╬══════════════════╬══════════════════╬═══════════════════════════════════════════╣
+	║ 8                ║        4         ║ entry_count      ║ Number of sparse entries E                ║
+	╠══════════════════╬══════════════════╬══════════════════╬═══════════════════════════════════════════╣
+	║ 12               ║        4         ║ reserved         ║ Zero                                      ║
+	╠══════════════════╬══════════════════╬══════════════════╬═══════════════════════════════════════════╣
+	║ 16               ║   256 × 256 × 4  ║ byte_pairs       ║ Rank of the pair of bytes [first][second] ║
+	║                  ║                  ║                  ║ u32 max - no merge                        ║
+	╠══════════════════╬══════════════════╬══════════════════╬═══════════════════════════════════════════╣
+	║ 16 + 256K        ║   (R + 1) × 4    ║ row_offsets      ║ Row of the first token r is               ║
+	║                  ║                  ║                  ║ entries[row_offsets[r], row_offsets[r+1]) ║
+	╠══════════════════╬══════════════════╬══════════════════╬═══════════════════════════════════════════╣
+	║ 16 + 256K +      ║      E × 8       ║ entries          ║ (second u32, rank u32) sorted by second,  ║
+	║ (R + 1) × 4      ║                  ║                  ║ pairs of two bytes are not included       ║
+	╚══════════════════╩══════════════════╩══════════════════╩═══════════════════════════════════════════╝
+*/
+};
+
+inline std::optional<u32> MergeRanksMappedTable::get(u32 first, u32 second) const
+{
+	if ((first | second) < byte_count) {
+		const u32 rank = byte_pairs[first * byte_count + second];
+		return rank != no_rank ? std::optional<u32>{ rank } : std::nullopt;
+	}
+	if (first >= row_count) {
+		return std::nullopt;
+	}
+
+	const Entry* begin = entries + row_offsets[first];
+	const Entry* end = entries + row_offsets[first + 1];
+	if (static_cast<size_t>(end - begin) > linear_search_size) {
+		begin = std::lower_bound(begin, end, second,
+			[](const Entry& entry, u32 value) { return entry.second < value; });
+	}
+	for (; begin != end && begin->second <= second; ++begin) {
+		if (begin->second == second) {
+			return begin->rank;
+		}
+	}
+	return std::nullopt;
+}
+
+template<typename Map>
+size_t MergeRanksMappedTable::write_to_buffer(const Map& merges, size_t token_count, std::vector<u8>& buffer)
+{
+	std::vector<u32> byte_pair_ranks(byte_count * byte_count, no_rank);
+	std::vector<std::vector<Entry>> rows(token_count);
+	size_t entry_count = 0;
+	for (const auto& [pair, rank] : merges) {
+		assert(pair.first < token_count && pair.second < token_count);
+		if ((pair.first | pair.second) < byte_count) {
+			byte_pair_ranks[pair.first * byte_count + pair.second] = rank;
+		} else {
+			rows[pair.first].push_back(Entry{ pair.second, rank });
+			entry_count++;
+		}
+	}
+
+	const size_t header_size = 4 * sizeof(u32);
+	const size_t buffer_size = header_size
+		+ byte_pair_ranks.size() * sizeof(u32)
+		+ (token_count + 1) * sizeof(u32)
+		+ entry_count * sizeof(Entry);
+
+	const size_t prev_pos = buffer.size();
+	buffer.resize(buffer.size() + buffer_size);
+	BufferWriter writer{ buffer.data() + prev_pos };
+
+	writer.write_u32(static_cast<u32>(buffer_size));
+	writer.write_u32(static_cast<u32>(token_count));
+	writer.write_u32(static_cast<u32>(entry_count));
+	writer.write_u32(0);
+
+	for (const u32 rank : byte_pair_ranks) {
+		writer.write_u32(rank);
+	}
+
+	u32 offset = 0;
+	for (const auto& row : rows) {
+		writer.write_u32(offset);
+		offset += static_cast<u32>(row.size());
+	}
+	writer.write_u32(offset);
+
+	for (auto& row : rows) {
+		std::sort(row.begin(), row.end(), [](const Entry& left, const Entry& right) { return left.second < right.second; });
+		for (const auto& entry : row) {
+			writer.write_u32(entry.second);
+			writer.write_u32(entry.rank);
+		}
+	}
+
+	return buffer_size;
+}
+
+// Fast string hash. The result does not depend on the build, so it can be stored in the files.
+struct StringHash {
+	// Identifier of the hash function stored in the files.
+	static constexpr u32 id = 1;
+
+	u64 operator()(std::string_view value) const
+	{
+		const char* data = value.data();
+		const size_t size = value.size();
+
+		// The tail is read by the overlapping loads of the fixed size.
+		u64 hash = k0 ^ (size * k1);
+		if (size >= sizeof(u64)) {
+			for (size_t pos = 0; pos + sizeof(u64) < size; pos += sizeof(u64)) {
+				hash = mix(hash, load<u64>(data + pos));
+			}
+			hash = mix(hash, load<u64>(data + size - sizeof(u64)));
+		} else if (size >= sizeof(u32)) {
+			hash = mix(hash, (static_cast<u64>(load<u32>(data)) << 32) | load<u32>(data + size - sizeof(u32)));
+		} else if (size > 0) {
+			const u64 word = (static_cast<u64>(static_cast<u8>(data[0])) << 16)
+				| (static_cast<u64>(static_cast<u8>(data[size / 2])) << 8)
+				| static_cast<u8>(data[size - 1]);
+			hash = mix(hash, word);
+		}
+
+		// Final avalanche, so the low and the high bits are good.
+		hash ^= hash >> 32;
+		hash *= k0;
+		hash ^= hash >> 29;
+		return hash;
+	}
+
+private:
+	static constexpr u64 k0 = 0x9E3779B97F4A7C15ull;
+	static constexpr u64 k1 = 0xC2B2AE3D27D4EB4Full;
+
+	template<typename T>
+	static T load(const char* data)
+	{
+		T value;
+		::memcpy(&value, data, sizeof(T));
+		return value;
+	}
+
+	static u64 mix(u64 hash, u64 word)
+	{
+		hash = (hash ^ word) * k1;
+		return hash ^ (hash >> 29);
+	}
+};
+
+// Layout of MappedMap in the buffer.
+enum class MapLayout {
+	// Buckets of the prime size with the chains of the serialized entries.
+	chained,
+	// Open addressing with the groups of 16 slots and the 7-bit hash tags of the slots, probed with SIMD.
+	// The key hash must have the stable identifier KeyHash::id.
+	swiss,
+	// Minimal perfect hash: every key is mapped to its own slot by the pilot of its bucket (PTHash),
+	// so any lookup reads exactly one slot. Keys are partitioned by hash and partitions are built in parallel.
+	// The key hash must have the stable identifier KeyHash::id.
+	perfect,
+};
+
+// Mapped split block Bloom filter of the strings. Every key sets one bit in each of the 8 words of its
+// 32-byte block, so the check reads a single cache line. 10 bits per key give about 1% of false positives.
+class MappedBloomFilter {
+public:
+	MappedBloomFilter();
+
+	// Attach the external buffer aligned to 4 bytes and return buffer size.
+	// Return 0 if the buffer was written with another hash function.
+	size_t attach(const u8* data);
+
+	// Create the filter of the keys, write it to the buffer and return buffer size.
+	template<typename Keys>
+	static size_t write_to_buffer(const Keys& keys, size_t bits_per_key, std::vector<u8>& buffer);
+
+	// Whether the filter is attached.
+	bool attached() const { return blocks != nullptr; }
+	// False if the key is definitely not in the set.
+	bool may_contain(std::string_view key) const;
+
+private:
+	static constexpr size_t header_size = 4 * sizeof(u32);
+	static constexpr size_t block_words = 8;
+	static constexpr size_t block_size = block_words * sizeof(u32);
+
+	static u32 get_block(u64 key_hash, u32 block_count)
+	{
+		return static_cast<u32>(((key_hash >> 32) * block_count) >> 32);
+	}
+	// 5-bit positions of the bits in the block words are taken from the high bits of the remixed hash.
+	static u64 get_bit_positions(u64 key_hash) { return key_hash * 0x9E3779B97F4A7C15ull; }
+	static u32 get_bit(u64 bit_positions, size_t word) { return 1u << ((bit_positions >> (24 + 5 * word)) & 31); }
+
+	size_t buffer_size;
+	u32 block_count;
+	const u8* blocks;
+
+/*
+                                        Layout in the file.
+	╔══════════════════╦══════════════════╦══════════════════╦═══════════════════════════════════════════╗
+	║ Offset (bytes)   ║   Size (bytes)   ║ Field            ║ Description                               ║
+	╠══════════════════╬══════════════════╬══════════════════╬═══════════════════════════════════════════╣
+	║ 0                ║        4         ║ buffer_size      ║ Total buffer size (u32 little-endian)     ║
+	╠══════════════════╬══════════════════╬══════════════════╬═══════════════════════════════════════════╣
+	║ 4                ║        4         ║ block_count      ║ Number of blocks B                        ║
+	╠══════════════════╬══════════════════╬══════════════════╬═══════════════════════════════════════════╣
+	║ 8                ║        4         ║ hash_id          ║ StringHash::id                            ║
+	╠══════════════════╬══════════════════╬══════════════════╬═══════════════════════════════════════════╣
+	║ 12               ║        4         ║ reserved         ║ Zero                                      ║
+	╠══════════════════╬══════════════════╬══════════════════╬═══════════════════════════════════════════╣
+	║ 16               ║      B × 32      ║ blocks           ║ 8 u32 words of every block                ║
+	╚══════════════════╩══════════════════╩══════════════════╩═══════════════════════════════════════════╝
+*/
+};
+
+inline bool MappedBloomFilter::may_contain(std::string_view key) const
+{
+	const u64 key_hash = StringHash{}(key);
+	const u64 bit_positions = get_bit_positions(key_hash);
+	BufferReader reader{ blocks + get_block(key_hash, block_count) * block_size };
+
+	// All 8 words are checked without branches.
+	u32 missing = 0;
+	for (size_t word = 0; word < block_words; word++) {
+		missing |= ~reader.read_u32() & get_bit(bit_positions, word);
+	}
+	return missing == 0;
+}
+
+template<typename Keys>
+size_t MappedBloomFilter::write_to_buffer(const Keys& keys, size_t bits_per_key, std::vector<u8>& buffer)
+{
+	const size_t key_count = static_cast<size_t>(std::distance(std::begin(keys), std::end(keys)));
+	const size_t count = std::max<size_t>(1, (key_count * bits_per_key + block_size * CHAR_BIT - 1) / (block_size * CHAR_BIT));
+
+	std::vector<u32> words(count * block_words, 0);
+	for (const auto& key : keys) {
+		const u64 key_hash = StringHash{}(key);
+		const u64 bit_positions = get_bit_positions(key_hash);
+		u32* block = words.data() + get_block(key_hash, static_cast<u32>(count)) * block_words;
+		for (size_t word = 0; word < block_words; word++) {
+			block[word] |= get_bit(bit_positions, word);
+		}
+	}
+
+	const size_t buffer_size = header_size + words.size() * sizeof(u32);
+	const size_t prev_pos = buffer.size();
+	buffer.resize(buffer.size() + buffer_size);
+	BufferWriter writer{ buffer.data() + prev_pos };
+
+	writer.write_u32(static_cast<u32>(buffer_size));
+	writer.write_u32(static_cast<u32>(count));
+	writer.write_u32(StringHash::id);
+	writer.write_u32(0);
+	for (const u32 word : words) {
+		writer.write_u32(word);
+	}
+
+	return buffer_size;
+}
+
 // Config trait for map.
 template<
 	typename _Key, typename _Value,
 	typename _KeyHash=std::hash<_Key>, 
 	typename _KeyEq=std::equal_to<_Key>,
 	typename _KeySerializer=DataSerializer<_Key>,
-	typename _ValueSerializer=DataSerializer<_Value>
+	typename _ValueSerializer=DataSerializer<_Value>,
+	MapLayout _Layout=MapLayout::chained
 >
 struct DefaultMapConfig {
 	using Key = _Key;
@@ -239,6 +772,7 @@ struct DefaultMapConfig {
 	using KeyEq = _KeyEq;
 	using KeySerializer = _KeySerializer;
 	using ValueSerializer = _ValueSerializer;
+	static constexpr MapLayout layout = _Layout;
 };
 
 // Mapped storage for arbitrary key-value pairs.
@@ -257,6 +791,9 @@ public:
 		number_of_elements(0), 
 		hash_table_size(0),
 		end_pos(0),
+		partition_count(0),
+		partitions(nullptr),
+		control(nullptr),
 		index(nullptr),
 		storage(nullptr)
 	{ 
@@ -267,20 +804,54 @@ public:
 		number_of_elements(0),
 		hash_table_size(0),
 		end_pos(0),
+		partition_count(0),
+		partitions(nullptr),
+		control(nullptr),
 		index(nullptr),
 		storage(nullptr) {}
 
 	// Attach the external buffer and return buffer size.
+	// Return 0 if the buffer of the swiss or the perfect layout was written with another hash function.
 	size_t attach(const u8* data);
 
 	// Create MappedMap from the map, write it to the buffer and return buffer size.
+	// The perfect layout builds its partitions on the pool, nullptr - on the calling thread.
 	template<typename Map>
-	static size_t write_to_buffer(const Map& data, std::vector<u8>& buffer);
+	static size_t write_to_buffer(const Map& data, std::vector<u8>& buffer, ThreadPool* pool = nullptr);
 
 	// Check if the map contains the key.
 	bool contains(const Key& key) const;
 	// Get the value by the key.
 	Value get(const Key& key) const;
+	// Find the serialized value by the key. Return nullptr if the map does not contain the key.
+	const u8* find(const Key& key) const;
+	// Get the view of the value in the mapped buffer by the key. The map must be attached to the aligned buffer
+	// and its entries must keep the values aligned. Return the empty view if the map does not contain the key.
+	auto get_view(const Key& key) const
+	{
+		typename Config::ValueSerializer value_serializer;
+		using View = decltype(value_serializer.read_view(std::declval<BufferReader&>()));
+
+		const u8* value = find(key);
+		if (value == nullptr) {
+			return View{};
+		}
+		BufferReader reader{ value };
+		return value_serializer.read_view(reader);
+	}
+	// Decode the value by the key and append its elements to the end of the result.
+	// Return false if the map does not contain the key.
+	template<typename Result>
+	bool get_append(const Key& key, Result& result) const
+	{
+		const u8* value = find(key);
+		if (value == nullptr) {
+			return false;
+		}
+		BufferReader reader{ value };
+		typename Config::ValueSerializer{}.read_append(reader, result);
+		return true;
+	}
 	// Get the value by the key.
 	Value operator[](const Key& key) const { return get(key); }
 	// Collection size.
@@ -296,8 +867,14 @@ public:
 private:
 	size_t buffer_size;
 	u32 number_of_elements;
+	// Number of the buckets, or the number of the slots for the swiss and the perfect layouts.
 	u32 hash_table_size;
 	u32 end_pos;
+	// Partitions of the perfect layout.
+	u32 partition_count;
+	const u8* partitions;
+	// Slot tags of the swiss layout, or the bucket pilots of the perfect layout.
+	const u8* control;
 	const u8* index;
 	const u8* storage;
 
@@ -327,9 +904,108 @@ private:
 ║                                                       └───────────────────────────────┘                              ║
 ║                                [entry_1]              ... (repeated number_of_elements times) ...                    ║
 ╚══════════════════════════════════════════════════════════════════════════════════════════════════════════════════════╝
+*/
+/*                                     Swiss layout in the file.
+╔══════════════════════════════════════════════════════════════════════════════════════════════════════════════════════╗
+║ Offset (bytes)  Size (bytes)    Field                 Description                                                    ║
+╠══════════════════════════════════════════════════════════════════════════════════════════════════════════════════════╣
+║ 0               4               buffer_size           Total size of mapped buffer (header + slots + storage)         ║
+╟──────────────────────────────────────────────────────────────────────────────────────────────────────────────────────╢
+║ 4               4               number_of_elements    Total number of key-value pairs in the map                     ║
+╟──────────────────────────────────────────────────────────────────────────────────────────────────────────────────────╢
+║ 8               4               hash_table_size       Number of slots N, power of two >= 16                          ║
+╟──────────────────────────────────────────────────────────────────────────────────────────────────────────────────────╢
+║ 12              4               end_pos               Offset to end of valid data in storage                         ║
+╟──────────────────────────────────────────────────────────────────────────────────────────────────────────────────────╢
+║ 16              4               hash_id               KeyHash::id of the hash function                               ║
+╟──────────────────────────────────────────────────────────────────────────────────────────────────────────────────────╢
+║ 20              12              reserved              Zeros                                                          ║
+╠══════════════════════════════════════════════════════════════════════════════════════════════════════════════════════╣
+║ 32              N               control               Slot tags: 0x80 - empty slot, 0..0x7F - 7 high bits of hash    ║
+║                                                       Slots are probed by the groups of 16                           ║
+╠══════════════════════════════════════════════════════════════════════════════════════════════════════════════════════╣
+║ 32+N            4*N             index                 Offset of the slot entry in storage                            ║
+╠══════════════════════════════════════════════════════════════════════════════════════════════════════════════════════╣
+║ 32+5*N          Variable        storage               Key-value storage area, as in the chained layout               ║
+╚══════════════════════════════════════════════════════════════════════════════════════════════════════════════════════╝
+*/
+/*                                    Perfect layout in the file.
+╔══════════════════════════════════════════════════════════════════════════════════════════════════════════════════════╗
+║ Offset (bytes)  Size (bytes)    Field                 Description                                                    ║
+╠══════════════════════════════════════════════════════════════════════════════════════════════════════════════════════╣
+║ 0               4               buffer_size           Total size of mapped buffer (header + index + storage)         ║
+╟──────────────────────────────────────────────────────────────────────────────────────────────────────────────────────╢
+║ 4               4               number_of_elements    Total number of key-value pairs in the map                     ║
+╟──────────────────────────────────────────────────────────────────────────────────────────────────────────────────────╢
+║ 8               4               hash_table_size       Total number of slots N, about 1.016 * number_of_elements      ║
+╟──────────────────────────────────────────────────────────────────────────────────────────────────────────────────────╢
+║ 12              4               end_pos               Offset to end of valid data in storage                         ║
+╟──────────────────────────────────────────────────────────────────────────────────────────────────────────────────────╢
+║ 16              4               hash_id               KeyHash::id of the hash function                               ║
+╟──────────────────────────────────────────────────────────────────────────────────────────────────────────────────────╢
+║ 20              4               partition_count       Number of partitions P                                         ║
+╟──────────────────────────────────────────────────────────────────────────────────────────────────────────────────────╢
+║ 24              4               bucket_count          Total number of buckets B, about number_of_elements / 4        ║
+╟──────────────────────────────────────────────────────────────────────────────────────────────────────────────────────╢
+║ 28              4               reserved              Zero                                                           ║
+╠══════════════════════════════════════════════════════════════════════════════════════════════════════════════════════╣
+║ 32              16*P            partitions            ┌────────────┬────────────┬─────────────┬──────────────┐       ║
+║                                                       │ slot_base  │ slot_count │ bucket_base │ bucket_count │       ║
+║                                                       └────────────┴────────────┴─────────────┴──────────────┘       ║
+╠══════════════════════════════════════════════════════════════════════════════════════════════════════════════════════╣
+║ 32+16*P         2*B, aligned 4  pilots                u16 pilot of every bucket, it selects the slots of bucket keys ║
+╠══════════════════════════════════════════════════════════════════════════════════════════════════════════════════════╣
+║ ...             4*N             index                 Offset of the slot entry in storage, u32 max - empty slot      ║
+╠══════════════════════════════════════════════════════════════════════════════════════════════════════════════════════╣
+║ ...             Variable        storage               Key-value storage area, as in the chained layout               ║
+╚══════════════════════════════════════════════════════════════════════════════════════════════════════════════════════╝
 */
 	static constexpr u32 unknown_offset = std::numeric_limits<u32>::max();
 
+	static constexpr size_t swiss_header_size = 8 * sizeof(u32);
+	static constexpr size_t group_size = 16;
+	static constexpr u8 empty_tag = 0x80;
+
+	static u8 get_tag(u64 key_hash) { return static_cast<u8>(key_hash >> 57); }
+	// Bit mask of the group slots with the tag.
+	static u32 match_group(const u8* group, u8 tag);
+
+	static constexpr size_t perfect_header_size = 8 * sizeof(u32);
+	static constexpr size_t partition_size = 4 * sizeof(u32);
+	// Average number of keys in the partition and in the bucket.
+	static constexpr size_t partition_key_count = 1 << 12;
+	static constexpr size_t bucket_key_count = 4;
+	static constexpr size_t max_pilot = std::numeric_limits<u16>::max();
+
+	// Key hashes of the perfect layout are remixed, so the weak key hashes are good too.
+	static u64 mix_hash(u64 value)
+	{
+		value ^= value >> 32;
+		value *= 0xD6E8FEB86659FD93ull;
+		value ^= value >> 32;
+		value *= 0xD6E8FEB86659FD93ull;
+		value ^= value >> 32;
+		return value;
+	}
+	// Map the value to [0, range) without the division.
+	static u32 reduce(u32 value, u32 range) { return static_cast<u32>((static_cast<u64>(value) * range) >> 32); }
+	// Slot of the key in the partition with the pilot of the key bucket.
+	static u32 get_perfect_slot(u64 key_hash, size_t pilot, u32 slot_count)
+	{
+		return reduce(static_cast<u32>(mix_hash(key_hash ^ (pilot * 0x9E3779B97F4A7C15ull)) >> 32), slot_count);
+	}
+
+	const u8* find_chained(const Key& key) const;
+	const u8* find_swiss(const Key& key) const;
+	const u8* find_perfect(const Key& key) const;
+
+	template<typename Map>
+	static size_t write_chained(const Map& data, std::vector<u8>& buffer);
+	template<typename Map>
+	static size_t write_swiss(const Map& data, std::vector<u8>& buffer);
+	template<typename Map>
+	static size_t write_perfect(const Map& data, std::vector<u8>& buffer, ThreadPool* pool);
+
 	template<typename Map>
 	static size_t choose_hash_table_size(const Map& data);
 	static std::vector<size_t> find_prime_numbers(size_t n);
@@ -346,14 +1022,69 @@ size_t MappedMap<Key, Value, Config>::attach(const u8* data)
 	number_of_elements = reader.read_u32();
 	hash_table_size = reader.read_u32();
 	end_pos = reader.read_u32();
-	index = data + 4 * sizeof(u32);
-	storage = index + hash_table_size * ( 2 * sizeof(u32));
+
+	if constexpr (Config::layout == MapLayout::swiss) {
+		if (reader.read_u32() != Config::KeyHash::id) {
+			*this = MappedMap{};
+			return 0;
+		}
+		assert(hash_table_size % group_size == 0 && (hash_table_size & (hash_table_size - 1)) == 0);
+		control = data + swiss_header_size;
+		index = control + hash_table_size;
+		storage = index + hash_table_size * sizeof(u32);
+	} else if constexpr (Config::layout == MapLayout::perfect) {
+		if (reader.read_u32() != Config::KeyHash::id) {
+			*this = MappedMap{};
+			return 0;
+		}
+		partition_count = reader.read_u32();
+		const u32 bucket_count = reader.read_u32();
+		assert(partition_count >= 1);
+		partitions = data + perfect_header_size;
+		control = partitions + partition_count * partition_size;
+		index = control + (bucket_count * sizeof(u16) + 3) / 4 * 4;
+		storage = index + hash_table_size * sizeof(u32);
+	} else {
+		index = data + 4 * sizeof(u32);
+		storage = index + hash_table_size * ( 2 * sizeof(u32));
+	}
 
 	return buffer_size;
 }
 
 template<typename Key, typename Value, typename Config>
 inline bool MappedMap<Key, Value, Config>::contains(const Key& key) const
+{
+	return find(key) != nullptr;
+}
+
+template<typename Key, typename Value, typename Config>
+inline Value MappedMap<Key, Value, Config>::get(const Key& key) const
+{
+	typename Config::ValueSerializer value_serializer;
+
+	const u8* value = find(key);
+	if (value == nullptr) {
+		return Value();
+	}
+	BufferReader reader{ value };
+	return value_serializer.read(reader);
+}
+
+template<typename Key, typename Value, typename Config>
+inline const u8* MappedMap<Key, Value, Config>::find(const Key& key) const
+{
+	if constexpr (Config::layout == MapLayout::swiss) {
+		return find_swiss(key);
+	} else if constexpr (Config::layout == MapLayout::perfect) {
+		return find_perfect(key);
+	} else {
+		return find_chained(key);
+	}
+}
+
+template<typename Key, typename Value, typename Config>
+inline const u8* MappedMap<Key, Value, Config>::find_chained(const Key& key) const
 {
 	typename Config::KeyHash hasher;
 	typename Config::KeyEq eq;
@@ -366,7 +1097,7 @@ inline bool MappedMap<Key, Value, Config>::contains(const Key& key) const
 
 	const u32 offset = index_reader.read_u32();
 	if (offset == unknown_offset || offset >= end_pos) {
-		return false;
+		return nullptr;
 	}
 	const u32 end_key_offset = index_reader.read_u32();
 	assert(end_key_offset <= end_pos);
@@ -375,39 +1106,57 @@ inline bool MappedMap<Key, Value, Config>::contains(const Key& key) const
 	while (storage_reader.ptr() - storage < end_key_offset) {
 		const auto storage_key = key_serializer.read(storage_reader);
 		if (eq(key, storage_key)) {
-			return true;
+			return storage_reader.ptr();
 		}
 		value_serializer.skip(storage_reader);
 	}
-	return false;
+	return nullptr;
 }
 
 template<typename Key, typename Value, typename Config>
-inline Value MappedMap<Key, Value, Config>::get(const Key& key) const
+inline u32 MappedMap<Key, Value, Config>::match_group(const u8* group, u8 tag)
+{
+#ifdef BPE_MAPPED_MAP_SSE2
+	const __m128i slots = _mm_loadu_si128(reinterpret_cast<const __m128i*>(group));
+	return static_cast<u32>(_mm_movemask_epi8(_mm_cmpeq_epi8(slots, _mm_set1_epi8(static_cast<char>(tag)))));
+#else
+	u32 mask = 0;
+	for (size_t i = 0; i < group_size; i++) {
+		mask |= static_cast<u32>(group[i] == tag) << i;
+	}
+	return mask;
+#endif
+}
+
+// Groups are probed quadratically, all groups are visited since their number is a power of two.
+// Keys are compared only for the slots with the matching tag, the group with an empty slot ends the probing.
+template<typename Key, typename Value, typename Config>
+inline const u8* MappedMap<Key, Value, Config>::find_swiss(const Key& key) const
 {
 	typename Config::KeyHash hasher;
 	typename Config::KeyEq eq;
 	typename Config::KeySerializer key_serializer;
-	typename Config::ValueSerializer value_serializer;
 
-	const size_t entry_index = hasher(key) % hash_table_size;
-
-	BufferReader index_reader{ index + 2 * sizeof(u32) * entry_index };
-
-	const u32 offset = index_reader.read_u32();
-	assert(offset != unknown_offset && offset < end_pos);
-	const u32 end_key_offset = index_reader.read_u32();
-	assert(end_key_offset <= end_pos);
-
-	BufferReader storage_reader{ storage + offset };
-	while (storage_reader.ptr() - storage < end_key_offset) {
-		const auto storage_key = key_serializer.read(storage_reader);
-		if (eq(key, storage_key)) {
-			return value_serializer.read(storage_reader);
+	const u64 key_hash = hasher(key);
+	const u8 tag = get_tag(key_hash);
+	const size_t group_mask = hash_table_size / group_size - 1;
+
+	size_t group = static_cast<size_t>(key_hash) & group_mask;
+	for (size_t probe = 1;; probe++) {
+		const u8* group_control = control + group * group_size;
+		for (u32 match = match_group(group_control, tag); match != 0; match &= match - 1) {
+			const size_t slot = group * group_size + static_cast<size_t>(std::countr_zero(match));
+			BufferReader storage_reader{ storage + BufferReader{ index + slot * sizeof(u32) }.read_u32() };
+			if (eq(key, key_serializer.read(storage_reader))) {
+				return storage_reader.ptr();
+			}
 		}
-		value_serializer.skip(storage_reader);
+		if (match_group(group_control, empty_tag) != 0) {
+			return nullptr;
+		}
+		assert(probe <= group_mask);
+		group = (group + probe) & group_mask;
 	}
-	return Value();
 }
 
 template<typename Key, typename Value, typename Config>
@@ -440,13 +1189,290 @@ MappedMap<Key, Value, Config>::get_key_value(Position pos) const
 	return std::pair<Key, Value>(std::move(key), std::move(value));
 }
 
+template<typename Key, typename Value, typename Config>
+inline const u8* MappedMap<Key, Value, Config>::find_perfect(const Key& key) const
+{
+	typename Config::KeyHash hasher;
+	typename Config::KeyEq eq;
+	typename Config::KeySerializer key_serializer;
+
+	const u64 key_hash = mix_hash(hasher(key));
+
+	BufferReader partition_reader{ partitions + reduce(static_cast<u32>(key_hash >> 32), partition_count) * partition_size };
+	const u32 slot_base = partition_reader.read_u32();
+	const u32 slot_count = partition_reader.read_u32();
+	const u32 bucket_base = partition_reader.read_u32();
+	const u32 bucket_count = partition_reader.read_u32();
+
+	const u32 bucket = bucket_base + reduce(static_cast<u32>(key_hash), bucket_count);
+	const u16 pilot = BufferReader{ control + bucket * sizeof(u16) }.read_u16();
+	const u32 slot = slot_base + get_perfect_slot(key_hash, pilot, slot_count);
+
+	const u32 offset = BufferReader{ index + slot * sizeof(u32) }.read_u32();
+	if (offset == unknown_offset) {
+		return nullptr;
+	}
+	BufferReader storage_reader{ storage + offset };
+	if (!eq(key, key_serializer.read(storage_reader))) {
+		return nullptr;
+	}
+	return storage_reader.ptr();
+}
+
 template<typename Key, typename Value, typename Config>
 template<typename Map>
 inline size_t MappedMap<Key, Value, Config>::write_to_buffer(
-	const Map& data, std::vector<u8>& buffer)
+	const Map& data, std::vector<u8>& buffer, ThreadPool* pool)
+{
+	if constexpr (Config::layout == MapLayout::swiss) {
+		return write_swiss(data, buffer);
+	} else if constexpr (Config::layout == MapLayout::perfect) {
+		return write_perfect(data, buffer, pool);
+	} else {
+		return write_chained(data, buffer);
+	}
+}
+
+// Keys of every partition are grouped into buckets by hash. Buckets are placed from the largest one, the pilot
+// of the bucket is the first value which maps all its keys to the free slots. The slot table is 1/64 larger
+// than the number of keys, so the pilots of the last buckets are found fast. If some bucket has no pilot,
+// the partition is rebuilt with the larger slot table.
+template<typename Key, typename Value, typename Config>
+template<typename Map>
+size_t MappedMap<Key, Value, Config>::write_perfect(const Map& data, std::vector<u8>& buffer, ThreadPool* pool)
+{
+	typename Config::KeyHash hasher;
+	typename Config::KeySerializer key_serializer;
+	typename Config::ValueSerializer value_serializer;
+
+	using Item = typename Map::value_type;
+
+	struct Partition {
+		std::vector<std::pair<u64, const Item*>> keys;
+		std::vector<u16> pilots;
+		// Slot -> key index, u32 max - empty slot.
+		std::vector<u32> slots;
+	};
+
+	const size_t partition_count = std::max<size_t>(1, (data.size() + partition_key_count - 1) / partition_key_count);
+	std::vector<Partition> partitions(partition_count);
+	for (auto& partition : partitions) {
+		partition.keys.reserve(partition_key_count + partition_key_count / 4);
+	}
+	for (const auto& item : data) {
+		const u64 key_hash = mix_hash(hasher(item.first));
+		partitions[reduce(static_cast<u32>(key_hash >> 32), static_cast<u32>(partition_count))].keys.emplace_back(key_hash, &item);
+	}
+
+	auto build_partition = [](Partition& partition) {
+		const size_t key_count = partition.keys.size();
+		const size_t bucket_count = std::max<size_t>(1, (key_count + bucket_key_count - 1) / bucket_key_count);
+
+		// Keys with the same hash can not be separated by any pilot.
+		std::sort(partition.keys.begin(), partition.keys.end(),
+			[](const auto& left, const auto& right) { return left.first < right.first; });
+		for (size_t i = 1; i < key_count; i++) {
+			if (partition.keys[i - 1].first == partition.keys[i].first) {
+				throw std::runtime_error("Perfect hash: keys have the same 64-bit hash");
+			}
+		}
+
+		// Bucket keys ordered by bucket, buckets ordered by size descending.
+		std::vector<u32> bucket_begin(bucket_count + 1, 0);
+		for (const auto& [key_hash, item] : partition.keys) {
+			bucket_begin[reduce(static_cast<u32>(key_hash), static_cast<u32>(bucket_count)) + 1]++;
+		}
+		for (size_t i = 0; i < bucket_count; i++) {
+			bucket_begin[i + 1] += bucket_begin[i];
+		}
+		std::vector<u32> bucket_keys(key_count);
+		std::vector<u32> bucket_fill(bucket_begin.begin(), bucket_begin.end() - 1);
+		for (size_t i = 0; i < key_count; i++) {
+			bucket_keys[bucket_fill[reduce(static_cast<u32>(partition.keys[i].first), static_cast<u32>(bucket_count))]++] = static_cast<u32>(i);
+		}
+		std::vector<u32> bucket_order(bucket_count);
+		for (size_t i = 0; i < bucket_count; i++) {
+			bucket_order[i] = static_cast<u32>(i);
+		}
+		std::stable_sort(bucket_order.begin(), bucket_order.end(), [&](u32 left, u32 right) {
+			return bucket_begin[left + 1] - bucket_begin[left] > bucket_begin[right + 1] - bucket_begin[right];
+		});
+
+		std::vector<u32> bucket_slots;
+		for (size_t slot_count = key_count + key_count / 64 + 1;; slot_count += slot_count / 16 + 1) {
+			partition.pilots.assign(bucket_count, 0);
+			partition.slots.assign(slot_count, unknown_offset);
+
+			bool placed = true;
+			for (const u32 bucket : bucket_order) {
+				const u32 begin = bucket_begin[bucket];
+				const u32 end = bucket_begin[bucket + 1];
+
+				size_t pilot = 0;
+				for (; pilot <= max_pilot; pilot++) {
+					bucket_slots.clear();
+					bool free = true;
+					for (u32 i = begin; i < end && free; i++) {
+						const u32 slot = get_perfect_slot(partition.keys[bucket_keys[i]].first, pilot, static_cast<u32>(slot_count));
+						free = partition.slots[slot] == unknown_offset
+							&& std::find(bucket_slots.begin(), bucket_slots.end(), slot) == bucket_slots.end();
+						bucket_slots.push_back(slot);
+					}
+					if (free) {
+						break;
+					}
+				}
+				if (pilot > max_pilot) {
+					placed = false;
+					break;
+				}
+
+				partition.pilots[bucket] = static_cast<u16>(pilot);
+				for (u32 i = begin; i < end; i++) {
+					partition.slots[bucket_slots[i - begin]] = bucket_keys[i];
+				}
+			}
+			if (placed) {
+				return;
+			}
+		}
+	};
+	if (pool != nullptr) {
+		pool->run(partition_count, [&](size_t task, size_t) { build_partition(partitions[task]); });
+	} else {
+		for (auto& partition : partitions) {
+			build_partition(partition);
+		}
+	}
+
+	size_t slot_count = 0;
+	size_t bucket_count = 0;
+	size_t storage_size = 0;
+	for (const auto& partition : partitions) {
+		slot_count += partition.slots.size();
+		bucket_count += partition.pilots.size();
+		for (const auto& [key_hash, item] : partition.keys) {
+			storage_size += key_serializer.size(item->first) + value_serializer.size(item->second);
+		}
+	}
+
+	const size_t pilots_size = (bucket_count * sizeof(u16) + 3) / 4 * 4;
+	const size_t buffer_size = perfect_header_size + partition_count * partition_size + pilots_size
+		+ slot_count * sizeof(u32) + storage_size;
+	const size_t prev_pos = buffer.size();
+	buffer.resize(buffer.size() + buffer_size);
+
+	u8* base_ptr = buffer.data() + prev_pos;
+	BufferWriter partition_writer{ base_ptr + perfect_header_size };
+	BufferWriter pilot_writer{ base_ptr + perfect_header_size + partition_count * partition_size };
+	u8* index_ptr = base_ptr + perfect_header_size + partition_count * partition_size + pilots_size;
+	BufferWriter index_writer{ index_ptr };
+	u8* storage_base_ptr = index_ptr + slot_count * sizeof(u32);
+	BufferWriter storage_writer{ storage_base_ptr };
+
+	size_t slot_base = 0;
+	size_t bucket_base = 0;
+	for (const auto& partition : partitions) {
+		partition_writer.write_u32(static_cast<u32>(slot_base));
+		partition_writer.write_u32(static_cast<u32>(partition.slots.size()));
+		partition_writer.write_u32(static_cast<u32>(bucket_base));
+		partition_writer.write_u32(static_cast<u32>(partition.pilots.size()));
+		slot_base += partition.slots.size();
+		bucket_base += partition.pilots.size();
+
+		for (const u16 pilot : partition.pilots) {
+			pilot_writer.write_u16(pilot);
+		}
+
+		// Entries are stored in the slot order.
+		for (const u32 key_index : partition.slots) {
+			if (key_index == unknown_offset) {
+				index_writer.write_u32(unknown_offset);
+				continue;
+			}
+			index_writer.write_u32(static_cast<u32>(storage_writer.ptr() - storage_base_ptr));
+			const Item* item = partition.keys[key_index].second;
+			key_serializer.write(item->first, storage_writer);
+			value_serializer.write(item->second, storage_writer);
+		}
+	}
+
+	BufferWriter header_writer{ base_ptr };
+	header_writer.write_u32(static_cast<u32>(buffer_size));
+	header_writer.write_u32(static_cast<u32>(data.size()));
+	header_writer.write_u32(static_cast<u32>(slot_count));
+	header_writer.write_u32(static_cast<u32>(storage_writer.ptr() - storage_base_ptr));
+	header_writer.write_u32(Config::KeyHash::id);
+	header_writer.write_u32(static_cast<u32>(partition_count));
+	header_writer.write_u32(static_cast<u32>(bucket_count));
+	header_writer.write_u32(0);
+
+	return buffer_size;
+}
+
+template<typename Key, typename Value, typename Config>
+template<typename Map>
+size_t MappedMap<Key, Value, Config>::write_swiss(const Map& data, std::vector<u8>& buffer)
+{
+	typename Config::KeyHash hasher;
+	typename Config::KeySerializer key_serializer;
+	typename Config::ValueSerializer value_serializer;
+
+	// Load factor is at most 7/8.
+	const size_t hash_table_size = std::max(group_size, std::bit_ceil(data.size() + data.size() / 7 + 1));
+	const size_t group_mask = hash_table_size / group_size - 1;
+
+	size_t storage_size = 0;
+	for (const auto& [key, value] : data) {
+		storage_size += key_serializer.size(key) + value_serializer.size(value);
+	}
+
+	const size_t buffer_size = swiss_header_size + hash_table_size * (1 + sizeof(u32)) + storage_size;
+	const size_t prev_pos = buffer.size();
+	buffer.resize(buffer.size() + buffer_size);
+
+	u8* base_ptr = buffer.data() + prev_pos;
+	u8* control_ptr = base_ptr + swiss_header_size;
+	u8* index_ptr = control_ptr + hash_table_size;
+	u8* storage_base_ptr = index_ptr + hash_table_size * sizeof(u32);
+	std::fill(control_ptr, index_ptr, empty_tag);
+
+	BufferWriter storage_writer{ storage_base_ptr };
+	for (const auto& [key, value] : data) {
+		const u64 key_hash = hasher(key);
+
+		size_t group = static_cast<size_t>(key_hash) & group_mask;
+		for (size_t probe = 1; match_group(control_ptr + group * group_size, empty_tag) == 0; probe++) {
+			group = (group + probe) & group_mask;
+		}
+		const size_t slot = group * group_size
+			+ static_cast<size_t>(std::countr_zero(match_group(control_ptr + group * group_size, empty_tag)));
+
+		control_ptr[slot] = get_tag(key_hash);
+		BufferWriter{ index_ptr + slot * sizeof(u32) }.write_u32(static_cast<u32>(storage_writer.ptr() - storage_base_ptr));
+		key_serializer.write(key, storage_writer);
+		value_serializer.write(value, storage_writer);
+	}
+
+	BufferWriter header_writer{ base_ptr };
+	header_writer.write_u32(static_cast<u32>(buffer_size));
+	header_writer.write_u32(static_cast<u32>(data.size()));
+	header_writer.write_u32(static_cast<u32>(hash_table_size));
+	header_writer.write_u32(static_cast<u32>(storage_writer.ptr() - storage_base_ptr));
+	header_writer.write_u32(Config::KeyHash::id);
+	for (size_t i = 0; i < 3; i++) {
+		header_writer.write_u32(0);
+	}
+
+	return buffer_size;
+}
+
+template<typename Key, typename Value, typename Config>
+template<typename Map>
+size_t MappedMap<Key, Value, Config>::write_chained(const Map& data, std::vector<u8>& buffer)
 {
-	const size_t hash_table_size = choose_hash_table_size(data);
-	assert(hash_table_size != 0);
+	// Small and empty maps have no prime in the search range and use the single bucket.
+	const size_t hash_table_size = std::max<size_t>(choose_hash_table_size(data), 1);
 
 	typename Config::KeyHash hasher;
 	typename Config::KeySerializer key_serializer;
@@ -546,24 +1572,25 @@ size_t MappedMap<Key, Value, Config>::choose_hash_table_size(const Map& data)
 		std::lower_bound(prime_numbers.begin(), prime_numbers.end(), min_hash_table_size)
 		- prime_numbers.begin());
 
+	// Collisions are counted for the bounded number of the primes spread over the range, so the choice is O(N).
+	constexpr size_t max_candidate_count = 16;
+	const size_t prime_count = prime_numbers.size() - lowest_prime_pos;
+	const size_t candidate_count = std::min(max_candidate_count, prime_count);
+
 	size_t best_hash_table_size = 0;
-	int best_collision_count = INT_MAX;
-	for (size_t i = lowest_prime_pos; i < prime_numbers.size(); i++) {
-		const size_t hash_table_size = prime_numbers[i];
-		int collision_count = 0;
+	size_t best_collision_count = std::numeric_limits<size_t>::max();
+	std::vector<u32> index_to_count;
+	for (size_t candidate = 0; candidate < candidate_count; candidate++) {
+		const size_t hash_table_size = prime_numbers[lowest_prime_pos + candidate * prime_count / candidate_count];
+		size_t collision_count = 0;
 
-		std::vector<int> index_to_count(hash_table_size, 0);
+		index_to_count.assign(hash_table_size, 0);
 		for (size_t key_hash : hashes) {
 			const size_t index = key_hash % hash_table_size;
-			index_to_count[index]++;
+			// Every key after the first one in the bucket is the collision.
+			collision_count += index_to_count[index]++ != 0;
 		}
 
-		for (int count : index_to_count) {
-			if (count >= 2) {
-				collision_count += count - 1;
-			}
-		}
-		
 		if (collision_count < best_collision_count) {
 			best_collision_count = collision_count;
 			best_hash_table_size = hash_table_size;
@@ -589,8 +1616,9 @@ std::vector<size_t> MappedMap<Key, Value, Config>::find_prime_numbers(size_t n)
 		}
 	}
 
+	// 0 and 1 are not primes.
 	std::vector<size_t> prime_numbers;
-	for (size_t i = 0; i < is_prime.size(); i++) {
+	for (size_t i = 2; i < is_prime.size(); i++) {
 		if (is_prime[i]) {
 			prime_numbers.push_back(i);
 		}
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <functional>
+#include <vector>
+
+#include "mapped_storages.h"
+#include "to.h"
+
+namespace bpe {
+
+// Tags of the model file sections.
+enum class SectionTag : u32 {
+	tokens = 0x534E4B54,       // "TKNS" ShortStringsMappedArray of the token sequences
+	merge_table = 0x47524D4D,  // "MMRG" MappedMap of the merges
+	cache = 0x48434143,        // "CACH" MappedMap of the precalculated words
+	merge_ranks = 0x4B4E524D,  // "MRNK" MergeRanksMappedTable
+	cache_filter = 0x544C4643, // "CFLT" MappedBloomFilter of the cache words
+};
+
+// Model file: the header, the section table and the sections.
+// Every section starts at the offset aligned to section_alignment, so the mapped sections can be read in place
+// when the file itself is aligned to model_alignment.
+/*
+                                        Layout in the file.
+	╔══════════════════╦══════════════════╦══════════════════╦═══════════════════════════════════════════╗
+	║ Offset (bytes)   ║   Size (bytes)   ║ Field            ║ Description                               ║
+	╠══════════════════╬══════════════════╬══════════════════╬═══════════════════════════════════════════╣
+	║ 0                ║        4         ║ magic            ║ "BPEM"                                    ║
+	╠══════════════════╬══════════════════╬══════════════════╬═══════════════════════════════════════════╣
+	║ 4                ║        4         ║ version          ║ Format version                            ║
+	╠══════════════════╬══════════════════╬══════════════════╬═══════════════════════════════════════════╣
+	║ 8                ║        4         ║ section_count    ║ Number of sections S                      ║
+	╠══════════════════╬══════════════════╬══════════════════╬═══════════════════════════════════════════╣
+	║ 12               ║        4         ║ flags            ║ Bit 0 - the checksum is present           ║
+	╠══════════════════╬══════════════════╬══════════════════╬═══════════════════════════════════════════╣
+	║ 16               ║        8         ║ file_size        ║ Total file size                           ║
+	╠══════════════════╬══════════════════╬══════════════════╬═══════════════════════════════════════════╣
+	║ 24               ║        8         ║ checksum         ║ Checksum of the bytes [32, file_size)     ║
+	╠══════════════════╬══════════════════╬══════════════════╬═══════════════════════════════════════════╣
+	║ 32               ║      S × 24      ║ section_table    ║ (tag u32, reserved u32,                   ║
+	║                  ║                  ║                  ║  offset u64, size u64)                    ║
+	╠══════════════════╬══════════════════╬══════════════════╬═══════════════════════════════════════════╣
+	║ aligned to 64    ║    Variable      ║ sections         ║ Section payloads, each aligned to 64,     ║
+	║                  ║                  ║                  ║ zero padding between them                 ║
+	╚══════════════════╩══════════════════╩══════════════════╩═══════════════════════════════════════════╝
+*/
+class ModelFile {
+public:
+	static constexpr u32 magic = 0x4D455042; // "BPEM"
+	// Version 2: the cached ids are stored by CompactIdsSerializer.
+	// Version 3: the token strings are packed after the separate length table.
+	static constexpr u32 version = 3;
+	static constexpr size_t section_alignment = 64;
+	// Required alignment of the model in memory.
+	static constexpr size_t model_alignment = 16;
+
+	ModelFile();
+
+	// Parse the header and the section table of the model. Does not verify the checksum.
+	// Return false if the buffer is not the model of the supported version or it is truncated.
+	bool attach(const u8* data, size_t size);
+	// Read the model size from the header. Return 0 if the buffer is not the model.
+	static size_t read_size(const u8* data);
+
+	// Section of the model, nullptr if the model has no such section.
+	const u8* find(SectionTag tag) const;
+	// Whether the checksum is stored and it matches the data. O(size).
+	bool verify_checksum() const;
+	bool has_checksum() const { return (flags & checksum_flag) != 0; }
+
+	// Writer of the model sections.
+	class Writer {
+	public:
+		// Writes the section payload to the end of the buffer.
+		using WriteSection = std::function<void(std::vector<u8>& buffer)>;
+
+		void add_section(SectionTag tag, WriteSection write);
+		// Write the model to the buffer.
+		std::vector<u8> write(bool checksum) const;
+
+	private:
+		std::vector<std::pair<SectionTag, WriteSection>> sections;
+	};
+
+private:
+	static constexpr size_t header_size = 32;
+	static constexpr size_t table_entry_size = 24;
+	static constexpr u32 checksum_flag = 1;
+
+	static u64 compute_checksum(const u8* data, size_t size);
+
+	const u8* data;
+	size_t size;
+	u32 section_count;
+	u32 flags;
+	const u8* section_table;
+};
+
+} // namespace bpe
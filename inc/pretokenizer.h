@@ -0,0 +1,42 @@
+#pragma once
+
+#include <array>
+#include <string_view>
+
+#include "cpu_features.h"
+#include "to.h"
+
+namespace bpe {
+
+// Character classes of the pre-tokenizer.
+enum CharClass : u8 {
+	char_other = 0,
+	char_space = 1,
+	char_punctuation = 2,
+};
+
+// Class of every byte.
+inline constexpr std::array<u8, 256> char_classes = [] {
+	std::array<u8, 256> classes{};
+	for (const char c : std::string_view{ " \r\n\t" }) {
+		classes[static_cast<u8>(c)] = char_space;
+	}
+	for (const char c : std::string_view{ ",.?-\":;()[]<>{}%'!/#$^&*~|+=_" }) {
+		classes[static_cast<u8>(c)] = char_punctuation;
+	}
+	return classes;
+}();
+
+// Check if the character separates words.
+inline bool is_space(char c) { return char_classes[static_cast<u8>(c)] == char_space; }
+// Check if the character is split from the begin and the end of the word.
+inline bool is_punctuation(char c) { return char_classes[static_cast<u8>(c)] == char_punctuation; }
+
+// Find the first space at or after pos. Return text.size() if there is no space.
+// Uses the best kernel supported by the CPU.
+size_t find_space(std::string_view text, size_t pos);
+// Find the first space at or after pos with the given kernel, which must be supported by the CPU.
+// There is no SSSE3 kernel, the SSE2 one is used for it.
+size_t find_space(std::string_view text, size_t pos, SimdLevel level);
+
+} // namespace bpe
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <functional>
+#include <istream>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "bpe.h"
+
+namespace bpe {
+
+// Encoder of the text coming in chunks.
+// Text is encoded up to the last complete word boundary of the received data, so the ids are the same
+// as encode() of the whole text. Memory is bounded by the chunk size plus the longest word.
+template<TokenId Id>
+class BasicStreamEncoder {
+public:
+	// Receives ids of the next encoded part of the text.
+	using Sink = std::function<void(std::span<const Id> ids)>;
+
+	// Throws std::length_error if the vocabulary of the tokenizer does not fit the Id type.
+	BasicStreamEncoder(const Tokenizer& tokenizer, Sink sink);
+
+	// Append the chunk of the text. Ids of the complete words are passed to the sink.
+	void write(std::string_view chunk);
+	// Read and append the stream until the end of the stream.
+	void read(std::istream& stream, size_t chunk_size = default_chunk_size);
+	// Read and append the file descriptor until the end of the file.
+	void read(int fd, size_t chunk_size = default_chunk_size);
+	// Encode the rest of the text and pass it to the sink. The encoder can be used for the next text after that.
+	void finish();
+
+	static constexpr size_t default_chunk_size = 1 << 16;
+
+private:
+	static constexpr size_t no_boundary = 0;
+
+	const Tokenizer& tokenizer;
+	Sink sink;
+	EncodeScratch scratch;
+	std::vector<Id> ids;
+	// Text after the last encoded word boundary.
+	std::string pending;
+	// Chunk buffer for the read methods.
+	std::string chunk_buffer;
+	// Last word boundary in pending followed by a non-space. Text before it is complete.
+	size_t boundary;
+	// Last space in pending preceded by a non-space. It becomes the boundary when a non-space follows.
+	size_t candidate;
+
+	void encode_pending(size_t size);
+};
+
+using StreamEncoder = BasicStreamEncoder<u32>;
+
+// Decoder of the ids coming one at a time or in small batches, e.g. from the generation.
+// Tokens may end in the middle of the UTF-8 sequence, so only complete sequences are passed to the sink
+// and at most 3 bytes of the incomplete one are kept. The sink receives the same bytes as decode()
+// of all ids, invalid sequences are passed as is. Every token is decoded once.
+class StreamDecoder {
+public:
+	// Receives the next decoded part of the text.
+	using Sink = std::function<void(std::string_view text)>;
+
+	StreamDecoder(const Tokenizer& tokenizer, Sink sink);
+
+	// Decode the token. Complete UTF-8 text is passed to the sink.
+	void write(u32 id);
+	// Decode the tokens. Complete UTF-8 text is passed to the sink.
+	void write(std::span<const u32> ids);
+	// Pass the pending bytes of the incomplete sequence to the sink. The decoder can be used for the next ids after that.
+	void finish();
+
+	static constexpr size_t max_pending = 3;
+
+private:
+	const Tokenizer& tokenizer;
+	Sink sink;
+	// Pending bytes followed by the decoded tokens.
+	std::string text;
+
+	// Size of the prefix of the text which does not end inside the UTF-8 sequence.
+	static size_t complete_size(std::string_view text);
+};
+
+} // namespace bpe
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <thread>
+#include <vector>
+
+#include "to.h"
+
+namespace bpe {
+
+// Persistent pool of threads running batches of indexed tasks.
+// Tasks are distributed between per-worker queues by their weights, and idle workers steal
+// tasks from the back of the other queues, so one heavy task does not stall the whole batch.
+class ThreadPool {
+public:
+	// Task function: (task index, worker index). Worker index is less than thread_count().
+	using Task = std::function<void(size_t task, size_t worker)>;
+
+	// thread_count - total number of threads running tasks, including the calling thread.
+	explicit ThreadPool(size_t thread_count);
+	~ThreadPool();
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	// Total number of threads running tasks, including the calling thread.
+	size_t thread_count() const { return queues.size(); }
+
+	// Run tasks [0, task_count) and wait for all of them. The calling thread runs tasks too.
+	// weights - optional estimated cost of every task (e.g. bytes to process), empty for equal costs.
+	// Nested calls from inside a task run serially on the calling thread.
+	// The first exception thrown by a task is rethrown after all tasks have finished.
+	void run(size_t task_count, std::span<const u64> weights, const Task& task);
+	void run(size_t task_count, const Task& task) { run(task_count, {}, task); }
+
+	// Process-wide pool with one thread per hardware thread.
+	static ThreadPool& shared();
+
+private:
+	// Queue of the task indices owned by the single worker.
+	struct WorkQueue {
+		std::mutex mutex;
+		std::deque<size_t> tasks;
+	};
+
+	std::vector<std::unique_ptr<WorkQueue>> queues;
+	std::vector<std::thread> threads;
+
+	// Serializes concurrent run() calls.
+	std::mutex run_mutex;
+
+	// Job state shared with the workers.
+	std::mutex mutex;
+	std::condition_variable start_condition;
+	std::condition_variable done_condition;
+	const Task* job;
+	u64 generation;
+	size_t running_workers;
+	bool stop;
+	std::exception_ptr error;
+
+	void worker_loop(size_t worker);
+	void work(size_t worker);
+	bool pop_task(size_t worker, size_t& task);
+};
+
+} // namespace bpe
@@ -0,0 +1,128 @@
+#pragma once
+
+#include <cassert>
+#include <cstdio>
+#include <filesystem>
+#include <span>
+#include <string>
+#include <vector>
+
+#include "bpe.h"
+#include "mapped_storages.h"
+#include "to.h"
+
+namespace bpe {
+
+// Token shards of the tokenized corpus, ready to be memory mapped by the training jobs.
+// Shard NNNNN of the prefix is the pair of files:
+// PREFIX_NNNNN.bin - ids of all documents packed one after another, u16 or u32 little-endian, no header;
+// PREFIX_NNNNN.idx - the index of the documents.
+/*
+                                    Layout of the index file.
+	╔══════════════════╦══════════════════╦══════════════════╦═══════════════════════════════════════╗
+	║ Offset (bytes)   ║   Size (bytes)   ║ Field            ║ Description                           ║
+	╠══════════════════╬══════════════════╬══════════════════╬═══════════════════════════════════════╣
+	║ 0                ║        4         ║ magic            ║ "BPEI"                                ║
+	╠══════════════════╬══════════════════╬══════════════════╬═══════════════════════════════════════╣
+	║ 4                ║        4         ║ version          ║ Format version                        ║
+	╠══════════════════╬══════════════════╬══════════════════╬═══════════════════════════════════════╣
+	║ 8                ║        4         ║ id_size          ║ Size of the id in the .bin file, 2/4  ║
+	╠══════════════════╬══════════════════╬══════════════════╬═══════════════════════════════════════╣
+	║ 12               ║        4         ║ reserved         ║ Zero                                  ║
+	╠══════════════════╬══════════════════╬══════════════════╬═══════════════════════════════════════╣
+	║ 16               ║        8         ║ document_count   ║ Number of documents D                 ║
+	╠══════════════════╬══════════════════╬══════════════════╬═══════════════════════════════════════╣
+	║ 24               ║        8         ║ token_count      ║ Number of ids in the .bin file        ║
+	╠══════════════════╬══════════════════╬══════════════════╬═══════════════════════════════════════╣
+	║ 32               ║   (D + 1) × 8    ║ offsets          ║ Ids of the document i are             ║
+	║                  ║                  ║                  ║ [offsets[i], offsets[i + 1])          ║
+	╚══════════════════╩══════════════════╩══════════════════╩═══════════════════════════════════════╝
+*/
+struct TokenShardFormat {
+	static constexpr u32 magic = 0x49455042; // "BPEI"
+	static constexpr u32 version = 1;
+	static constexpr size_t header_size = 32;
+
+	// Path of the shard file: PREFIX_NNNNN.extension.
+	static std::filesystem::path get_path(const std::filesystem::path& prefix, size_t shard, std::string_view extension);
+};
+
+// Writer of the token shards. Documents are appended to the current shard, the next shard is started
+// when the current one has at least shard_tokens ids. Documents are never split between the shards.
+// Throws std::system_error if the files can not be written.
+class TokenShardWriter {
+public:
+	TokenShardWriter(const std::filesystem::path& prefix, size_t id_size, u64 shard_tokens);
+	~TokenShardWriter();
+
+	TokenShardWriter(const TokenShardWriter&) = delete;
+	TokenShardWriter& operator=(const TokenShardWriter&) = delete;
+
+	// Append the document. Id must be of the writer id size.
+	template<TokenId Id>
+	void write(std::span<const Id> ids)
+	{
+		assert(sizeof(Id) == id_size);
+		write_document(ids.data(), ids.size());
+	}
+	// Write the index of the last shard and close it. Called by the destructor if it was not called.
+	void finish();
+
+	size_t get_shard_count() const { return shard_count; }
+	u64 get_document_count() const { return document_count; }
+	u64 get_token_count() const { return token_count; }
+
+private:
+	std::filesystem::path prefix;
+	size_t id_size;
+	u64 shard_tokens;
+	// Data file of the current shard, nullptr if no shard is open.
+	std::FILE* data_file;
+	// Token offsets of the documents of the current shard.
+	std::vector<u64> offsets;
+	size_t shard_count;
+	u64 document_count;
+	u64 token_count;
+
+	void write_document(const void* ids, size_t count);
+	void close_shard();
+};
+
+// Memory mapped token shard.
+// Throws std::system_error if the files can not be mapped and std::runtime_error if the index is invalid.
+class TokenShard {
+public:
+	TokenShard(const std::filesystem::path& prefix, size_t shard, const MapOptions& options = {});
+
+	size_t get_id_size() const { return id_size; }
+	// Number of documents.
+	size_t size() const { return document_count; }
+	u64 get_token_count() const { return token_count; }
+
+	// Ids of all documents. Id must be of the shard id size.
+	template<TokenId Id>
+	std::span<const Id> ids() const
+	{
+		assert(sizeof(Id) == id_size);
+		return std::span<const Id>(reinterpret_cast<const Id*>(data.data()), to<size_t>(token_count));
+	}
+	// Ids of the document. Id must be of the shard id size.
+	template<TokenId Id>
+	std::span<const Id> document(size_t index) const
+	{
+		assert(index < document_count);
+		const u64 begin = BufferReader{ offsets + index * sizeof(u64) }.read<u64>();
+		const u64 end = BufferReader{ offsets + (index + 1) * sizeof(u64) }.read<u64>();
+		return ids<Id>().subspan(to<size_t>(begin), to<size_t>(end - begin));
+	}
+
+private:
+	MappedFile data;
+	MappedFile index;
+	size_t id_size;
+	size_t document_count;
+	u64 token_count;
+	const u8* offsets;
+};
+
+} // namespace bpe
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "to.h"
+
+namespace bpe {
+
+// Bounded in-memory cache of the encoded words.
+// The cache is split into shards by the word hash, every shard has its own lock and CLOCK eviction.
+class WordCache {
+public:
+	struct Config {
+		// Total memory budget of the cache in bytes.
+		size_t byte_budget;
+		// Number of independent shards.
+		size_t shard_count;
+		// Shorter words are not cached, they are encoded faster than looked up.
+		size_t min_word_size;
+
+		Config() : byte_budget(64 << 20), shard_count(64), min_word_size(3) {}
+	};
+
+	struct Stats {
+		u64 hits;
+		u64 misses;
+		u64 insertions;
+		u64 evictions;
+		// Number of cached words.
+		size_t words;
+		// Memory used by the cached words.
+		size_t bytes;
+
+		Stats() : hits(0), misses(0), insertions(0), evictions(0), words(0), bytes(0) {}
+	};
+
+	explicit WordCache(const Config& config);
+
+	// Append cached ids of the word to the ids vector. Return false if the word is not cached.
+	bool lookup(std::string_view word, std::vector<u32>& ids);
+	// Insert ids of the word, evicting not recently used words to fit the budget.
+	void insert(std::string_view word, std::span<const u32> ids);
+	// Whether the word can be cached at all.
+	bool accepts(std::string_view word) const { return word.size() >= config.min_word_size; }
+
+	// Counters summed over all shards.
+	Stats stats() const;
+
+private:
+	// Cached word.
+	struct Slot {
+		std::string word;
+		std::vector<u32> ids;
+		// Memory accounted for the slot, 0 if the slot is free.
+		size_t bytes;
+		// CLOCK reference bit.
+		bool referenced;
+	};
+
+	struct Shard {
+		mutable std::mutex mutex;
+		// Word to the slot index. Keys point to Slot::word.
+		std::unordered_map<std::string_view, u32> index;
+		// Slots are never moved, so the index keys stay valid.
+		std::deque<Slot> slots;
+		std::vector<u32> free_slots;
+		// CLOCK hand.
+		size_t hand;
+		size_t byte_budget;
+		Stats stats;
+
+		Shard() : hand(0), byte_budget(0) {}
+	};
+
+	const Config config;
+	std::vector<std::unique_ptr<Shard>> shards;
+
+	Shard& get_shard(std::string_view word) const;
+	static void evict(Shard& shard);
+	static size_t slot_bytes(std::string_view word, size_t id_count);
+};
+
+} // namespace bpe
@@ -0,0 +1,163 @@
+#pragma once
+
+#include <cassert>
+#include <cstring>
+#include <memory>
+#include <string_view>
+#include <vector>
+
+#include "mapped_storages.h"
+#include "to.h"
+
+namespace bpe {
+
+// Counter of the words of the corpus.
+// Open addressing table with the linear probing, every occurrence costs a single probe sequence and no
+// allocations. Words are copied into the append-only arena once, when they are met for the first time.
+class WordCounter {
+public:
+	WordCounter();
+
+	WordCounter(WordCounter&&) noexcept = default;
+	WordCounter& operator=(WordCounter&&) noexcept = default;
+
+	// Add count occurrences of the word.
+	void add(std::string_view word, u64 count = 1) { add(word, get_hash(word), count); }
+	// Add the counts of the other counter.
+	void merge(const WordCounter& other);
+	// Add the counts of the other counter and release it. The empty counter takes the other one as is.
+	void merge(WordCounter&& other);
+	// Number of occurrences of the word, 0 if the word was never added.
+	u64 get(std::string_view word) const;
+
+	// Number of distinct words.
+	size_t size() const { return word_count; }
+	bool empty() const { return word_count == 0; }
+	// Prepare the table for the words without growing.
+	void reserve(size_t words);
+
+	// Call function(std::string_view word, u64 count) for every word in no particular order.
+	template<typename F>
+	void for_each(F&& function) const
+	{
+		for (const Slot& slot : slots) {
+			if (slot.count != 0) {
+				function(std::string_view{ slot.data, slot.size }, slot.count);
+			}
+		}
+	}
+
+	// Memory allocated by the table and the arena in bytes.
+	size_t get_memory_usage() const { return slots.capacity() * sizeof(Slot) + arena_bytes; }
+
+private:
+	friend class ShardedWordCounter;
+
+	// Slot of the table, free if count is 0.
+	struct Slot {
+		// Word in the arena.
+		const char* data;
+		u64 count;
+		u32 size;
+		// Low bits select the slot, all bits reject the most of the different words without comparing them.
+		u32 hash;
+	};
+
+	static constexpr size_t initial_capacity = 256;
+	static constexpr size_t min_arena_chunk_size = 4 << 10;
+	static constexpr size_t max_arena_chunk_size = 256 << 10;
+
+	std::vector<Slot> slots;
+	size_t word_count;
+	// Arena chunks are never moved or freed while the counter is alive, so the slots point into them.
+	std::vector<std::unique_ptr<char[]>> arena;
+	char* arena_pos;
+	size_t arena_free;
+	size_t arena_bytes;
+
+	static u32 get_hash(std::string_view word)
+	{
+		const u64 hash = StringHash{}(word);
+		return static_cast<u32>(hash ^ (hash >> 32));
+	}
+
+	void add(std::string_view word, u32 hash, u64 count);
+	// Copy the word into the arena.
+	const char* store(std::string_view word);
+	// Double the table.
+	void grow();
+	void rehash(size_t capacity);
+};
+
+inline void WordCounter::add(std::string_view word, u32 hash, u64 count)
+{
+	assert(count > 0);
+	// The load factor is kept at most 3/4.
+	if (4 * (word_count + 1) > 3 * slots.size()) {
+		grow();
+	}
+
+	const size_t mask = slots.size() - 1;
+	for (size_t index = hash & mask;; index = (index + 1) & mask) {
+		Slot& slot = slots[index];
+		if (slot.count == 0) {
+			slot.data = store(word);
+			slot.count = count;
+			slot.size = to<u32>(word.size());
+			slot.hash = hash;
+			word_count++;
+			return;
+		}
+		if (slot.hash == hash && slot.size == word.size() && std::memcmp(slot.data, word.data(), word.size()) == 0) {
+			slot.count += count;
+			return;
+		}
+	}
+}
+
+// Word counter partitioned by the word hash into the independent shards.
+// The counters of the corpus parts are merged shard by shard in parallel, every shard by its own thread.
+class ShardedWordCounter {
+public:
+	explicit ShardedWordCounter(size_t shard_count = 1);
+
+	ShardedWordCounter(ShardedWordCounter&&) noexcept = default;
+	ShardedWordCounter& operator=(ShardedWordCounter&&) noexcept = default;
+
+	// Add count occurrences of the word.
+	void add(std::string_view word, u64 count = 1)
+	{
+		const u32 hash = WordCounter::get_hash(word);
+		shards[get_shard_index(hash)].add(word, hash, count);
+	}
+	// Number of occurrences of the word, 0 if the word was never added.
+	u64 get(std::string_view word) const { return shards[get_shard_index(WordCounter::get_hash(word))].get(word); }
+
+	// Number of distinct words.
+	size_t size() const;
+	bool empty() const { return size() == 0; }
+
+	// Call function(std::string_view word, u64 count) for every word in no particular order.
+	template<typename F>
+	void for_each(F&& function) const
+	{
+		for (const auto& shard : shards) {
+			shard.for_each(function);
+		}
+	}
+
+	size_t get_shard_count() const { return shards.size(); }
+	WordCounter& get_shard(size_t index) { return shards[index]; }
+	const WordCounter& get_shard(size_t index) const { return shards[index]; }
+
+	// Memory allocated by all shards in bytes.
+	size_t get_memory_usage() const;
+
+private:
+	std::vector<WordCounter> shards;
+
+	// The shard is selected by the high bits of the hash, the low bits select the slot in the shard.
+	size_t get_shard_index(u32 hash) const { return to<size_t>((u64{ hash } * shards.size()) >> 32); }
+};
+
+} // namespace bpe
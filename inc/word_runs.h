@@ -0,0 +1,56 @@
+#pragma once
+
+#include <filesystem>
+#include <functional>
+#include <mutex>
+#include <string_view>
+#include <vector>
+
+#include "to.h"
+#include "word_counter.h"
+
+namespace bpe {
+
+// Sorted runs of the word counts spilled to the disk by the out-of-core counting.
+// The counter which exceeds its memory budget is written as the run and cleared, merge() sums the counts
+// of the runs. Every run is the sequence of the records in the ascending word order:
+// u32 word size, word bytes, u64 count.
+// The merge reads at most get_merge_fan_in() runs at once, so its buffers and open files fit the memory
+// budget. More runs are merged in several passes into the intermediate runs.
+// Throws std::system_error if the runs can not be written or read.
+class WordRunSpiller {
+public:
+	// Runs are created in the directory, the empty directory is the system temporary directory.
+	// The memory budget sizes the file buffers and the merge fan-in.
+	WordRunSpiller(const std::filesystem::path& directory, size_t memory_budget);
+	// Removes the runs which were not merged.
+	~WordRunSpiller();
+
+	WordRunSpiller(const WordRunSpiller&) = delete;
+	WordRunSpiller& operator=(const WordRunSpiller&) = delete;
+
+	// Write the words of the counter as the new run and clear the counter. Thread-safe.
+	void spill(ShardedWordCounter& counter);
+	// Merge all runs and remove them. Call function(std::string_view word, u64 count) for the words
+	// with the total count at least min_count in the ascending word order.
+	void merge(u64 min_count, const std::function<void(std::string_view, u64)>& function);
+
+	size_t get_run_count() const;
+	// Maximum number of the runs merged in one pass.
+	size_t get_merge_fan_in() const { return merge_fan_in; }
+
+private:
+	std::filesystem::path directory;
+	// Buffer of every read or written run.
+	size_t buffer_size;
+	size_t merge_fan_in;
+	// Unique prefix of the run names of this spiller.
+	std::string name_prefix;
+	mutable std::mutex mutex;
+	std::vector<std::filesystem::path> runs;
+	size_t next_run;
+
+	std::filesystem::path get_next_run_path();
+};
+
+} // namespace bpe
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <cassert>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "mapped_storages.h"
+#include "to.h"
+
+namespace bpe {
+
+// Approximate counter of the most frequent words in the fixed memory.
+// Every occurrence updates the Count-Min sketch of depth rows of width counters, the word estimate is
+// the minimum of its counters in all rows. The sketch is updated conservatively: only the counters below
+// the new estimate are raised. The top_size words with the largest estimates are kept in the table with
+// their counts, the word with the smallest count is replaced when a new word has the larger estimate.
+// The counts never go below the true ones and exceed them by at most get_error_bound() with probability
+// 1 - get_error_probability() per word. The words which are not kept in the table are lost.
+class WordSketch {
+public:
+	// The width is rounded up to the power of two.
+	WordSketch(size_t top_size, size_t width, size_t depth);
+
+	WordSketch(WordSketch&&) noexcept = default;
+	WordSketch& operator=(WordSketch&&) noexcept = default;
+
+	// Add count occurrences of the word.
+	void add(std::string_view word, u64 count = 1);
+	// Add the counts of the other sketch of the same dimensions.
+	void merge(const WordSketch& other);
+	// Estimated number of occurrences of the word, never less than the true one.
+	u64 estimate(std::string_view word) const;
+	// Count of the word in the table, 0 if the word is not kept.
+	u64 get(std::string_view word) const;
+
+	// Number of the kept words.
+	size_t size() const { return entries.size(); }
+	// Number of all added occurrences.
+	u64 get_total() const { return total; }
+	// Maximum excess of the counts over the true ones: e / width of all occurrences.
+	u64 get_error_bound() const;
+	// Probability that the count of a word exceeds the error bound: exp(-depth).
+	double get_error_probability() const;
+
+	size_t get_top_size() const { return top_size; }
+	size_t get_width() const { return width_mask + 1; }
+	size_t get_depth() const { return depth; }
+	// Memory allocated by the sketch and the table in bytes, it does not depend on the number of the words.
+	size_t get_memory_usage() const;
+
+	// Call function(std::string_view word, u64 count) for every kept word in no particular order.
+	template<typename F>
+	void for_each(F&& function) const
+	{
+		for (const Entry& entry : entries) {
+			function(std::string_view{ entry.word }, entry.count);
+		}
+	}
+
+private:
+	struct Entry {
+		std::string word;
+		u64 count;
+		// Position in the heap.
+		u32 heap_index;
+	};
+
+	size_t top_size;
+	size_t width_mask;
+	size_t depth;
+	// Rows one after another.
+	std::vector<u64> counters;
+	u64 total;
+	// Entries are never reallocated, the index refers to their words.
+	std::vector<Entry> entries;
+	std::unordered_map<std::string_view, u32, StringHash> index;
+	// Min-heap of the entries by the count.
+	std::vector<u32> heap;
+
+	// Counter of the row for the word hash. The rows use the double hashing of the halves of the hash.
+	size_t get_counter(u64 hash, size_t row) const
+	{
+		const u64 step = (hash >> 32) | 1;
+		return row * (width_mask + 1) + ((hash + row * step) & width_mask);
+	}
+	// Conservative update of the sketch, return the new estimate.
+	u64 update(u64 hash, u64 count);
+	u64 estimate(u64 hash) const;
+	// Set the count of the word, keep the word if it is among the top_size largest counts.
+	void offer(std::string_view word, u64 count);
+	// Restore the heap after the count of the entry has grown.
+	void sift_down(size_t heap_index);
+};
+
+} // namespace bpe
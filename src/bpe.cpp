@@ -1,33 +1,25 @@
 ﻿#include "bpe.h"
+#include "thread_pool.h"
 
 #include <cassert>
 #include <algorithm>
 #include <queue>
-#include <fstream>
 #include <iostream>
 #include <cstdint>
 #include <string>
 #include <filesystem>
+#include <stdexcept>
 #include <unordered_set>
 #include <thread>
+#include <mutex>
 #include <optional>
-#include <numeric>
+#include <exception>
+#include <cstring>
 
 
 namespace bpe {
 
 
-bool is_space(char c)
-{
-	return c == ' ' || c == '\r' || c == '\n' || c == '\t';
-}
-
-bool is_punctuation(char c)
-{
-	static const std::unordered_set<char> punctuations_set{ ',', '.', '?', '-', '"', ':', ';', '(', ')', '[', ']', '<', '>', '{', '}', '%', '\'', '!', '/', '#', '$', '%', '^', '&', '*', '~', '|', '+', '=' , '\'', '_', '~'  };
-	return punctuations_set.find(c) != punctuations_set.end();
-}
-
 PrefixBodySuffix split_prefix_body_suffix(std::string_view word)
 {
 	size_t begin = 0;
@@ -72,62 +64,84 @@ PrefixBodySuffix split_prefix_body_suffix(std::string_view word)
 	return {prefix, body, suffix};
 }
 
-std::vector<std::string_view> split_by_words(std::string_view text)
+WordIterator::WordIterator(std::string_view _text) :
+	text(_text),
+	tail(_text.size()),
+	next(0),
+	part(0),
+	part_count(0)
 {
-	// Find all space intervals.
-	std::vector<std::pair<size_t, size_t>> spaces;
-	{
-		std::optional<size_t> begin;
-		for (size_t i = 0; i < text.size(); i++) {
-			if (is_space(text[i])) {
-				if (!begin) {
-					begin = i;
-				}
-				continue;
-			}
+	while (tail > 0 && is_space(text[tail - 1])) {
+		tail--;
+	}
+	next_segment();
+}
 
-			if (begin) {
-				spaces.emplace_back(*begin, i);
-				begin = std::nullopt;
-			}
+// Every space followed by a non-space starts a new segment, so the last space of a gap is glued
+// to the right word, and the trailing spaces of the text stay with the last word.
+// Segments are split to prefix, body and suffix, empty parts are skipped.
+void WordIterator::next_segment()
+{
+	part = 0;
+	part_count = 0;
+	while (part_count == 0 && next <= text.size()) {
+		const size_t begin = next;
+		size_t end = (begin < tail) ? find_space(text.substr(0, tail), begin + 1) : tail;
+		if (end >= tail) {
+			end = text.size();
+			next = text.size() + 1;
+		} else {
+			next = end;
 		}
-	}
 
-	// Find split points by gaps.
-	std::vector<size_t> split_points;
-	split_points.push_back(0); // Begin of the text.
-	for (const auto& space : spaces) {
-		const size_t space_length = space.second - space.first;
-		for (size_t i = 0; i < space_length; i++) {
-			split_points.push_back(space.first + i);
+		const auto [prefix, body, suffix] = split_prefix_body_suffix(text.substr(begin, end - begin));
+		for (const auto item : { prefix, body, suffix }) {
+			if (!item.empty()) {
+				parts[part_count++] = item;
+			}
 		}
 	}
-	split_points.push_back(text.size()); // End of the text;
 
-	// Split by words.
-	std::vector<std::string_view> words;
-	words.reserve(split_points.size());
-	for (size_t i = 0; i < split_points.size() - 1; i++) {
-		const size_t begin = split_points[i];
-		const size_t end = split_points[i + 1];
-		const std::string_view word{ text.data() + begin, end - begin };
-
-		const PrefixBodySuffix prefix_body_suffix = split_prefix_body_suffix(word);
+	// The end iterator is equal to the default constructed one.
+	if (part_count == 0) {
+		*this = WordIterator{};
+	}
+}
 
-		const auto prefix = std::get<0>(prefix_body_suffix);
-		const auto body = std::get<1>(prefix_body_suffix);
-		const auto suffix = std::get<2>(prefix_body_suffix);
+void split_by_words(std::string_view text, std::vector<std::string_view>& result)
+{
+	result.clear();
+	for (const auto word : words(text)) {
+		result.push_back(word);
+	}
+}
 
-		if (!prefix.empty()) {
-			words.push_back(prefix);
+// Word boundary is the space preceded by a non-space and followed by a non-space somewhere later.
+// Both parts of the text end up with the same split points as the whole text.
+size_t find_word_boundary(std::string_view text, size_t pos)
+{
+	for (size_t i = find_space(text, std::min(std::max<size_t>(pos, 1), text.size())); i < text.size();
+		i = find_space(text, i + 1)) {
+		if (is_space(text[i - 1])) {
+			continue;
 		}
-		if (!body.empty()) {
-			words.push_back(body);
+
+		size_t next = i + 1;
+		while (next < text.size() && is_space(text[next])) {
+			next++;
 		}
-		if (!suffix.empty()) {
-			words.push_back(suffix);
+		if (next == text.size()) {
+			break;
 		}
+		return i;
 	}
+	return text.size();
+}
+
+std::vector<std::string_view> split_by_words(std::string_view text)
+{
+	std::vector<std::string_view> words;
+	split_by_words(text, words);
 	return words;
 }
 
@@ -338,101 +352,257 @@ void TokenizerTrainer::init_id_to_seq()
 void TokenizerTrainer::create_vocab_from_word_vocab()
 {
 	vocab.reserve(word_vocab.size());
-	for (const auto& item : word_vocab) {
-		if (item.second < config.min_count) {
-			continue;
+	word_vocab.for_each([&](std::string_view word, u64 count) {
+		if (count < config.min_count) {
+			return;
 		}
 		VocabEntry entry;
-		entry.ids.reserve(item.first.size());
-		for (auto id : item.first) {
+		entry.ids.reserve(word.size());
+		for (auto id : word) {
 			entry.ids.push_back(static_cast<u8>(id));
 		}
-		entry.count = item.second;
-		entry.text = item.first;
+		entry.count = count;
+		entry.text = word;
 		vocab.push_back(entry);
+	});
+}
+
+// Replace the vocabulary with the merged runs and the counts in memory, only the words with min_count are kept.
+void TokenizerTrainer::merge_spilled_word_vocab()
+{
+	if (spiller == nullptr || spiller->get_run_count() == 0) {
+		return;
 	}
+	if (!word_vocab.empty()) {
+		spiller->spill(word_vocab);
+	}
+	spiller->merge(config.min_count, [&](std::string_view word, u64 count) { word_vocab.add(word, count); });
 }
 
-static void build_vocabulary_single_thread(
-	const std::string& path, size_t begin, size_t end, 
-	std::unordered_map<std::string, u64>& word_vocab)
+// Fill the vocabulary with the approximate counts of the most frequent words.
+void TokenizerTrainer::fill_word_vocab_from_sketch()
 {
-	std::ifstream file{ path, std::ios_base::in };
-	file.seekg(std::streampos{ to<std::streamoff>(begin) });
+	if (sketch == nullptr) {
+		return;
+	}
+	word_vocab = ShardedWordCounter{ word_vocab.get_shard_count() };
+	sketch->for_each([&](std::string_view word, u64 count) { word_vocab.add(word, count); });
+}
 
-	static constexpr size_t vocabulary_init_size = 1000000;
+// Call function(std::string_view line) for the lines of the text. Newlines are not the part of the lines,
+// the last line may have no newline.
+template<typename F>
+static void for_each_line(std::string_view text, F&& function)
+{
+	while (!text.empty()) {
+		const void* newline = std::memchr(text.data(), '\n', text.size());
+		const size_t line_size = newline != nullptr
+			? to<size_t>(static_cast<const char*>(newline) - text.data())
+			: text.size();
+		function(text.substr(0, line_size));
+		text.remove_prefix(std::min(line_size + 1, text.size()));
+	}
+}
 
-	std::string line;
-	word_vocab.reserve(vocabulary_init_size);
-	while (std::getline(file, line)) {
-		std::vector<std::string_view> words = split_by_words(line);
-		for (const auto& word : words) {
-			if (word.empty()) {
-				continue;
+// Count the words of the lines of the text. The counter is passed to flush(word_vocab) every time its memory
+// exceeds the memory budget, 0 is no budget. The flush must empty the counter.
+template<typename F>
+static void build_vocabulary_on_lines(std::string_view text, ShardedWordCounter& word_vocab,
+	size_t memory_budget, F&& flush)
+{
+	// The memory of the counter changes only when it grows, so it is checked once in a while.
+	static constexpr size_t budget_check_size = 64 << 10;
+
+	size_t unchecked_size = 0;
+	for_each_line(text, [&](std::string_view line) {
+		for (const auto word : words(line)) {
+			if (!word.empty()) {
+				word_vocab.add(word);
 			}
-			std::string word_str{ word };
-			if (word_vocab.find(word_str) == word_vocab.end()) {
-				word_vocab[word_str] = 1;
-			} else {
-				word_vocab[word_str]++;
+		}
+
+		unchecked_size += line.size() + 1;
+		if (memory_budget != 0 && unchecked_size >= budget_check_size) {
+			unchecked_size = 0;
+			if (word_vocab.get_memory_usage() > memory_budget) {
+				flush(word_vocab);
 			}
 		}
-		if (static_cast<size_t>(file.tellg()) >= end) {
-			break;
+	});
+}
+
+// Count the words of the lines of the text approximately.
+static void build_sketch_on_lines(std::string_view text, WordSketch& sketch)
+{
+	for_each_line(text, [&](std::string_view line) {
+		for (const auto word : words(line)) {
+			if (!word.empty()) {
+				sketch.add(word);
+			}
 		}
+	});
+}
+
+// Start of the first line which starts at or after the position.
+// The chunks split at the line starts count every line exactly once.
+static size_t get_next_line_start(std::string_view text, size_t pos)
+{
+	if (pos == 0 || pos >= text.size()) {
+		return std::min(pos, text.size());
 	}
+	const void* newline = std::memchr(text.data() + pos - 1, '\n', text.size() - pos + 1);
+	return newline != nullptr ? to<size_t>(static_cast<const char*>(newline) - text.data()) + 1 : text.size();
 }
 
-static void build_vocabulary_multiple_threads(
-	const std::string& path, size_t file_size, u32 max_worker,
-	std::unordered_map<std::string, u64>& word_vocab)
+// Split the text into at most max_worker chunks at the line starts, the long lines leave some of the chunks out.
+static std::vector<std::string_view> split_into_line_chunks(std::string_view text, u32 max_worker)
 {
-	const size_t chunk_size = file_size / max_worker;
+	const size_t chunk_size = text.size() / max_worker;
 	assert(chunk_size >= 1);
 
-	// Split work.
-	std::vector<std::pair<size_t, size_t>> ranges;
-	ranges.reserve(max_worker);
-	for (size_t i = 0; i < max_worker; i++) {
-		ranges.emplace_back(i * chunk_size, std::min<size_t>(file_size, (i + 1) * chunk_size));
+	std::vector<std::string_view> chunks;
+	chunks.reserve(max_worker);
+	size_t begin = 0;
+	for (size_t i = 1; i <= max_worker; i++) {
+		const size_t end = i == max_worker ? text.size() : std::max(begin, get_next_line_start(text, i * chunk_size));
+		if (end > begin) {
+			chunks.push_back(text.substr(begin, end - begin));
+		}
+		begin = end;
 	}
+	return chunks;
+}
 
-	// Start all threads.
-	std::vector<std::unordered_map<std::string, u64>> word_vocabs(ranges.size());
-	std::vector<std::thread> threads;
-	for (size_t i = 0; i < ranges.size(); i++) {
-		const auto& range = ranges[i];
-		std::thread thread{ build_vocabulary_single_thread, path, range.first, range.second, std::ref(word_vocabs[i])};
-		threads.push_back(std::move(thread));
+// Every thread counts its chunk into its own sketch, the sketches are merged into the first one.
+static void build_sketch_multiple_threads(std::string_view text, u32 max_worker, WordSketch& sketch)
+{
+	const std::vector<std::string_view> chunks = split_into_line_chunks(text, max_worker);
+
+	std::vector<WordSketch> sketches;
+	sketches.reserve(chunks.size() - 1);
+	for (size_t i = 1; i < chunks.size(); i++) {
+		sketches.emplace_back(sketch.get_top_size(), sketch.get_width(), sketch.get_depth());
 	}
 
-	// Wait for all threads to terminate.
+	std::vector<std::exception_ptr> errors(chunks.size());
+	std::vector<std::thread> threads;
+	for (size_t i = 0; i < chunks.size(); i++) {
+		threads.emplace_back([&, i] {
+			try {
+				build_sketch_on_lines(chunks[i], i == 0 ? sketch : sketches[i - 1]);
+			} catch (...) {
+				errors[i] = std::current_exception();
+			}
+		});
+	}
 	for (auto& thread : threads) {
 		thread.join();
 	}
+	for (const auto& error : errors) {
+		if (error) {
+			std::rethrow_exception(error);
+		}
+	}
 
-	// Merge vocabularies from threads into one vocabulary.
-	word_vocab.reserve(2 * word_vocabs.front().size());
-	for (const auto& thread_vocab : word_vocabs) {
-		for (const auto& [word, count] : thread_vocab) {
-			if (!word_vocab.contains(word)) {
-				word_vocab.emplace(word, count);
-			} else {
-				word_vocab[word] += count;
+	for (const auto& thread_sketch : sketches) {
+		sketch.merge(thread_sketch);
+	}
+}
+
+static void build_vocabulary_multiple_threads(
+	std::string_view text, u32 max_worker, ShardedWordCounter& word_vocab,
+	WordRunSpiller* spiller, size_t memory_budget)
+{
+	// Memory of the counts of a thread after which they are merged into the vocabulary. The words are
+	// stored once in the vocabulary and at most once more in the counts of every thread, which stay small.
+	static constexpr size_t thread_vocabulary_size = 4 << 20;
+
+	// Split work at the line starts.
+	const std::vector<std::string_view> chunks = split_into_line_chunks(text, max_worker);
+
+	// Count the chunks into the shards of the same partition as the vocabulary. Every shard of the
+	// vocabulary has its own lock, so the threads merge the different shards at the same time.
+	const size_t shard_count = word_vocab.get_shard_count();
+	std::vector<std::mutex> shard_mutexes(shard_count);
+	const auto merge_into_vocabulary = [&](ShardedWordCounter& thread_vocab, size_t thread_index) {
+		// The threads start at different shards to wait less for each other. The merged shard is
+		// released at once and the first one is moved into the empty vocabulary shard without copying.
+		for (size_t i = 0; i < shard_count; i++) {
+			const size_t shard = (thread_index + i) % shard_count;
+			if (thread_vocab.get_shard(shard).empty()) {
+				continue;
 			}
+			const std::lock_guard lock{ shard_mutexes[shard] };
+			word_vocab.get_shard(shard).merge(std::move(thread_vocab.get_shard(shard)));
+		}
+	};
+
+	// Start all threads. With the spiller the counts of every chunk go to the runs instead,
+	// the vocabulary is merged from the runs by build_bpe().
+	std::vector<std::exception_ptr> errors(chunks.size());
+	std::vector<std::thread> threads;
+	for (size_t i = 0; i < chunks.size(); i++) {
+		threads.emplace_back([&, i] {
+			try {
+				ShardedWordCounter thread_vocab{ shard_count };
+				if (spiller != nullptr) {
+					const auto spill = [&](ShardedWordCounter& counts) { spiller->spill(counts); };
+					build_vocabulary_on_lines(chunks[i], thread_vocab, std::max<size_t>(memory_budget / chunks.size(), 1), spill);
+					if (!thread_vocab.empty()) {
+						spiller->spill(thread_vocab);
+					}
+				} else {
+					const auto merge = [&](ShardedWordCounter& counts) { merge_into_vocabulary(counts, i); };
+					build_vocabulary_on_lines(chunks[i], thread_vocab, thread_vocabulary_size, merge);
+					merge_into_vocabulary(thread_vocab, i);
+				}
+			} catch (...) {
+				errors[i] = std::current_exception();
+			}
+		});
+	}
+
+	// Wait for all threads to terminate.
+	for (auto& thread : threads) {
+		thread.join();
+	}
+	for (const auto& error : errors) {
+		if (error) {
+			std::rethrow_exception(error);
 		}
 	}
 }
 
 std::vector<u8> TokenizerTrainer::save() const
 {
-	std::vector<u8> buffer;
-
-	ShortStringsMappedArray::write_to_buffer(id_to_seq, buffer);
-	MergeTable::write_to_buffer(merge_table, buffer);
-	Cache::write_to_buffer(cache, buffer);
+	// The partitions of the perfect merge table are built by max_worker threads.
+	std::optional<ThreadPool> pool;
+	if (config.max_worker > 1) {
+		pool.emplace(config.max_worker);
+	}
 
-	return buffer;
+	ModelFile::Writer writer;
+	writer.add_section(SectionTag::tokens,
+		[&](std::vector<u8>& buffer) { ShortStringsMappedArray::write_to_buffer(id_to_seq, buffer); });
+	writer.add_section(SectionTag::merge_table,
+		[&](std::vector<u8>& buffer) { MergeTable::write_to_buffer(merge_table, buffer, pool ? &*pool : nullptr); });
+	writer.add_section(SectionTag::cache,
+		[&](std::vector<u8>& buffer) { Cache::write_to_buffer(cache, buffer); });
+	if (config.merge_ranks) {
+		writer.add_section(SectionTag::merge_ranks,
+			[&](std::vector<u8>& buffer) { MergeRanksMappedTable::write_to_buffer(merge_table, id_to_seq.size(), buffer); });
+	}
+	if (config.cache_filter_bits > 0 && !cache.empty()) {
+		writer.add_section(SectionTag::cache_filter, [&](std::vector<u8>& buffer) {
+			std::vector<std::string_view> cache_words;
+			cache_words.reserve(cache.size());
+			for (const auto& [word, ids] : cache) {
+				cache_words.push_back(word);
+			}
+			MappedBloomFilter::write_to_buffer(cache_words, config.cache_filter_bits, buffer);
+		});
+	}
+	return writer.write(config.checksum);
 }
 
 void TokenizerTrainer::build_bpe()
@@ -441,6 +611,8 @@ void TokenizerTrainer::build_bpe()
 	assert(merge_table.empty());
 
 	init_id_to_seq();
+	merge_spilled_word_vocab();
+	fill_word_vocab_from_sketch();
 	create_vocab_from_word_vocab();
 	train_bpe();
 	build_cache();
@@ -485,30 +657,46 @@ void TokenizerTrainer::build_cache()
 
 void TokenizerTrainer::build_vocabulary_on_text(const std::string& text)
 {
-	std::vector<std::string_view> words = split_by_words(text);
-	for (const auto& word : words) {
-		const std::string word_str{ word };
-		if (!word_vocab.contains(word_str)) {
-			word_vocab[word_str] = 1;
-		} else {
-			word_vocab[word_str]++;
+	if (sketch != nullptr) {
+		for (const auto word : words(text)) {
+			sketch->add(word);
 		}
+		return;
+	}
+	for (const auto word : words(text)) {
+		word_vocab.add(word);
+	}
+	if (spiller != nullptr && word_vocab.get_memory_usage() > config.memory_budget) {
+		spiller->spill(word_vocab);
 	}
 }
 
 void TokenizerTrainer::build_vocabulary(const std::string& path, size_t symbols_count)
 {
-	size_t file_size = std::filesystem::file_size(path);
+	// Words are counted right in the mapping, the threads read their chunks sequentially.
+	MapOptions options;
+	options.sequential = true;
+	const MappedFile file{ path, options };
+	std::string_view text{ reinterpret_cast<const char*>(file.data()), file.size() };
 	if (symbols_count > 0) {
-		file_size = std::min<size_t>(file_size, symbols_count);
+		// The line which crosses the limit is counted whole.
+		text = text.substr(0, get_next_line_start(text, std::min(symbols_count, text.size())));
 	}
 
 	constexpr size_t single_thread_file_size = 16384;
 
-	if (config.max_worker == 1 || file_size <= single_thread_file_size) {
-		build_vocabulary_single_thread(path, 0, file_size, word_vocab);
+	if (sketch != nullptr) {
+		if (config.max_worker == 1 || text.size() <= single_thread_file_size) {
+			build_sketch_on_lines(text, *sketch);
+		} else {
+			build_sketch_multiple_threads(text, config.max_worker, *sketch);
+		}
+	} else if (config.max_worker == 1 || text.size() <= single_thread_file_size) {
+		// The spiller exists only with the memory budget.
+		build_vocabulary_on_lines(text, word_vocab, config.memory_budget,
+			[&](ShardedWordCounter& counts) { spiller->spill(counts); });
 	} else {
-		build_vocabulary_multiple_threads(path, file_size, config.max_worker, word_vocab);
+		build_vocabulary_multiple_threads(text, config.max_worker, word_vocab, spiller.get(), config.memory_budget);
 	}
 }
 
@@ -522,90 +710,456 @@ void TokenizerTrainer::train_on_text(const std::string& text)
 	build_vocabulary_on_text(text);
 }
 
-Tokenizer::Tokenizer(const std::filesystem::path& path)
+Tokenizer::Tokenizer(const std::filesystem::path& path, const MapOptions& options)
+{
+	load(path, options);
+}
+
+void Tokenizer::load(const std::filesystem::path& path, const MapOptions& options)
+{
+	MappedFile mapped(path, options);
+	if (!attach(mapped.data(), mapped.size())) {
+		throw std::runtime_error("Not a tokenizer model: " + path.string());
+	}
+	// Release the previous mapping only after the storages are switched to the new one.
+	file = std::move(mapped);
+}
+
+bool Tokenizer::attach(const u8* data)
 {
-	load(path);
+	return attach(data, ModelFile::read_size(data));
 }
 
-void Tokenizer::load(const std::filesystem::path& path)
+bool Tokenizer::attach(const u8* data, size_t size)
 {
-	memory = load_file_to_buffer(path);
-	attach(memory.data());
+	ModelFile attached_model;
+	if (!attached_model.attach(data, size)) {
+		return false;
+	}
+	const u8* tokens = attached_model.find(SectionTag::tokens);
+	const u8* merges = attached_model.find(SectionTag::merge_table);
+	const u8* cached_words = attached_model.find(SectionTag::cache);
+	if (tokens == nullptr || merges == nullptr || cached_words == nullptr) {
+		return false;
+	}
+
+	// The maps written with other hash functions can not be read.
+	MergeTable attached_merge_table;
+	Cache attached_cache;
+	if (attached_merge_table.attach(merges) == 0 || attached_cache.attach(cached_words) == 0) {
+		return false;
+	}
+
+	model = attached_model;
+	id_to_seq.attach(tokens);
+	merge_table = attached_merge_table;
+	cache = attached_cache;
+
+	// Optional sections.
+	merge_ranks = MergeRanksMappedTable{};
+	if (const u8* ranks = model.find(SectionTag::merge_ranks)) {
+		merge_ranks.attach(ranks);
+	}
+	// The filter written with another hash function is not attached, the cache works without it.
+	cache_filter = MappedBloomFilter{};
+	if (const u8* filter = model.find(SectionTag::cache_filter)) {
+		cache_filter.attach(filter);
+	}
+	return true;
 }
 
-void Tokenizer::attach(const u8* data)
+template<TokenId Id>
+void Tokenizer::check_ids() const
 {
-	size_t offset = 0;
-	offset += id_to_seq.attach(data + offset);
-	offset += merge_table.attach(data + offset);
-	cache.attach(data + offset);
+	if (!supports_ids<Id>()) {
+		throw std::length_error("Token ids of the vocabulary do not fit the id type");
+	}
+}
+
+// Append the ids narrowed to the Id type, they are checked to fit by check_ids().
+template<TokenId Id>
+static void append_ids(std::span<const u32> source, std::vector<Id>& ids)
+{
+	for (const u32 id : source) {
+		ids.push_back(static_cast<Id>(id));
+	}
 }
 
-std::vector<u32> Tokenizer::encode(std::string_view text) const
+template<TokenId Id>
+std::vector<Id> Tokenizer::encode(std::string_view text) const
 {
-	std::vector<u32> ids;
+	std::vector<Id> ids;
 	ids.reserve(text.size());
+	encode_into(text, ids);
+	return ids;
+}
 
-	const std::vector<std::string_view> words = split_by_words(text);
-	for (const auto& word : words) {
-		if (cache.contains(word)) {
-			const std::vector<u32> word_ids = cache.get(word);
-			ids.insert(ids.end(), word_ids.begin(), word_ids.end());
-		} else {
-			const std::vector<u32> word_ids = encode_word(word);
-			ids.insert(ids.end(), word_ids.begin(), word_ids.end());
+size_t Tokenizer::count_tokens(std::string_view text) const
+{
+	static thread_local EncodeScratch scratch;
+	return count_tokens(text, scratch);
+}
+
+size_t Tokenizer::count_tokens(std::string_view text, EncodeScratch& scratch) const
+{
+	size_t count = 0;
+	for (const auto word : words(text)) {
+		count += count_word_tokens(word, scratch);
+	}
+	return count;
+}
+
+template<TokenId Id>
+std::vector<Id> Tokenizer::encode_prefix(std::string_view text, size_t max_tokens) const
+{
+	static thread_local EncodeScratch scratch;
+	check_ids<Id>();
+
+	// Words are pre-tokenized lazily, so the rest of the text is not scanned.
+	std::vector<Id> ids;
+	for (const auto word : words(text)) {
+		if (ids.size() >= max_tokens) {
+			break;
 		}
+		encode_cached_word(word, ids, scratch);
 	}
+	ids.resize(std::min(ids.size(), max_tokens));
 	return ids;
 }
 
-std::vector<u32> Tokenizer::encode_word(std::string_view text) const
+template<TokenId Id>
+std::vector<Id> Tokenizer::encode(std::string_view text, const EncodeOptions& options) const
 {
-	std::vector<u32> ids;
-	ids.reserve(text.size());
-	for (char c: text) {
-		ids.push_back(static_cast<u32>(c));
+	if (options.threads <= 1 || text.size() < options.min_parallel_size) {
+		return encode<Id>(text);
 	}
 
-	while (ids.size() >= 2) {
+	// BPE never merges across words, so the parts cut at word boundaries are encoded independently.
+	std::vector<std::string_view> parts;
+	parts.reserve(options.threads);
+	size_t begin = 0;
+	for (size_t i = 1; i <= options.threads && begin < text.size(); i++) {
+		const size_t end = (i == options.threads)
+			? text.size()
+			: find_word_boundary(text, std::max(begin + 1, text.size() / options.threads * i));
+		if (end > begin) {
+			parts.push_back(text.substr(begin, end - begin));
+		}
+		begin = end;
+	}
 
-		using MinIdWithIndex = std::pair<u32, size_t>;
-		std::optional<MinIdWithIndex> min_id;
-		for (size_t i = 1; i < ids.size(); i++) {
-			const std::optional<u32> id = get_merge_id(ids[i - 1], ids[i]);
-			if (id) {
-				if (!min_id) {
-					min_id = MinIdWithIndex{*id, i - 1};
-				} else {
-					if (id < min_id->first) {
-						min_id->first = *id;
-						min_id->second = i - 1;
-					}
-				}
+	BasicEncodedBatch<Id> batch = encode_batch<Id>(parts, options.pool != nullptr ? *options.pool : ThreadPool::shared());
+	return std::move(batch.ids);
+}
+
+template<TokenId Id>
+void Tokenizer::encode_into(std::string_view text, std::vector<Id>& ids) const
+{
+	static thread_local EncodeScratch scratch;
+	encode_into(text, ids, scratch);
+}
+
+template<TokenId Id>
+void Tokenizer::encode_into(std::string_view text, std::vector<Id>& ids, EncodeScratch& scratch) const
+{
+	check_ids<Id>();
+	for (const auto word : words(text)) {
+		encode_cached_word(word, ids, scratch);
+	}
+}
+
+template<TokenId Id>
+size_t Tokenizer::encode_into(std::string_view text, std::span<Id> ids, EncodeScratch& scratch) const
+{
+	check_ids<Id>();
+	size_t count = 0;
+	for (const auto word : words(text)) {
+		scratch.word_ids.clear();
+		encode_cached_word(word, scratch.word_ids, scratch);
+
+		if (count < ids.size()) {
+			const size_t copy_count = std::min(scratch.word_ids.size(), ids.size() - count);
+			for (size_t i = 0; i < copy_count; i++) {
+				ids[count + i] = static_cast<Id>(scratch.word_ids[i]);
 			}
 		}
+		count += scratch.word_ids.size();
+	}
+	return count;
+}
 
-		if (!min_id) {
-			break;
+template<TokenId Id>
+BasicEncodedBatch<Id> Tokenizer::encode_batch(std::span<const std::string_view> texts) const
+{
+	return encode_batch<Id>(texts, ThreadPool::shared());
+}
+
+template<TokenId Id>
+BasicEncodedBatch<Id> Tokenizer::encode_batch(std::span<const std::string_view> texts, ThreadPool& pool) const
+{
+	check_ids<Id>();
+
+
+	// Consecutive texts are grouped into tasks of at least task_bytes bytes.
+	static constexpr size_t task_bytes = 64 * 1024;
+
+	std::vector<size_t> task_begins;
+	std::vector<u64> task_weights;
+	for (size_t i = 0; i < texts.size(); i++) {
+		if (task_weights.empty() || task_weights.back() >= task_bytes) {
+			task_begins.push_back(i);
+			task_weights.push_back(0);
+		}
+		task_weights.back() += texts[i].size();
+	}
+	task_begins.push_back(texts.size());
+
+	// Every worker encodes into its own buffer, text_ranges keeps where each text was written.
+	struct TextRange {
+		size_t worker;
+		size_t begin;
+		size_t end;
+	};
+	std::vector<TextRange> text_ranges(texts.size());
+	std::vector<std::vector<Id>> worker_ids(pool.thread_count());
+	std::vector<EncodeScratch> worker_scratches(pool.thread_count());
+
+	pool.run(task_weights.size(), task_weights, [&](size_t task, size_t worker) {
+		std::vector<Id>& ids = worker_ids[worker];
+		for (size_t i = task_begins[task]; i < task_begins[task + 1]; i++) {
+			const size_t begin = ids.size();
+			encode_into(texts[i], ids, worker_scratches[worker]);
+			text_ranges[i] = TextRange{ worker, begin, ids.size() };
+		}
+	});
+
+	BasicEncodedBatch<Id> batch;
+	batch.offsets.reserve(texts.size() + 1);
+	batch.offsets.push_back(0);
+	for (const auto& range : text_ranges) {
+		batch.offsets.push_back(batch.offsets.back() + range.end - range.begin);
+	}
+
+	batch.ids.resize(batch.offsets.back());
+	pool.run(task_weights.size(), task_weights, [&](size_t task, size_t) {
+		for (size_t i = task_begins[task]; i < task_begins[task + 1]; i++) {
+			const TextRange& range = text_ranges[i];
+			const auto& ids = worker_ids[range.worker];
+			std::copy(ids.begin() + to<std::ptrdiff_t>(range.begin), ids.begin() + to<std::ptrdiff_t>(range.end),
+				batch.ids.begin() + to<std::ptrdiff_t>(batch.offsets[i]));
 		}
+	});
+
+	return batch;
+}
+
+template<TokenId Id>
+void Tokenizer::encode_cached_word(std::string_view word, std::vector<Id>& ids, EncodeScratch& scratch) const
+{
+	if (const u8* cached_ids = find_cached(word)) {
+		BufferReader reader{ cached_ids };
+		CompactIdsSerializer{}.read_append(reader, ids);
+		return;
+	}
+	encode_uncached_word(word, ids, scratch);
+}
 
-		const auto& [new_id, index] = *min_id;
+template<TokenId Id>
+void Tokenizer::encode_uncached_word(std::string_view word, std::vector<Id>& ids, EncodeScratch& scratch) const
+{
+	if (runtime_cache == nullptr || !runtime_cache->accepts(word)) {
+		encode_word(word, ids, scratch);
+		return;
+	}
 
-		ids[index] = new_id;
-		for (size_t i = index + 1; i < ids.size() - 1; i++) {
-			ids[i] = ids[i + 1];
+	if constexpr (std::is_same_v<Id, u32>) {
+		if (runtime_cache->lookup(word, ids)) {
+			return;
 		}
-		ids.resize(ids.size() - 1);
+		const size_t begin = ids.size();
+		encode_word(word, ids, scratch);
+		runtime_cache->insert(word, std::span<const u32>{ ids }.subspan(begin));
+	} else {
+		// The runtime cache keeps u32 ids, the narrow output does not use the word ids of the scratch.
+		scratch.word_ids.clear();
+		encode_uncached_word(word, scratch.word_ids, scratch);
+		append_ids(std::span<const u32>{ scratch.word_ids }, ids);
 	}
+}
 
-	return ids;
+void Tokenizer::enable_runtime_cache(const WordCache::Config& config)
+{
+	runtime_cache = std::make_unique<WordCache>(config);
 }
 
-std::string Tokenizer::decode(const std::vector<u32>& ids) const
+WordCache::Stats Tokenizer::get_runtime_cache_stats() const
 {
-	return std::accumulate(ids.begin(), ids.end(), std::string{}, [this](const std::string& acc, u32 id) {
-		return acc + std::string(id_to_seq[id]);
-	});
+	return runtime_cache != nullptr ? runtime_cache->stats() : WordCache::Stats{};
+}
+
+const u8* Tokenizer::find_cached(std::string_view word) const
+{
+	if (cache_filter.attached() && !cache_filter.may_contain(word)) {
+		return nullptr;
+	}
+	return cache.find(word);
+}
+
+size_t Tokenizer::count_word_tokens(std::string_view word, EncodeScratch& scratch) const
+{
+	if (const u8* cached_ids = find_cached(word)) {
+		BufferReader reader{ cached_ids };
+		return CompactIdsSerializer::read_count(reader);
+	}
+	scratch.word_ids.clear();
+	encode_uncached_word(word, scratch.word_ids, scratch);
+	return scratch.word_ids.size();
+}
+
+// Bpe merges of the single word.
+// Symbols of the word are kept in the intrusive doubly-linked list over the array, and merge
+// candidates of the neighboring symbols are kept in the min-heap ordered by (merge rank, position).
+// Only neighbors of the merged pair are re-evaluated, so the word is encoded in O(n log n).
+// Stale heap entries are skipped lazily when popped.
+template<TokenId Id>
+void Tokenizer::encode_word(std::string_view text, std::vector<Id>& ids, EncodeScratch& scratch) const
+{
+	using Symbol = EncodeScratch::Symbol;
+	using Candidate = EncodeScratch::Candidate;
+
+	static constexpr u32 none = std::numeric_limits<u32>::max();
+
+	const u32 size = to<u32>(text.size());
+
+	std::vector<Symbol>& symbols = scratch.symbols;
+	symbols.clear();
+	for (u32 i = 0; i < size; i++) {
+		symbols.push_back(Symbol{ static_cast<u8>(text[i]), i == 0 ? none : i - 1, i + 1 == size ? none : i + 1 });
+	}
+
+	std::vector<Candidate>& heap = scratch.heap;
+	heap.clear();
+	const auto push_candidate = [&](u32 left, u32 right) {
+		const std::optional<u32> new_id = get_merge_id(symbols[left].id, symbols[right].id);
+		if (new_id) {
+			heap.push_back(Candidate{ *new_id, left, right, symbols[left].id, symbols[right].id });
+			std::push_heap(heap.begin(), heap.end(), std::greater<>{});
+		}
+	};
+
+	for (u32 i = 1; i < size; i++) {
+		push_candidate(i - 1, i);
+	}
+
+	while (!heap.empty()) {
+		std::pop_heap(heap.begin(), heap.end(), std::greater<>{});
+		const Candidate candidate = heap.back();
+		heap.pop_back();
+
+		Symbol& left = symbols[candidate.left];
+		Symbol& right = symbols[candidate.right];
+		// Token ids only grow during merging, so an unchanged pair of ids means the candidate is still valid.
+		if (left.id != candidate.left_id || left.next != candidate.right || right.id != candidate.right_id) {
+			continue;
+		}
+
+		left.id = candidate.new_id;
+		left.next = right.next;
+		if (right.next != none) {
+			symbols[right.next].prev = candidate.left;
+		}
+		right.id = none;
+
+		if (left.prev != none) {
+			push_candidate(left.prev, candidate.left);
+		}
+		if (left.next != none) {
+			push_candidate(candidate.left, left.next);
+		}
+	}
+
+	// The first symbol is never merged into a left neighbor, so it is the head of the list.
+	for (u32 i = size == 0 ? none : 0; i != none; i = symbols[i].next) {
+		ids.push_back(static_cast<Id>(symbols[i].id));
+	}
+}
+
+std::string Tokenizer::decode(std::span<const u32> ids) const
+{
+	std::string text;
+	decode_ids_into(ids, text);
+	return text;
+}
+
+std::string Tokenizer::decode(std::span<const u16> ids) const
+{
+	std::string text;
+	decode_ids_into(ids, text);
+	return text;
+}
+
+void Tokenizer::decode_into(std::span<const u32> ids, std::string& text) const
+{
+	decode_ids_into(ids, text);
+}
+
+void Tokenizer::decode_into(std::span<const u16> ids, std::string& text) const
+{
+	decode_ids_into(ids, text);
+}
+
+template<TokenId Id>
+void Tokenizer::decode_ids_into(std::span<const Id> ids, std::string& text) const
+{
+	const size_t prev_size = text.size();
+	const size_t size = get_decoded_size(ids);
+	text.resize(prev_size + size + ShortStringsMappedArray::padding);
+	copy_tokens(ids, text.data() + prev_size);
+	text.resize(prev_size + size);
+}
+
+DecodedBatch Tokenizer::decode_batch(std::span<const std::span<const u32>> batch) const
+{
+	DecodedBatch result;
+	result.offsets.reserve(batch.size() + 1);
+	result.offsets.push_back(0);
+	for (const auto ids : batch) {
+		result.offsets.push_back(result.offsets.back() + get_decoded_size(ids));
+	}
+
+	result.text.resize(result.offsets.back() + ShortStringsMappedArray::padding);
+	for (size_t i = 0; i < batch.size(); i++) {
+		copy_tokens(batch[i], result.text.data() + result.offsets[i]);
+	}
+	result.text.resize(result.offsets.back());
+	return result;
+}
+
+template<TokenId Id>
+size_t Tokenizer::get_decoded_size(std::span<const Id> ids) const
+{
+	size_t size = 0;
+	for (const Id id : ids) {
+		size += id_to_seq.length(id);
+	}
+	return size;
+}
+
+template<TokenId Id>
+void Tokenizer::copy_tokens(std::span<const Id> ids, char* output) const
+{
+	// Short tokens are copied by the fixed-size loads, which overrun into the padding of the tokens
+	// and into the slack after the output.
+	static constexpr size_t copy_size = ShortStringsMappedArray::padding;
+	for (const Id id : ids) {
+		const std::string_view token = id_to_seq[id];
+		if (token.size() <= copy_size) {
+			::memcpy(output, token.data(), copy_size);
+		} else {
+			::memcpy(output, token.data(), token.size());
+		}
+		output += token.size();
+	}
 }
 
 std::string_view Tokenizer::decode_token(u32 id) const
@@ -616,11 +1170,31 @@ std::string_view Tokenizer::decode_token(u32 id) const
 
 std::optional<u32> Tokenizer::get_merge_id(u32 first, u32 second) const
 {
-	const Pair merge_pair{ first, second };
-	if (!merge_table.contains(merge_pair)) {
+	if (merge_ranks.attached()) {
+		return merge_ranks.get(first, second);
+	}
+
+	const u8* merge_id = merge_table.find(Pair{ first, second });
+	if (merge_id == nullptr) {
 		return std::nullopt;
 	}
-	return merge_table.get(merge_pair);
+	return BufferReader{ merge_id }.read_u32();
 }
 
+// Encoding to the wide and the narrow ids.
+#define BPE_INSTANTIATE_ENCODE(Id) \
+	template std::vector<Id> Tokenizer::encode<Id>(std::string_view text) const; \
+	template std::vector<Id> Tokenizer::encode<Id>(std::string_view text, const EncodeOptions& options) const; \
+	template void Tokenizer::encode_into<Id>(std::string_view text, std::vector<Id>& ids) const; \
+	template void Tokenizer::encode_into<Id>(std::string_view text, std::vector<Id>& ids, EncodeScratch& scratch) const; \
+	template size_t Tokenizer::encode_into<Id>(std::string_view text, std::span<Id> ids, EncodeScratch& scratch) const; \
+	template std::vector<Id> Tokenizer::encode_prefix<Id>(std::string_view text, size_t max_tokens) const; \
+	template BasicEncodedBatch<Id> Tokenizer::encode_batch<Id>(std::span<const std::string_view> texts) const; \
+	template BasicEncodedBatch<Id> Tokenizer::encode_batch<Id>(std::span<const std::string_view> texts, ThreadPool& pool) const;
+
+BPE_INSTANTIATE_ENCODE(u32)
+BPE_INSTANTIATE_ENCODE(u16)
+
+#undef BPE_INSTANTIATE_ENCODE
+
 } // namespace bpe
\ No newline at end of file
@@ -0,0 +1,42 @@
+#include "cpu_features.h"
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define BPE_X86_64 1
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#include <immintrin.h>
+#endif
+#endif
+
+namespace bpe {
+
+SimdLevel detect_simd_level()
+{
+#if !defined(BPE_X86_64)
+	return SimdLevel::scalar;
+#elif defined(_MSC_VER) && !defined(__clang__)
+	int info[4];
+	__cpuid(info, 0);
+	const int max_leaf = info[0];
+	__cpuid(info, 1);
+	const SimdLevel sse_level = (info[2] & (1 << 9)) != 0 ? SimdLevel::ssse3 : SimdLevel::sse2;
+	if (max_leaf < 7) {
+		return sse_level;
+	}
+	// AVX registers must be enabled by the OS.
+	const bool os_xsave = (info[2] & (1 << 27)) != 0;
+	const bool avx = (info[2] & (1 << 28)) != 0;
+	if (!os_xsave || !avx || (_xgetbv(0) & 6) != 6) {
+		return sse_level;
+	}
+	__cpuidex(info, 7, 0);
+	return (info[1] & (1 << 5)) != 0 ? SimdLevel::avx2 : sse_level;
+#else
+	if (__builtin_cpu_supports("avx2")) {
+		return SimdLevel::avx2;
+	}
+	return __builtin_cpu_supports("ssse3") ? SimdLevel::ssse3 : SimdLevel::sse2;
+#endif
+}
+
+} // namespace bpe
@@ -1,7 +1,34 @@
 #include "mapped_storages.h"
+#include "cpu_features.h"
 
 #include <cassert>
+#include <cerrno>
 #include <fstream>
+#include <system_error>
+#include <utility>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define BPE_X86_64 1
+#include <immintrin.h>
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define BPE_TARGET_SSSE3 __attribute__((target("ssse3")))
+#else
+#define BPE_TARGET_SSSE3
+#endif
 
 namespace bpe {
 
@@ -15,10 +42,145 @@ std::vector<u8> load_file_to_buffer(const std::filesystem::path& path)
 	return buffer;
 }
 
+#ifdef _WIN32
+
+MappedFile::MappedFile(const std::filesystem::path& path, const MapOptions&) :
+	mapping(nullptr),
+	mapping_size(0)
+{
+	// Hints of the options have no direct equivalent for the file views and are ignored.
+	const HANDLE file = ::CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE) {
+		throw std::system_error(static_cast<int>(::GetLastError()), std::system_category(), "CreateFileW " + path.string());
+	}
+
+	LARGE_INTEGER file_size;
+	if (!::GetFileSizeEx(file, &file_size)) {
+		const auto error = ::GetLastError();
+		::CloseHandle(file);
+		throw std::system_error(static_cast<int>(error), std::system_category(), "GetFileSizeEx " + path.string());
+	}
+	if (file_size.QuadPart == 0) {
+		::CloseHandle(file);
+		return;
+	}
+
+	const HANDLE file_mapping = ::CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	const auto mapping_error = ::GetLastError();
+	::CloseHandle(file);
+	if (file_mapping == nullptr) {
+		throw std::system_error(static_cast<int>(mapping_error), std::system_category(), "CreateFileMappingW " + path.string());
+	}
+
+	// The view keeps the mapping object alive.
+	const void* view = ::MapViewOfFile(file_mapping, FILE_MAP_READ, 0, 0, 0);
+	const auto view_error = ::GetLastError();
+	::CloseHandle(file_mapping);
+	if (view == nullptr) {
+		throw std::system_error(static_cast<int>(view_error), std::system_category(), "MapViewOfFile " + path.string());
+	}
+
+	mapping = static_cast<const u8*>(view);
+	mapping_size = static_cast<size_t>(file_size.QuadPart);
+}
+
+void MappedFile::close()
+{
+	if (mapping != nullptr) {
+		::UnmapViewOfFile(mapping);
+	}
+	mapping = nullptr;
+	mapping_size = 0;
+}
+
+#else
+
+MappedFile::MappedFile(const std::filesystem::path& path, const MapOptions& options) :
+	mapping(nullptr),
+	mapping_size(0)
+{
+	const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		throw std::system_error(errno, std::generic_category(), "open " + path.string());
+	}
+
+	struct stat file_stat;
+	if (::fstat(fd, &file_stat) != 0) {
+		const int error = errno;
+		::close(fd);
+		throw std::system_error(error, std::generic_category(), "fstat " + path.string());
+	}
+	if (file_stat.st_size == 0) {
+		::close(fd);
+		return;
+	}
+
+	int flags = MAP_SHARED;
+#ifdef MAP_POPULATE
+	if (options.populate) {
+		flags |= MAP_POPULATE;
+	}
+#endif
+
+	const size_t size = static_cast<size_t>(file_stat.st_size);
+	void* ptr = ::mmap(nullptr, size, PROT_READ, flags, fd, 0);
+	const int error = errno;
+	// The mapping keeps the file alive.
+	::close(fd);
+	if (ptr == MAP_FAILED) {
+		throw std::system_error(error, std::generic_category(), "mmap " + path.string());
+	}
+
+	// Advices are hints, their failures are ignored.
+	if (options.will_need) {
+		::madvise(ptr, size, MADV_WILLNEED);
+	}
+	if (options.sequential) {
+		::madvise(ptr, size, MADV_SEQUENTIAL);
+	}
+#ifdef MADV_HUGEPAGE
+	if (options.huge_pages) {
+		::madvise(ptr, size, MADV_HUGEPAGE);
+	}
+#endif
+
+	mapping = static_cast<const u8*>(ptr);
+	mapping_size = size;
+}
+
+void MappedFile::close()
+{
+	if (mapping != nullptr) {
+		::munmap(const_cast<u8*>(mapping), mapping_size);
+	}
+	mapping = nullptr;
+	mapping_size = 0;
+}
+
+#endif
+
+MappedFile::MappedFile(MappedFile&& other) noexcept :
+	mapping(std::exchange(other.mapping, nullptr)),
+	mapping_size(std::exchange(other.mapping_size, 0))
+{
+}
+
+MappedFile& MappedFile::operator=(MappedFile&& other) noexcept
+{
+	if (this != &other) {
+		close();
+		mapping = std::exchange(other.mapping, nullptr);
+		mapping_size = std::exchange(other.mapping_size, 0);
+	}
+	return *this;
+}
+
 ShortStringsMappedArray::ShortStringsMappedArray(const u8* data) :
 	buffer_size(0),
 	element_count(0),
 	offsets(nullptr),
+	lengths(nullptr),
 	strings(nullptr)
 {
 	attach(data);
@@ -28,6 +190,7 @@ ShortStringsMappedArray::ShortStringsMappedArray() :
 	buffer_size(0),
 	element_count(0),
 	offsets(nullptr),
+	lengths(nullptr),
 	strings(nullptr)
 {
 }
@@ -41,7 +204,8 @@ size_t ShortStringsMappedArray::attach(const u8* data)
 	buffer_size = reader.read_u32();
 	element_count = reader.read_u32();
 	offsets = data + 2 * sizeof(u32);
-	strings = offsets + sizeof(u32) * element_count;
+	lengths = offsets + sizeof(u32) * element_count;
+	strings = lengths + element_count;
 
 	return buffer_size;
 }
@@ -51,11 +215,12 @@ size_t ShortStringsMappedArray::write_to_buffer(const std::vector<std::string>&
 	std::vector<size_t> offsets;
 	size_t strings_size = 0;
 	for (const auto& item : data) {
+		assert(item.size() <= 0xFF);
 		offsets.push_back(strings_size);
-		strings_size += item.size() + 1;
+		strings_size += item.size();
 	}
 
-	const size_t buffer_size = (2 * sizeof(u32)) + (data.size() * sizeof(u32)) + strings_size;
+	const size_t buffer_size = (2 * sizeof(u32)) + (data.size() * (sizeof(u32) + sizeof(u8))) + strings_size + padding;
 
 	const size_t prev_pos = buffer.size();
 	buffer.resize(buffer.size() + buffer_size);
@@ -70,16 +235,149 @@ size_t ShortStringsMappedArray::write_to_buffer(const std::vector<std::string>&
 	}
 
 	for (const auto& item : data) {
-		writer.write_string_view(item);
+		writer.write_u8(static_cast<u8>(item.size()));
 	}
 
+	for (const auto& item : data) {
+		writer.write_bytes(item.data(), item.size());
+	}
+
+	return buffer_size;
+}
+
+MergeRanksMappedTable::MergeRanksMappedTable() :
+	buffer_size(0),
+	row_count(0),
+	byte_pairs(nullptr),
+	row_offsets(nullptr),
+	entries(nullptr)
+{
+}
+
+size_t MergeRanksMappedTable::attach(const u8* data)
+{
+	assert(data != nullptr);
+	assert(reinterpret_cast<uintptr_t>(data) % alignof(u32) == 0);
+
+	BufferReader reader{ data };
+
+	buffer_size = reader.read_u32();
+	row_count = reader.read_u32();
+	reader.read_u32(); // entry_count
+	reader.read_u32(); // reserved
+
+	byte_pairs = reinterpret_cast<const u32*>(reader.ptr());
+	row_offsets = byte_pairs + byte_count * byte_count;
+	entries = reinterpret_cast<const Entry*>(row_offsets + row_count + 1);
+
+	return buffer_size;
+}
+
+MappedBloomFilter::MappedBloomFilter() :
+	buffer_size(0),
+	block_count(0),
+	blocks(nullptr)
+{
+}
+
+size_t MappedBloomFilter::attach(const u8* data)
+{
+	assert(data != nullptr);
+	assert(reinterpret_cast<uintptr_t>(data) % alignof(u32) == 0);
+
+	BufferReader reader{ data };
+
+	const u32 size = reader.read_u32();
+	const u32 count = reader.read_u32();
+	if (reader.read_u32() != StringHash::id) {
+		*this = MappedBloomFilter{};
+		return 0;
+	}
+
+	buffer_size = size;
+	block_count = count;
+	blocks = data + header_size;
 	return buffer_size;
 }
 
-std::string_view ShortStringsMappedArray::operator[](size_t index) const
+static const u8* decode_group_varint_scalar(const u8* data, size_t count, u32* output)
+{
+	for (size_t group = 0; group < count; group += 4) {
+		const u32 tag = *data++;
+		const size_t group_end = std::min(group + 4, count);
+		for (size_t i = group; i < group_end; i++) {
+			const size_t length = ((tag >> (2 * (i - group))) & 3) + 1;
+			u32 id = 0;
+			for (size_t byte = 0; byte < length; byte++) {
+				id |= static_cast<u32>(data[byte]) << (8 * byte);
+			}
+			output[i] = id;
+			data += length;
+		}
+	}
+	return data;
+}
+
+#ifdef BPE_X86_64
+
+// Shuffle masks that spread the bytes of the group to 4 ids, and the group data sizes by the tag.
+struct GroupVarintTables {
+	alignas(16) u8 masks[256][16];
+	u8 sizes[256];
+
+	GroupVarintTables()
+	{
+		for (size_t tag = 0; tag < 256; tag++) {
+			size_t offset = 0;
+			for (size_t i = 0; i < 4; i++) {
+				const size_t length = ((tag >> (2 * i)) & 3) + 1;
+				for (size_t byte = 0; byte < 4; byte++) {
+					masks[tag][4 * i + byte] = byte < length ? static_cast<u8>(offset + byte) : 0x80;
+				}
+				offset += length;
+			}
+			sizes[tag] = static_cast<u8>(offset);
+		}
+	}
+};
+
+BPE_TARGET_SSSE3 static const u8* decode_group_varint_ssse3(const u8* data, const u8* end, size_t count, u32* output)
 {
-	const size_t offset = BufferReader{ offsets + (sizeof(u32) * index) }.read_u32();
-	return BufferReader{ strings + offset }.read_string_view();
+	static const GroupVarintTables tables;
+
+	// Full groups only, the tag and 16 bytes of the group must be inside the data.
+	size_t decoded = 0;
+	while (decoded + 4 <= count && end - data > 16) {
+		const u8 tag = *data;
+		const __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 1));
+		const __m128i mask = _mm_load_si128(reinterpret_cast<const __m128i*>(tables.masks[tag]));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(output + decoded), _mm_shuffle_epi8(bytes, mask));
+		data += 1 + tables.sizes[tag];
+		decoded += 4;
+	}
+	return decode_group_varint_scalar(data, count - decoded, output + decoded);
+}
+
+#endif // BPE_X86_64
+
+using DecodeGroupVarint = const u8* (*)(const u8* data, const u8* end, size_t count, u32* output);
+
+static DecodeGroupVarint get_decode_group_varint()
+{
+#ifdef BPE_X86_64
+	if (detect_simd_level() >= SimdLevel::ssse3) {
+		return decode_group_varint_ssse3;
+	}
+#endif
+	return [](const u8* data, const u8*, size_t count, u32* output) { return decode_group_varint_scalar(data, count, output); };
+}
+
+const u8* decode_group_varint(const u8* data, const u8* end, size_t count, u32* output)
+{
+	static const DecodeGroupVarint decode = get_decode_group_varint();
+	assert(data <= end);
+
+	return decode(data, end, count, output);
 }
 
 } // namespace bpe
\ No newline at end of file
@@ -0,0 +1,147 @@
+#include "model_file.h"
+
+#include <cassert>
+
+namespace bpe {
+
+static size_t align_up(size_t value, size_t alignment)
+{
+	return (value + alignment - 1) / alignment * alignment;
+}
+
+ModelFile::ModelFile() :
+	data(nullptr),
+	size(0),
+	section_count(0),
+	flags(0),
+	section_table(nullptr)
+{
+}
+
+size_t ModelFile::read_size(const u8* data)
+{
+	BufferReader reader{ data };
+	if (reader.read_u32() != magic) {
+		return 0;
+	}
+	reader.skip_count(3 * sizeof(u32));
+	return to<size_t>(reader.read<u64>());
+}
+
+bool ModelFile::attach(const u8* _data, size_t _size)
+{
+	assert(reinterpret_cast<uintptr_t>(_data) % model_alignment == 0);
+	*this = ModelFile{};
+
+	if (_data == nullptr || _size < header_size) {
+		return false;
+	}
+
+	BufferReader reader{ _data };
+	const u32 file_magic = reader.read_u32();
+	const u32 file_version = reader.read_u32();
+	const u32 file_section_count = reader.read_u32();
+	const u32 file_flags = reader.read_u32();
+	const u64 file_size = reader.read<u64>();
+	if (file_magic != magic || file_version != version || file_size > _size) {
+		return false;
+	}
+	if (header_size + file_section_count * table_entry_size > file_size) {
+		return false;
+	}
+
+	// All sections must be inside the file.
+	for (size_t i = 0; i < file_section_count; i++) {
+		BufferReader entry_reader{ _data + header_size + i * table_entry_size + 2 * sizeof(u32) };
+		const u64 offset = entry_reader.read<u64>();
+		const u64 section_size = entry_reader.read<u64>();
+		if (offset % section_alignment != 0 || offset > file_size || section_size > file_size - offset) {
+			return false;
+		}
+	}
+
+	data = _data;
+	size = static_cast<size_t>(file_size);
+	section_count = file_section_count;
+	flags = file_flags;
+	section_table = _data + header_size;
+	return true;
+}
+
+const u8* ModelFile::find(SectionTag tag) const
+{
+	for (size_t i = 0; i < section_count; i++) {
+		BufferReader reader{ section_table + i * table_entry_size };
+		if (reader.read_u32() == static_cast<u32>(tag)) {
+			reader.skip<u32>();
+			return data + reader.read<u64>();
+		}
+	}
+	return nullptr;
+}
+
+bool ModelFile::verify_checksum() const
+{
+	if (!has_checksum()) {
+		return false;
+	}
+	const u64 stored = BufferReader{ data + 3 * sizeof(u64) }.read<u64>();
+	return compute_checksum(data + header_size, size - header_size) == stored;
+}
+
+// FNV-1a over 8-byte words, the tail is hashed by bytes.
+u64 ModelFile::compute_checksum(const u8* data, size_t size)
+{
+	constexpr u64 offset_basis = 0xCBF29CE484222325ull;
+	constexpr u64 prime = 0x100000001B3ull;
+
+	BufferReader reader{ data };
+	u64 hash = offset_basis;
+	for (size_t i = 0; i + sizeof(u64) <= size; i += sizeof(u64)) {
+		hash = (hash ^ reader.read<u64>()) * prime;
+	}
+	for (size_t i = size / sizeof(u64) * sizeof(u64); i < size; i++) {
+		hash = (hash ^ reader.read_u8()) * prime;
+	}
+	return hash;
+}
+
+void ModelFile::Writer::add_section(SectionTag tag, WriteSection write)
+{
+	sections.emplace_back(tag, std::move(write));
+}
+
+std::vector<u8> ModelFile::Writer::write(bool checksum) const
+{
+	const size_t table_end = header_size + sections.size() * table_entry_size;
+
+	std::vector<u8> buffer(table_end);
+	std::vector<std::pair<size_t, size_t>> section_ranges;
+	section_ranges.reserve(sections.size());
+	for (const auto& [tag, write_section] : sections) {
+		buffer.resize(align_up(buffer.size(), section_alignment));
+		const size_t offset = buffer.size();
+		write_section(buffer);
+		section_ranges.emplace_back(offset, buffer.size() - offset);
+	}
+
+	BufferWriter table_writer{ buffer.data() + header_size };
+	for (size_t i = 0; i < sections.size(); i++) {
+		table_writer.write_u32(static_cast<u32>(sections[i].first));
+		table_writer.write_u32(0);
+		table_writer.write<u64>(section_ranges[i].first);
+		table_writer.write<u64>(section_ranges[i].second);
+	}
+
+	BufferWriter header_writer{ buffer.data() };
+	header_writer.write_u32(magic);
+	header_writer.write_u32(version);
+	header_writer.write_u32(to<u32>(sections.size()));
+	header_writer.write_u32(checksum ? checksum_flag : 0);
+	header_writer.write<u64>(buffer.size());
+	header_writer.write<u64>(checksum ? compute_checksum(buffer.data() + header_size, buffer.size() - header_size) : 0);
+
+	return buffer;
+}
+
+} // namespace bpe
@@ -0,0 +1,106 @@
+#include "pretokenizer.h"
+
+#include <bit>
+#include <cassert>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define BPE_X86_64 1
+#include <immintrin.h>
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define BPE_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define BPE_TARGET_AVX2
+#endif
+
+namespace bpe {
+
+static size_t find_space_scalar(const char* data, size_t size, size_t pos)
+{
+	while (pos < size && !is_space(data[pos])) {
+		pos++;
+	}
+	return pos;
+}
+
+#ifdef BPE_X86_64
+
+// Spaces of the 16 bytes block as the bit mask.
+static u32 space_mask(__m128i block)
+{
+	const __m128i spaces = _mm_or_si128(
+		_mm_or_si128(_mm_cmpeq_epi8(block, _mm_set1_epi8(' ')), _mm_cmpeq_epi8(block, _mm_set1_epi8('\n'))),
+		_mm_or_si128(_mm_cmpeq_epi8(block, _mm_set1_epi8('\r')), _mm_cmpeq_epi8(block, _mm_set1_epi8('\t'))));
+	return static_cast<u32>(_mm_movemask_epi8(spaces));
+}
+
+static size_t find_space_sse2(const char* data, size_t size, size_t pos)
+{
+	for (; pos + 16 <= size; pos += 16) {
+		const u32 mask = space_mask(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data + pos)));
+		if (mask != 0) {
+			return pos + static_cast<size_t>(std::countr_zero(mask));
+		}
+	}
+	return find_space_scalar(data, size, pos);
+}
+
+BPE_TARGET_AVX2
+static size_t find_space_avx2(const char* data, size_t size, size_t pos)
+{
+	const __m256i space = _mm256_set1_epi8(' ');
+	const __m256i new_line = _mm256_set1_epi8('\n');
+	const __m256i carriage_return = _mm256_set1_epi8('\r');
+	const __m256i tab = _mm256_set1_epi8('\t');
+
+	for (; pos + 32 <= size; pos += 32) {
+		const __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + pos));
+		const __m256i spaces = _mm256_or_si256(
+			_mm256_or_si256(_mm256_cmpeq_epi8(block, space), _mm256_cmpeq_epi8(block, new_line)),
+			_mm256_or_si256(_mm256_cmpeq_epi8(block, carriage_return), _mm256_cmpeq_epi8(block, tab)));
+		const u32 mask = static_cast<u32>(_mm256_movemask_epi8(spaces));
+		if (mask != 0) {
+			return pos + static_cast<size_t>(std::countr_zero(mask));
+		}
+	}
+	return find_space_sse2(data, size, pos);
+}
+
+#endif // BPE_X86_64
+
+using FindSpace = size_t (*)(const char* data, size_t size, size_t pos);
+
+static FindSpace get_find_space(SimdLevel level)
+{
+	switch (level) {
+#ifdef BPE_X86_64
+	case SimdLevel::avx2:
+		return find_space_avx2;
+	case SimdLevel::ssse3:
+	case SimdLevel::sse2:
+		return find_space_sse2;
+#endif
+	default:
+		return find_space_scalar;
+	}
+}
+
+size_t find_space(std::string_view text, size_t pos, SimdLevel level)
+{
+	static const SimdLevel supported_level = detect_simd_level();
+	assert(level <= supported_level);
+	assert(pos <= text.size());
+
+	return get_find_space(level)(text.data(), text.size(), pos);
+}
+
+size_t find_space(std::string_view text, size_t pos)
+{
+	static const FindSpace find_space_impl = get_find_space(detect_simd_level());
+	assert(pos <= text.size());
+
+	return find_space_impl(text.data(), text.size(), pos);
+}
+
+} // namespace bpe
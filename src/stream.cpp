@@ -0,0 +1,172 @@
+#include "stream.h"
+
+#include <cassert>
+#include <cerrno>
+#include <stdexcept>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+namespace bpe {
+
+template<TokenId Id>
+BasicStreamEncoder<Id>::BasicStreamEncoder(const Tokenizer& _tokenizer, Sink _sink) :
+	tokenizer(_tokenizer),
+	sink(std::move(_sink)),
+	boundary(no_boundary),
+	candidate(no_boundary)
+{
+	assert(sink);
+	if (!tokenizer.supports_ids<Id>()) {
+		throw std::length_error("Token ids of the vocabulary do not fit the id type");
+	}
+}
+
+template<TokenId Id>
+void BasicStreamEncoder<Id>::write(std::string_view chunk)
+{
+	const size_t begin = pending.size();
+	pending.append(chunk);
+
+	// Track the word boundaries in the appended text, see find_word_boundary().
+	for (size_t i = std::max<size_t>(begin, 1); i < pending.size(); i++) {
+		if (is_space(pending[i])) {
+			if (!is_space(pending[i - 1])) {
+				candidate = i;
+			}
+		} else if (candidate != no_boundary) {
+			boundary = candidate;
+			candidate = no_boundary;
+		}
+	}
+
+	if (boundary != no_boundary) {
+		encode_pending(boundary);
+	}
+}
+
+template<TokenId Id>
+void BasicStreamEncoder<Id>::read(std::istream& stream, size_t chunk_size)
+{
+	assert(chunk_size > 0);
+
+	chunk_buffer.resize(chunk_size);
+	while (stream) {
+		stream.read(chunk_buffer.data(), to<std::streamsize>(chunk_size));
+		write(std::string_view{ chunk_buffer.data(), static_cast<size_t>(stream.gcount()) });
+	}
+}
+
+template<TokenId Id>
+void BasicStreamEncoder<Id>::read(int fd, size_t chunk_size)
+{
+	assert(chunk_size > 0);
+
+	chunk_buffer.resize(chunk_size);
+	while (true) {
+#ifdef _WIN32
+		const auto size = ::_read(fd, chunk_buffer.data(), to<unsigned>(chunk_size));
+#else
+		const auto size = ::read(fd, chunk_buffer.data(), chunk_size);
+#endif
+		if (size < 0 && errno == EINTR) {
+			continue;
+		}
+		if (size <= 0) {
+			break;
+		}
+		write(std::string_view{ chunk_buffer.data(), static_cast<size_t>(size) });
+	}
+}
+
+template<TokenId Id>
+void BasicStreamEncoder<Id>::finish()
+{
+	encode_pending(pending.size());
+}
+
+// Encode pending[0, size) and keep the rest.
+template<TokenId Id>
+void BasicStreamEncoder<Id>::encode_pending(size_t size)
+{
+	ids.clear();
+	tokenizer.encode_into(std::string_view{ pending }.substr(0, size), ids, scratch);
+	if (!ids.empty()) {
+		sink(ids);
+	}
+
+	pending.erase(0, size);
+	candidate = candidate > size ? candidate - size : no_boundary;
+	boundary = no_boundary;
+}
+
+template class BasicStreamEncoder<u32>;
+template class BasicStreamEncoder<u16>;
+
+StreamDecoder::StreamDecoder(const Tokenizer& _tokenizer, Sink _sink) :
+	tokenizer(_tokenizer),
+	sink(std::move(_sink))
+{
+	assert(sink);
+}
+
+void StreamDecoder::write(u32 id)
+{
+	write(std::span<const u32>{ &id, 1 });
+}
+
+void StreamDecoder::write(std::span<const u32> ids)
+{
+	tokenizer.decode_into(ids, text);
+
+	const size_t size = complete_size(text);
+	if (size != 0) {
+		sink(std::string_view{ text }.substr(0, size));
+	}
+	text.erase(0, size);
+	assert(text.size() <= max_pending);
+}
+
+void StreamDecoder::finish()
+{
+	if (!text.empty()) {
+		sink(text);
+	}
+	text.clear();
+}
+
+// Length of the UTF-8 sequence by its lead byte, invalid lead bytes are single.
+static size_t sequence_length(u8 lead)
+{
+	if ((lead & 0xE0) == 0xC0) {
+		return 2;
+	}
+	if ((lead & 0xF0) == 0xE0) {
+		return 3;
+	}
+	if ((lead & 0xF8) == 0xF0) {
+		return 4;
+	}
+	return 1;
+}
+
+size_t StreamDecoder::complete_size(std::string_view text)
+{
+	// The lead byte of the last sequence is among the last 4 bytes, continuation bytes are 10xxxxxx.
+	const size_t end = text.size();
+	const size_t begin = end > max_pending + 1 ? end - max_pending - 1 : 0;
+	for (size_t pos = end; pos > begin; pos--) {
+		const u8 byte = static_cast<u8>(text[pos - 1]);
+		if ((byte & 0xC0) == 0x80) {
+			continue;
+		}
+		return pos - 1 + sequence_length(byte) > end ? pos - 1 : end;
+	}
+	// Continuation bytes without the lead byte are invalid, they are passed as is.
+	return end;
+}
+
+} // namespace bpe
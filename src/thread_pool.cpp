@@ -0,0 +1,171 @@
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <cassert>
+#include <numeric>
+
+namespace bpe {
+
+// Set in the pool threads and while the calling thread runs tasks.
+static thread_local bool inside_task = false;
+
+ThreadPool::ThreadPool(size_t thread_count) :
+	job(nullptr),
+	generation(0),
+	running_workers(0),
+	stop(false)
+{
+	assert(thread_count >= 1);
+
+	queues.reserve(thread_count);
+	for (size_t i = 0; i < thread_count; i++) {
+		queues.push_back(std::make_unique<WorkQueue>());
+	}
+
+	// Worker 0 is the calling thread.
+	threads.reserve(thread_count - 1);
+	for (size_t i = 1; i < thread_count; i++) {
+		threads.emplace_back(&ThreadPool::worker_loop, this, i);
+	}
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		const std::lock_guard lock{ mutex };
+		stop = true;
+	}
+	start_condition.notify_all();
+	for (auto& thread : threads) {
+		thread.join();
+	}
+}
+
+ThreadPool& ThreadPool::shared()
+{
+	static ThreadPool pool{ std::max<size_t>(std::thread::hardware_concurrency(), 1) };
+	return pool;
+}
+
+void ThreadPool::run(size_t task_count, std::span<const u64> weights, const Task& task)
+{
+	assert(weights.empty() || weights.size() == task_count);
+
+	if (task_count == 0) {
+		return;
+	}
+
+	if (inside_task || thread_count() == 1 || task_count == 1) {
+		for (size_t i = 0; i < task_count; i++) {
+			task(i, 0);
+		}
+		return;
+	}
+
+	const std::lock_guard run_lock{ run_mutex };
+
+	// Distribute tasks: the heaviest task goes to the least loaded worker.
+	std::vector<size_t> order(task_count);
+	std::iota(order.begin(), order.end(), size_t{ 0 });
+	if (!weights.empty()) {
+		std::stable_sort(order.begin(), order.end(),
+			[&weights](size_t left, size_t right) { return weights[left] > weights[right]; });
+	}
+
+	std::vector<u64> loads(queues.size(), 0);
+	for (size_t i = 0; i < task_count; i++) {
+		const size_t index = order[i];
+		const size_t worker = weights.empty()
+			? i % queues.size()
+			: static_cast<size_t>(std::min_element(loads.begin(), loads.end()) - loads.begin());
+		loads[worker] += weights.empty() ? 1 : weights[index] + 1;
+		queues[worker]->tasks.push_back(index);
+	}
+
+	{
+		const std::lock_guard lock{ mutex };
+		job = &task;
+		error = nullptr;
+		running_workers = threads.size();
+		generation++;
+	}
+	start_condition.notify_all();
+
+	inside_task = true;
+	work(0);
+	inside_task = false;
+
+	std::unique_lock lock{ mutex };
+	done_condition.wait(lock, [this] { return running_workers == 0; });
+	job = nullptr;
+
+	if (error) {
+		std::rethrow_exception(std::exchange(error, nullptr));
+	}
+}
+
+void ThreadPool::worker_loop(size_t worker)
+{
+	inside_task = true;
+
+	u64 seen_generation = 0;
+	while (true) {
+		{
+			std::unique_lock lock{ mutex };
+			start_condition.wait(lock, [&] { return stop || generation != seen_generation; });
+			if (stop) {
+				return;
+			}
+			seen_generation = generation;
+		}
+
+		work(worker);
+
+		{
+			const std::lock_guard lock{ mutex };
+			running_workers--;
+		}
+		done_condition.notify_one();
+	}
+}
+
+void ThreadPool::work(size_t worker)
+{
+	size_t task = 0;
+	while (pop_task(worker, task)) {
+		try {
+			(*job)(task, worker);
+		} catch (...) {
+			const std::lock_guard lock{ mutex };
+			if (!error) {
+				error = std::current_exception();
+			}
+		}
+	}
+}
+
+// Pop the next own task from the front, or steal one from the back of another worker queue.
+// No tasks are added while the batch runs, so empty queues mean the batch is done.
+bool ThreadPool::pop_task(size_t worker, size_t& task)
+{
+	for (size_t i = 0; i < queues.size(); i++) {
+		const size_t victim = (worker + i) % queues.size();
+		WorkQueue& queue = *queues[victim];
+
+		const std::lock_guard lock{ queue.mutex };
+		if (queue.tasks.empty()) {
+			continue;
+		}
+		if (victim == worker) {
+			task = queue.tasks.front();
+			queue.tasks.pop_front();
+		} else {
+			task = queue.tasks.back();
+			queue.tasks.pop_back();
+		}
+		return true;
+	}
+	return false;
+}
+
+} // namespace bpe
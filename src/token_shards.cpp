@@ -0,0 +1,160 @@
+#include "token_shards.h"
+
+#include <cerrno>
+#include <stdexcept>
+#include <system_error>
+
+namespace bpe {
+
+std::filesystem::path TokenShardFormat::get_path(const std::filesystem::path& prefix, size_t shard, std::string_view extension)
+{
+	char number[32];
+	std::snprintf(number, sizeof(number), "_%05zu", shard);
+	return prefix.string() + number + std::string(extension);
+}
+
+// Open the file for writing, throws std::system_error on failure.
+static std::FILE* open_file(const std::filesystem::path& path)
+{
+	std::FILE* file = std::fopen(path.string().c_str(), "wb");
+	if (file == nullptr) {
+		throw std::system_error(errno, std::generic_category(), "fopen " + path.string());
+	}
+	return file;
+}
+
+static void write_file(std::FILE* file, const void* data, size_t size, const std::filesystem::path& path)
+{
+	if (size != 0 && std::fwrite(data, 1, size, file) != size) {
+		throw std::system_error(errno, std::generic_category(), "fwrite " + path.string());
+	}
+}
+
+static void close_file(std::FILE* file, const std::filesystem::path& path)
+{
+	if (std::fclose(file) != 0) {
+		throw std::system_error(errno, std::generic_category(), "fclose " + path.string());
+	}
+}
+
+TokenShardWriter::TokenShardWriter(const std::filesystem::path& _prefix, size_t _id_size, u64 _shard_tokens) :
+	prefix(_prefix),
+	id_size(_id_size),
+	shard_tokens(_shard_tokens),
+	data_file(nullptr),
+	shard_count(0),
+	document_count(0),
+	token_count(0)
+{
+	assert(id_size == sizeof(u16) || id_size == sizeof(u32));
+	assert(shard_tokens > 0);
+}
+
+TokenShardWriter::~TokenShardWriter()
+{
+	// Errors of the last shard are reported by the explicit finish().
+	try {
+		finish();
+	} catch (...) {
+	}
+}
+
+void TokenShardWriter::write_document(const void* ids, size_t count)
+{
+	if (data_file == nullptr) {
+		data_file = open_file(TokenShardFormat::get_path(prefix, shard_count, ".bin"));
+		offsets.assign(1, 0);
+	}
+
+	write_file(data_file, ids, count * id_size, TokenShardFormat::get_path(prefix, shard_count, ".bin"));
+	offsets.push_back(offsets.back() + count);
+	document_count++;
+	token_count += count;
+
+	if (offsets.back() >= shard_tokens) {
+		close_shard();
+	}
+}
+
+void TokenShardWriter::finish()
+{
+	// The corpus without documents still has the single empty shard.
+	if (shard_count == 0 && data_file == nullptr) {
+		data_file = open_file(TokenShardFormat::get_path(prefix, shard_count, ".bin"));
+		offsets.assign(1, 0);
+	}
+	close_shard();
+}
+
+void TokenShardWriter::close_shard()
+{
+	if (data_file == nullptr) {
+		return;
+	}
+	std::FILE* file = data_file;
+	data_file = nullptr;
+	close_file(file, TokenShardFormat::get_path(prefix, shard_count, ".bin"));
+
+	const std::filesystem::path index_path = TokenShardFormat::get_path(prefix, shard_count, ".idx");
+	std::vector<u8> index(TokenShardFormat::header_size + offsets.size() * sizeof(u64));
+	BufferWriter writer{ index.data() };
+	writer.write_u32(TokenShardFormat::magic);
+	writer.write_u32(TokenShardFormat::version);
+	writer.write_u32(static_cast<u32>(id_size));
+	writer.write_u32(0);
+	writer.write<u64>(offsets.size() - 1);
+	writer.write<u64>(offsets.back());
+	for (const u64 offset : offsets) {
+		writer.write<u64>(offset);
+	}
+
+	std::FILE* index_file = open_file(index_path);
+	try {
+		write_file(index_file, index.data(), index.size(), index_path);
+	} catch (...) {
+		std::fclose(index_file);
+		throw;
+	}
+	close_file(index_file, index_path);
+	shard_count++;
+}
+
+TokenShard::TokenShard(const std::filesystem::path& prefix, size_t shard, const MapOptions& options) :
+	data(TokenShardFormat::get_path(prefix, shard, ".bin"), options),
+	index(TokenShardFormat::get_path(prefix, shard, ".idx")),
+	id_size(0),
+	document_count(0),
+	token_count(0),
+	offsets(nullptr)
+{
+	const auto invalid = [&] {
+		return std::runtime_error("Invalid token shard index " + TokenShardFormat::get_path(prefix, shard, ".idx").string());
+	};
+	if (index.size() < TokenShardFormat::header_size + sizeof(u64) || index.size() % sizeof(u64) != 0) {
+		throw invalid();
+	}
+
+	BufferReader reader{ index.data() };
+	const u32 magic = reader.read_u32();
+	const u32 version = reader.read_u32();
+	const u32 size = reader.read_u32();
+	reader.skip<u32>();
+	const u64 documents = reader.read<u64>();
+	const u64 tokens = reader.read<u64>();
+	if (magic != TokenShardFormat::magic || version != TokenShardFormat::version
+		|| (size != sizeof(u16) && size != sizeof(u32))
+		|| documents != (index.size() - TokenShardFormat::header_size) / sizeof(u64) - 1
+		|| tokens != data.size() / size || data.size() % size != 0) {
+		throw invalid();
+	}
+
+	id_size = size;
+	document_count = to<size_t>(documents);
+	token_count = tokens;
+	offsets = index.data() + TokenShardFormat::header_size;
+	if (BufferReader{ offsets + document_count * sizeof(u64) }.read<u64>() != token_count) {
+		throw invalid();
+	}
+}
+
+} // namespace bpe
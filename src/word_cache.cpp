@@ -0,0 +1,138 @@
+#include "word_cache.h"
+
+#include <cassert>
+#include <functional>
+
+namespace bpe {
+
+WordCache::WordCache(const Config& _config) : config(_config)
+{
+	assert(config.shard_count >= 1);
+
+	shards.reserve(config.shard_count);
+	for (size_t i = 0; i < config.shard_count; i++) {
+		auto shard = std::make_unique<Shard>();
+		shard->byte_budget = config.byte_budget / config.shard_count;
+		shards.push_back(std::move(shard));
+	}
+}
+
+auto WordCache::get_shard(std::string_view word) const -> Shard&
+{
+	// Mix the hash, the low bits are also used by the shard index.
+	const size_t hash = std::hash<std::string_view>{}(word) * 0x9E3779B97F4A7C15ull;
+	return *shards[(hash >> 32) % shards.size()];
+}
+
+bool WordCache::lookup(std::string_view word, std::vector<u32>& ids)
+{
+	Shard& shard = get_shard(word);
+	const std::lock_guard lock{ shard.mutex };
+
+	const auto it = shard.index.find(word);
+	if (it == shard.index.end()) {
+		shard.stats.misses++;
+		return false;
+	}
+
+	Slot& slot = shard.slots[it->second];
+	slot.referenced = true;
+	ids.insert(ids.end(), slot.ids.begin(), slot.ids.end());
+	shard.stats.hits++;
+	return true;
+}
+
+void WordCache::insert(std::string_view word, std::span<const u32> ids)
+{
+	const size_t bytes = slot_bytes(word, ids.size());
+
+	Shard& shard = get_shard(word);
+	const std::lock_guard lock{ shard.mutex };
+
+	if (bytes > shard.byte_budget || shard.index.contains(word)) {
+		return;
+	}
+
+	while (shard.stats.bytes + bytes > shard.byte_budget) {
+		evict(shard);
+	}
+
+	u32 slot_index = 0;
+	if (!shard.free_slots.empty()) {
+		slot_index = shard.free_slots.back();
+		shard.free_slots.pop_back();
+	} else {
+		slot_index = to<u32>(shard.slots.size());
+		shard.slots.emplace_back();
+	}
+
+	// The storage is allocated to the exact sizes, so the slot takes the accounted bytes.
+	Slot& slot = shard.slots[slot_index];
+	slot.word = std::string{ word };
+	slot.ids = std::vector<u32>(ids.begin(), ids.end());
+	slot.bytes = bytes;
+	slot.referenced = false;
+	shard.index.emplace(slot.word, slot_index);
+
+	shard.stats.bytes += bytes;
+	shard.stats.words++;
+	shard.stats.insertions++;
+}
+
+// Evict the first slot without the reference bit, clearing the bits on the way.
+void WordCache::evict(Shard& shard)
+{
+	assert(shard.stats.words > 0);
+
+	while (true) {
+		if (shard.hand >= shard.slots.size()) {
+			shard.hand = 0;
+		}
+		Slot& slot = shard.slots[shard.hand];
+		const u32 slot_index = to<u32>(shard.hand);
+		shard.hand++;
+
+		if (slot.bytes == 0) {
+			continue;
+		}
+		if (slot.referenced) {
+			slot.referenced = false;
+			continue;
+		}
+
+		shard.index.erase(slot.word);
+		// The free slot keeps no storage of the evicted word.
+		slot.word = {};
+		slot.ids = {};
+		shard.stats.bytes -= slot.bytes;
+		shard.stats.words--;
+		shard.stats.evictions++;
+		slot.bytes = 0;
+		shard.free_slots.push_back(slot_index);
+		return;
+	}
+}
+
+// Approximate memory of the slot: word, ids, the slot itself and the index node.
+size_t WordCache::slot_bytes(std::string_view word, size_t id_count)
+{
+	static constexpr size_t index_node_bytes = 48;
+	return sizeof(Slot) + index_node_bytes + word.size() + id_count * sizeof(u32);
+}
+
+auto WordCache::stats() const -> Stats
+{
+	Stats result;
+	for (const auto& shard : shards) {
+		const std::lock_guard lock{ shard->mutex };
+		result.hits += shard->stats.hits;
+		result.misses += shard->stats.misses;
+		result.insertions += shard->stats.insertions;
+		result.evictions += shard->stats.evictions;
+		result.words += shard->stats.words;
+		result.bytes += shard->stats.bytes;
+	}
+	return result;
+}
+
+} // namespace bpe
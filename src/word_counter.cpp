@@ -0,0 +1,140 @@
+#include "word_counter.h"
+
+#include <algorithm>
+#include <bit>
+
+namespace bpe {
+
+WordCounter::WordCounter() :
+	word_count(0),
+	arena_pos(nullptr),
+	arena_free(0),
+	arena_bytes(0)
+{
+}
+
+void WordCounter::merge(const WordCounter& other)
+{
+	// No reserve: the counters of the corpus parts share the most of the words, the sum of the sizes
+	// would double the table.
+	for (const Slot& slot : other.slots) {
+		if (slot.count != 0) {
+			add(std::string_view{ slot.data, slot.size }, slot.hash, slot.count);
+		}
+	}
+}
+
+void WordCounter::merge(WordCounter&& other)
+{
+	if (empty()) {
+		*this = std::move(other);
+	} else {
+		merge(other);
+	}
+	other = WordCounter{};
+}
+
+u64 WordCounter::get(std::string_view word) const
+{
+	if (slots.empty()) {
+		return 0;
+	}
+
+	const u32 hash = get_hash(word);
+	const size_t mask = slots.size() - 1;
+	for (size_t index = hash & mask;; index = (index + 1) & mask) {
+		const Slot& slot = slots[index];
+		if (slot.count == 0) {
+			return 0;
+		}
+		if (slot.hash == hash && slot.size == word.size() && std::memcmp(slot.data, word.data(), word.size()) == 0) {
+			return slot.count;
+		}
+	}
+}
+
+void WordCounter::reserve(size_t words)
+{
+	const size_t capacity = std::bit_ceil(std::max(initial_capacity, (4 * words + 2) / 3));
+	if (capacity > slots.size()) {
+		rehash(capacity);
+	}
+}
+
+const char* WordCounter::store(std::string_view word)
+{
+	// Long words get their own chunks to keep the current one filling up.
+	if (word.size() > max_arena_chunk_size / 4) {
+		arena.push_back(std::make_unique_for_overwrite<char[]>(word.size()));
+		arena_bytes += word.size();
+		std::memcpy(arena.back().get(), word.data(), word.size());
+		return arena.back().get();
+	}
+
+	if (word.size() > arena_free) {
+		// Chunks grow with the arena, the many small counters of the shards stay small.
+		const size_t chunk_size = std::max(std::clamp(arena_bytes, min_arena_chunk_size, max_arena_chunk_size), word.size());
+		arena.push_back(std::make_unique_for_overwrite<char[]>(chunk_size));
+		arena_bytes += chunk_size;
+		arena_pos = arena.back().get();
+		arena_free = chunk_size;
+	}
+	char* data = arena_pos;
+	if (!word.empty()) {
+		std::memcpy(data, word.data(), word.size());
+	}
+	arena_pos += word.size();
+	arena_free -= word.size();
+	return data;
+}
+
+void WordCounter::grow()
+{
+	rehash(slots.empty() ? initial_capacity : 2 * slots.size());
+}
+
+void WordCounter::rehash(size_t capacity)
+{
+	// The slot index is taken from the 32 bits of the stored hash.
+	assert(std::has_single_bit(capacity) && capacity <= (size_t{ 1 } << 32));
+
+	std::vector<Slot> old_slots(capacity, Slot{ nullptr, 0, 0, 0 });
+	old_slots.swap(slots);
+
+	const size_t mask = slots.size() - 1;
+	for (const Slot& slot : old_slots) {
+		if (slot.count == 0) {
+			continue;
+		}
+		size_t index = slot.hash & mask;
+		while (slots[index].count != 0) {
+			index = (index + 1) & mask;
+		}
+		slots[index] = slot;
+	}
+}
+
+ShardedWordCounter::ShardedWordCounter(size_t shard_count) : shards(shard_count)
+{
+	assert(shard_count >= 1);
+}
+
+size_t ShardedWordCounter::size() const
+{
+	size_t result = 0;
+	for (const auto& shard : shards) {
+		result += shard.size();
+	}
+	return result;
+}
+
+size_t ShardedWordCounter::get_memory_usage() const
+{
+	size_t result = 0;
+	for (const auto& shard : shards) {
+		result += shard.get_memory_usage();
+	}
+	return result;
+}
+
+} // namespace bpe
@@ -0,0 +1,275 @@
+#include "word_runs.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <queue>
+#include <random>
+#include <string>
+#include <system_error>
+
+namespace bpe {
+
+// Buffers of the runs are sized from the memory budget within these limits.
+static constexpr size_t min_run_buffer_size = 4 << 10;
+static constexpr size_t max_run_buffer_size = 1 << 20;
+// Bounds the open files of the merge.
+static constexpr size_t max_merge_fan_in = 64;
+
+// Buffered writer of the run file.
+class RunWriter {
+public:
+	RunWriter(const std::filesystem::path& _path, size_t _buffer_size) :
+		path(_path),
+		file(std::fopen(path.string().c_str(), "wb")),
+		buffer_size(_buffer_size)
+	{
+		if (file == nullptr) {
+			throw std::system_error(errno, std::generic_category(), "fopen " + path.string());
+		}
+		buffer.reserve(buffer_size);
+	}
+	~RunWriter()
+	{
+		if (file != nullptr) {
+			std::fclose(file);
+		}
+	}
+
+	void write(std::string_view word, u64 count)
+	{
+		const u32 size = to<u32>(word.size());
+		if (buffer.size() + sizeof(size) + word.size() + sizeof(count) > buffer_size) {
+			flush();
+		}
+		buffer.append(reinterpret_cast<const char*>(&size), sizeof(size));
+		buffer.append(word);
+		buffer.append(reinterpret_cast<const char*>(&count), sizeof(count));
+	}
+
+	void close()
+	{
+		flush();
+		std::FILE* closed = file;
+		file = nullptr;
+		if (std::fclose(closed) != 0) {
+			throw std::system_error(errno, std::generic_category(), "fclose " + path.string());
+		}
+	}
+
+private:
+	std::filesystem::path path;
+	std::FILE* file;
+	size_t buffer_size;
+	std::string buffer;
+
+	void flush()
+	{
+		if (!buffer.empty() && std::fwrite(buffer.data(), 1, buffer.size(), file) != buffer.size()) {
+			throw std::system_error(errno, std::generic_category(), "fwrite " + path.string());
+		}
+		buffer.clear();
+	}
+};
+
+// Buffered reader of the run file, holds the current record.
+class RunReader {
+public:
+	RunReader(const std::filesystem::path& _path, size_t _buffer_size) :
+		path(_path),
+		file(std::fopen(path.string().c_str(), "rb")),
+		buffer_size(_buffer_size),
+		buffer(std::make_unique_for_overwrite<char[]>(buffer_size)),
+		pos(0),
+		end(0),
+		count(0)
+	{
+		if (file == nullptr) {
+			throw std::system_error(errno, std::generic_category(), "fopen " + path.string());
+		}
+	}
+	~RunReader() { std::fclose(file); }
+
+	RunReader(const RunReader&) = delete;
+	RunReader& operator=(const RunReader&) = delete;
+
+	// Read the next record. Return false at the end of the run.
+	bool next()
+	{
+		u32 size = 0;
+		if (!read(&size, sizeof(size), true)) {
+			return false;
+		}
+		word.resize(size);
+		read(word.data(), size, false);
+		read(&count, sizeof(count), false);
+		return true;
+	}
+
+	const std::string& get_word() const { return word; }
+	u64 get_count() const { return count; }
+
+private:
+	std::filesystem::path path;
+	std::FILE* file;
+	size_t buffer_size;
+	std::unique_ptr<char[]> buffer;
+	size_t pos;
+	size_t end;
+	std::string word;
+	u64 count;
+
+	// Read exactly size bytes. Return false if the run ends before the first byte and it may end there.
+	bool read(void* data, size_t size, bool may_end)
+	{
+		char* output = static_cast<char*>(data);
+		while (size > 0) {
+			if (pos == end) {
+				pos = 0;
+				end = std::fread(buffer.get(), 1, buffer_size, file);
+				if (end == 0) {
+					if (std::ferror(file)) {
+						throw std::system_error(errno, std::generic_category(), "fread " + path.string());
+					}
+					if (may_end) {
+						return false;
+					}
+					throw std::runtime_error("Truncated word run " + path.string());
+				}
+			}
+			const size_t part = std::min(size, end - pos);
+			std::memcpy(output, buffer.get() + pos, part);
+			pos += part;
+			output += part;
+			size -= part;
+			may_end = false;
+		}
+		return true;
+	}
+};
+
+// Merge the runs in the ascending word order, call function(std::string_view word, u64 count)
+// with the total counts of the words.
+template<typename F>
+static void merge_runs(const std::vector<std::filesystem::path>& runs, size_t buffer_size, F&& function)
+{
+	std::vector<std::unique_ptr<RunReader>> readers;
+	readers.reserve(runs.size());
+	for (const auto& run : runs) {
+		readers.push_back(std::make_unique<RunReader>(run, buffer_size));
+	}
+
+	// Readers with the smallest current word first.
+	const auto greater = [&](size_t first, size_t second) {
+		return readers[first]->get_word() > readers[second]->get_word();
+	};
+	std::priority_queue<size_t, std::vector<size_t>, decltype(greater)> queue(greater);
+	for (size_t i = 0; i < readers.size(); i++) {
+		if (readers[i]->next()) {
+			queue.push(i);
+		}
+	}
+
+	std::string word;
+	while (!queue.empty()) {
+		word = readers[queue.top()]->get_word();
+		u64 count = 0;
+		// Every run has the word at most once.
+		while (!queue.empty() && readers[queue.top()]->get_word() == word) {
+			const size_t reader = queue.top();
+			queue.pop();
+			count += readers[reader]->get_count();
+			if (readers[reader]->next()) {
+				queue.push(reader);
+			}
+		}
+		function(word, count);
+	}
+}
+
+WordRunSpiller::WordRunSpiller(const std::filesystem::path& _directory, size_t memory_budget) :
+	directory(_directory.empty() ? std::filesystem::temp_directory_path() : _directory),
+	// The merge holds the buffers of its inputs and of the output.
+	buffer_size(std::clamp(memory_budget / (max_merge_fan_in + 1), min_run_buffer_size, max_run_buffer_size)),
+	merge_fan_in(std::clamp(memory_budget / buffer_size, size_t{ 3 }, max_merge_fan_in + 1) - 1),
+	next_run(0)
+{
+	// Several trainers may share the directory.
+	std::random_device random;
+	char prefix[64];
+	std::snprintf(prefix, sizeof(prefix), "bpe_words_%08x%08x_", random(), random());
+	name_prefix = prefix;
+}
+
+WordRunSpiller::~WordRunSpiller()
+{
+	for (const auto& run : runs) {
+		std::error_code error;
+		std::filesystem::remove(run, error);
+	}
+}
+
+void WordRunSpiller::spill(ShardedWordCounter& counter)
+{
+	std::vector<std::pair<std::string_view, u64>> words;
+	words.reserve(counter.size());
+	counter.for_each([&](std::string_view word, u64 count) { words.emplace_back(word, count); });
+	std::sort(words.begin(), words.end());
+
+	RunWriter writer{ get_next_run_path(), buffer_size };
+	for (const auto& [word, count] : words) {
+		writer.write(word, count);
+	}
+	writer.close();
+
+	words = {};
+	counter = ShardedWordCounter{ counter.get_shard_count() };
+}
+
+void WordRunSpiller::merge(u64 min_count, const std::function<void(std::string_view, u64)>& function)
+{
+	// The oldest runs are merged first, so every word is rewritten about log(runs) / log(fan-in) times.
+	while (get_run_count() > merge_fan_in) {
+		const std::vector<std::filesystem::path> inputs(runs.begin(), runs.begin() + to<std::ptrdiff_t>(merge_fan_in));
+		RunWriter writer{ get_next_run_path(), buffer_size };
+		merge_runs(inputs, buffer_size, [&](std::string_view word, u64 count) { writer.write(word, count); });
+		writer.close();
+
+		const std::lock_guard lock{ mutex };
+		for (const auto& input : inputs) {
+			std::filesystem::remove(input);
+		}
+		runs.erase(runs.begin(), runs.begin() + to<std::ptrdiff_t>(merge_fan_in));
+	}
+
+	merge_runs(runs, buffer_size, [&](std::string_view word, u64 count) {
+		if (count >= min_count) {
+			function(word, count);
+		}
+	});
+
+	const std::lock_guard lock{ mutex };
+	for (const auto& run : runs) {
+		std::filesystem::remove(run);
+	}
+	runs.clear();
+}
+
+size_t WordRunSpiller::get_run_count() const
+{
+	const std::lock_guard lock{ mutex };
+	return runs.size();
+}
+
+std::filesystem::path WordRunSpiller::get_next_run_path()
+{
+	const std::lock_guard lock{ mutex };
+	std::filesystem::path path = directory / (name_prefix + std::to_string(next_run++) + ".run");
+	// Registered before writing, so the partial run is removed too.
+	runs.push_back(path);
+	return path;
+}
+
+} // namespace bpe
@@ -0,0 +1,189 @@
+#include "word_sketch.h"
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <numbers>
+#include <utility>
+
+namespace bpe {
+
+WordSketch::WordSketch(size_t _top_size, size_t width, size_t _depth) :
+	top_size(_top_size),
+	width_mask(std::bit_ceil(width) - 1),
+	depth(_depth),
+	counters(depth * (width_mask + 1)),
+	total(0)
+{
+	assert(top_size >= 1);
+	assert(width >= 1);
+	assert(depth >= 1);
+	entries.reserve(top_size);
+	index.reserve(top_size);
+	heap.reserve(top_size);
+}
+
+void WordSketch::add(std::string_view word, u64 count)
+{
+	assert(count > 0);
+	total += count;
+	const u64 hash = StringHash{}(word);
+	const u64 new_estimate = update(hash, count);
+
+	const auto it = index.find(word);
+	if (it != index.end()) {
+		// Both the kept count and the estimate are never less than the true count.
+		Entry& entry = entries[it->second];
+		entry.count = std::min(entry.count + count, new_estimate);
+		sift_down(entry.heap_index);
+	} else {
+		offer(word, new_estimate);
+	}
+}
+
+void WordSketch::merge(const WordSketch& other)
+{
+	assert(other.get_width() == get_width());
+	assert(other.depth == depth);
+
+	// Counts of the other side of the words of both tables are bounded before the sketches are summed:
+	// by the kept count if there is one, else by the estimate.
+	std::vector<u64> other_counts(entries.size());
+	for (size_t i = 0; i < entries.size(); i++) {
+		const u64 count = other.get(entries[i].word);
+		other_counts[i] = count != 0 ? count : other.estimate(entries[i].word);
+	}
+	std::vector<std::pair<std::string_view, u64>> other_words;
+	other.for_each([&](std::string_view word, u64 count) {
+		if (!index.contains(word)) {
+			other_words.emplace_back(word, count + estimate(word));
+		}
+	});
+
+	for (size_t i = 0; i < counters.size(); i++) {
+		counters[i] += other.counters[i];
+	}
+	total += other.total;
+
+	for (size_t i = 0; i < entries.size(); i++) {
+		Entry& entry = entries[i];
+		entry.count = std::min(entry.count + other_counts[i], estimate(entry.word));
+		sift_down(entry.heap_index);
+	}
+	for (const auto& [word, count] : other_words) {
+		offer(word, std::min(count, estimate(word)));
+	}
+}
+
+u64 WordSketch::estimate(std::string_view word) const
+{
+	return estimate(StringHash{}(word));
+}
+
+u64 WordSketch::get(std::string_view word) const
+{
+	const auto it = index.find(word);
+	return it != index.end() ? entries[it->second].count : 0;
+}
+
+u64 WordSketch::get_error_bound() const
+{
+	const double bound = std::numbers::e * static_cast<double>(total) / static_cast<double>(get_width());
+	return static_cast<u64>(std::ceil(bound));
+}
+
+double WordSketch::get_error_probability() const
+{
+	return std::exp(-static_cast<double>(depth));
+}
+
+size_t WordSketch::get_memory_usage() const
+{
+	size_t words_bytes = 0;
+	for (const Entry& entry : entries) {
+		words_bytes += entry.word.capacity() + 1;
+	}
+	return counters.capacity() * sizeof(u64) + entries.capacity() * sizeof(Entry) + words_bytes
+		+ index.bucket_count() * sizeof(void*) + index.size() * (sizeof(std::string_view) + 2 * sizeof(void*))
+		+ heap.capacity() * sizeof(u32);
+}
+
+u64 WordSketch::update(u64 hash, u64 count)
+{
+	const u64 new_estimate = estimate(hash) + count;
+	for (size_t row = 0; row < depth; row++) {
+		u64& counter = counters[get_counter(hash, row)];
+		counter = std::max(counter, new_estimate);
+	}
+	return new_estimate;
+}
+
+u64 WordSketch::estimate(u64 hash) const
+{
+	u64 result = counters[get_counter(hash, 0)];
+	for (size_t row = 1; row < depth; row++) {
+		result = std::min(result, counters[get_counter(hash, row)]);
+	}
+	return result;
+}
+
+void WordSketch::offer(std::string_view word, u64 count)
+{
+	if (entries.size() < top_size) {
+		const u32 entry_index = to<u32>(entries.size());
+		entries.push_back(Entry{ std::string{ word }, count, to<u32>(heap.size()) });
+		index.emplace(entries.back().word, entry_index);
+		heap.push_back(entry_index);
+
+		// Sift the new entry up.
+		size_t heap_index = heap.size() - 1;
+		while (heap_index > 0) {
+			const size_t parent = (heap_index - 1) / 2;
+			if (entries[heap[parent]].count <= count) {
+				break;
+			}
+			std::swap(heap[parent], heap[heap_index]);
+			entries[heap[heap_index]].heap_index = to<u32>(heap_index);
+			heap_index = parent;
+		}
+		entries[entry_index].heap_index = to<u32>(heap_index);
+		return;
+	}
+
+	// The word with the smallest count gives its entry to the new one.
+	const u32 entry_index = heap[0];
+	Entry& entry = entries[entry_index];
+	if (count <= entry.count) {
+		return;
+	}
+	index.erase(entry.word);
+	entry.word = word;
+	entry.count = count;
+	index.emplace(entry.word, entry_index);
+	sift_down(0);
+}
+
+void WordSketch::sift_down(size_t heap_index)
+{
+	const u32 entry_index = heap[heap_index];
+	const u64 count = entries[entry_index].count;
+	for (;;) {
+		size_t child = 2 * heap_index + 1;
+		if (child >= heap.size()) {
+			break;
+		}
+		if (child + 1 < heap.size() && entries[heap[child + 1]].count < entries[heap[child]].count) {
+			child++;
+		}
+		if (count <= entries[heap[child]].count) {
+			break;
+		}
+		heap[heap_index] = heap[child];
+		entries[heap[heap_index]].heap_index = to<u32>(heap_index);
+		heap_index = child;
+	}
+	heap[heap_index] = entry_index;
+	entries[entry_index].heap_index = to<u32>(heap_index);
+}
+
+} // namespace bpe
@@ -0,0 +1,101 @@
+#include "bpe.h"
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+#include <gtest/gtest.h>
+
+using namespace bpe;
+
+// The replaced operators below pair malloc with free, which gcc cannot see through inlining.
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+// Number of heap allocations made by the test binary.
+static std::atomic<size_t> allocation_count{ 0 };
+
+void* operator new(size_t size)
+{
+	allocation_count.fetch_add(1, std::memory_order_relaxed);
+	if (void* ptr = std::malloc(size == 0 ? 1 : size)) {
+		return ptr;
+	}
+	throw std::bad_alloc{};
+}
+
+void operator delete(void* ptr) noexcept
+{
+	std::free(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept
+{
+	std::free(ptr);
+}
+
+TEST(AllocationTest, encode_into_steady_state)
+{
+	TokenizerTrainer::Config config;
+	config.size = 256 + 100;
+	config.min_count = 1;
+	config.cache_size = 3;
+	config.max_worker = 1;
+
+	const std::string text = "Hello, world! The quick brown fox jumps over the lazy dog. Hello again, world!";
+
+	TokenizerTrainer trainer{ config };
+	trainer.train_on_text(text);
+	trainer.build_bpe();
+
+	const ByteBuffer buffer = trainer.save();
+	Tokenizer tokenizer;
+	tokenizer.attach(buffer.data());
+
+	EncodeScratch scratch;
+	std::vector<u32> ids;
+	std::vector<u32> span_ids(text.size());
+
+	// Warm up the buffers.
+	tokenizer.encode_into(text, ids, scratch);
+	tokenizer.encode_into(text, ids);
+	tokenizer.encode_into(text, std::span<u32>{ span_ids }, scratch);
+	const std::vector<u32> expected = tokenizer.encode(text);
+
+	ids.clear();
+	const size_t before = allocation_count.load();
+	tokenizer.encode_into(text, ids, scratch);
+	tokenizer.encode_into(text, ids);
+	const size_t count = tokenizer.encode_into(text, std::span<u32>{ span_ids }, scratch);
+	const size_t after = allocation_count.load();
+
+	EXPECT_EQ(before, after);
+
+	std::vector<u32> twice = expected;
+	twice.insert(twice.end(), expected.begin(), expected.end());
+	EXPECT_EQ(ids, twice);
+	ASSERT_EQ(count, expected.size());
+	EXPECT_EQ(std::vector<u32>(span_ids.begin(), span_ids.begin() + static_cast<std::ptrdiff_t>(count)), expected);
+}
+
+TEST(AllocationTest, encode_into_short_span)
+{
+	TokenizerTrainer::Config config;
+	config.size = 256 + 10;
+
+	TokenizerTrainer trainer{ config };
+	trainer.train_on_text("Hello, world!");
+	trainer.build_bpe();
+
+	const ByteBuffer buffer = trainer.save();
+	Tokenizer tokenizer;
+	tokenizer.attach(buffer.data());
+
+	const std::vector<u32> expected = tokenizer.encode("Hello, world! Hello, world!");
+
+	EncodeScratch scratch;
+	std::vector<u32> ids(3);
+	EXPECT_EQ(tokenizer.encode_into("Hello, world! Hello, world!", std::span<u32>{ ids }, scratch), expected.size());
+	EXPECT_EQ(ids, std::vector<u32>(expected.begin(), expected.begin() + 3));
+}
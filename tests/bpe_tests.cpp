@@ -1,5 +1,18 @@
 
 #include "bpe.h"
+#include "stream.h"
+#include "thread_pool.h"
+#include "token_shards.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <fstream>
+#include <numbers>
+#include <random>
+#include <sstream>
+#include <system_error>
+#include <unordered_set>
 
 // Potential comparison of a constant with another constant in EXPECT checks
 #include <gtest/gtest.h>
@@ -14,6 +27,85 @@ TEST(bpe, split_by_words)
 	EXPECT_EQ(split_by_words("Hello, world!"), std::vector<std::string_view>({"Hello", ",", " world", "!"}));
 }
 
+TEST(bpe, words)
+{
+	static_assert(std::forward_iterator<WordIterator>);
+	static_assert(std::ranges::forward_range<Words>);
+
+	const std::string_view text = "  (Hello),  world!!  ";
+	const auto range = words(text);
+	EXPECT_EQ(std::vector<std::string_view>(range.begin(), WordIterator{}), split_by_words(text));
+
+	std::vector<std::string_view> result;
+	for (auto it = range.begin(); it != range.end(); ++it) {
+		// Multi-pass: the copy of the iterator continues independently.
+		auto copy = it;
+		EXPECT_EQ(*copy++, *it);
+		result.push_back(*it);
+	}
+	EXPECT_EQ(result, std::vector<std::string_view>({" ", " (", "Hello", "),", " ", " world", "!!  "}));
+	EXPECT_EQ(words("").begin(), std::default_sentinel);
+	EXPECT_EQ(static_cast<size_t>(std::ranges::distance(words("a b c"))), 3);
+}
+
+TEST(bpe, find_space)
+{
+	std::mt19937 generator{ 11 };
+	const std::string_view alphabet = " \n\r\tab,\x80\xff";
+	for (size_t iteration = 0; iteration < 2000; iteration++) {
+		std::string text;
+		const size_t size = generator() % 100;
+		// Rare spaces to cross the block boundaries.
+		for (size_t i = 0; i < size; i++) {
+			text.push_back(generator() % 16 == 0 ? alphabet[generator() % 4] : alphabet[4 + generator() % 5]);
+		}
+
+		for (size_t pos = 0; pos <= text.size(); pos++) {
+			size_t expected = pos;
+			while (expected < text.size() && !is_space(text[expected])) {
+				expected++;
+			}
+
+			for (const SimdLevel level : { SimdLevel::scalar, SimdLevel::sse2, SimdLevel::avx2 }) {
+				if (level <= detect_simd_level()) {
+					ASSERT_EQ(find_space(text, pos, level), expected);
+				}
+			}
+			ASSERT_EQ(find_space(text, pos), expected);
+		}
+	}
+}
+
+TEST(bpe, find_word_boundary)
+{
+	EXPECT_EQ(find_word_boundary("hello world", 0), 5);
+	EXPECT_EQ(find_word_boundary("hello  world", 0), 5);
+	EXPECT_EQ(find_word_boundary("hello  world", 6), 12);
+	EXPECT_EQ(find_word_boundary("hello world  ", 6), 13);
+	EXPECT_EQ(find_word_boundary("  hello", 0), 7);
+
+	// Parts cut at the word boundaries are split by words like the whole text.
+	std::mt19937 generator{ 7 };
+	const std::string_view alphabet = " \n,.!ab";
+	for (size_t iteration = 0; iteration < 10000; iteration++) {
+		std::string text;
+		const size_t size = generator() % 16;
+		for (size_t i = 0; i < size; i++) {
+			text.push_back(alphabet[generator() % alphabet.size()]);
+		}
+
+		std::vector<std::string_view> words;
+		size_t begin = 0;
+		while (begin < text.size()) {
+			const size_t end = find_word_boundary(text, begin + 1);
+			const auto part_words = split_by_words(std::string_view{ text }.substr(begin, end - begin));
+			words.insert(words.end(), part_words.begin(), part_words.end());
+			begin = end;
+		}
+		EXPECT_EQ(words, split_by_words(text)) << text;
+	}
+}
+
 TEST(bpe, split_prefix_body_suffix)
 {
 	auto split = [](std::string_view word, std::string_view p, std::string_view b, std::string_view s) -> bool {
@@ -48,6 +140,43 @@ TEST(bpe, split_prefix_body_suffix)
 	ASSERT_TRUE(split(",,,,", "", ",,,,", ""));
 }
 
+static std::filesystem::path get_corpus_path()
+{
+	return std::filesystem::path(TEST_DATA_DIR) / "test_corpus.txt";
+}
+
+// Text of the test corpus, read once.
+static const std::string& get_corpus()
+{
+	static const std::string corpus = [] {
+		std::ifstream file{ get_corpus_path(), std::ios::binary };
+		std::stringstream corpus_stream;
+		corpus_stream << file.rdbuf();
+		return corpus_stream.str();
+	}();
+	return corpus;
+}
+
+// Lines of the test corpus without the newlines.
+static std::vector<std::string> get_corpus_lines()
+{
+	std::istringstream corpus_stream{ get_corpus() };
+	std::vector<std::string> lines;
+	for (std::string line; std::getline(corpus_stream, line);) {
+		lines.push_back(line);
+	}
+	return lines;
+}
+
+// Train the tokenizer on the test corpus and save it.
+static ByteBuffer build_corpus_model(const TokenizerTrainer::Config& config)
+{
+	TokenizerTrainer trainer{ config };
+	trainer.train_on_corpus(get_corpus_path().string(), 0);
+	trainer.build_bpe();
+	return trainer.save();
+}
+
 // Test fixture for setting up and tearing down the tests
 class BpeCorpusTest : public ::testing::Test {
 protected:
@@ -60,14 +189,8 @@ protected:
 		config.cache_size = 10;
 		config.max_worker = 1;
 
-		const std::filesystem::path path = std::filesystem::path(TEST_DATA_DIR) / "test_corpus.txt";
-
-		TokenizerTrainer trainer{ config };
-		trainer.train_on_corpus(path.string(), 0);
-		trainer.build_bpe();
-
-		tokenizer_buffer = trainer.save();
-		bpe.attach(tokenizer_buffer.data());
+		tokenizer_buffer = build_corpus_model(config);
+		bpe.attach(tokenizer_buffer.data(), tokenizer_buffer.size());
 	}
 	Tokenizer bpe;
 
@@ -101,6 +224,541 @@ TEST(BpeTest, tokenize)
 	ASSERT_EQ(tokens[0], "Hello");
 }
 
+TEST(BpeTest, word_counter)
+{
+	std::mt19937 generator{ 5 };
+	std::unordered_map<std::string, u64> expected;
+	WordCounter counter;
+	WordCounter other;
+	for (size_t i = 0; i < 200000; i++) {
+		// Skewed sizes and counts, the long words go to their own arena chunks.
+		const size_t size = generator() % 1000 == 0 ? 100000 : generator() % 12;
+		std::string word = std::to_string(generator() % 20000);
+		word.resize(size, 'x');
+		const u64 count = 1 + generator() % 3;
+		expected[word] += count;
+		(i % 2 == 0 ? counter : other).add(word, count);
+	}
+	counter.merge(other);
+
+	ASSERT_EQ(counter.size(), expected.size());
+	for (const auto& [word, count] : expected) {
+		ASSERT_EQ(counter.get(word), count);
+	}
+	ASSERT_EQ(counter.get("missing"), 0);
+	std::unordered_map<std::string, u64> counts;
+	counter.for_each([&](std::string_view word, u64 count) { counts.emplace(word, count); });
+	ASSERT_EQ(counts, expected);
+	ASSERT_GT(counter.get_memory_usage(), 0);
+
+	// The moved counter keeps the words in the arena.
+	const WordCounter moved = std::move(counter);
+	ASSERT_EQ(moved.get(expected.begin()->first), expected.begin()->second);
+	ASSERT_EQ(WordCounter{}.get("word"), 0);
+
+	// Shards partition the words.
+	ShardedWordCounter sharded{ 7 };
+	for (const auto& [word, count] : expected) {
+		sharded.add(word, count);
+	}
+	ASSERT_EQ(sharded.size(), expected.size());
+	for (size_t shard = 0; shard < sharded.get_shard_count(); shard++) {
+		ASSERT_FALSE(sharded.get_shard(shard).empty());
+		sharded.get_shard(shard).for_each([&](std::string_view word, u64 count) {
+			ASSERT_EQ(sharded.get(word), count);
+			ASSERT_EQ(expected.at(std::string{ word }), count);
+		});
+	}
+}
+
+TEST(BpeTest, corpus_vocabulary)
+{
+	// The long line, the empty lines and the last line without the newline move the chunk boundaries.
+	const std::string corpus = get_corpus() + std::string(50000, 'a') + " b\n\n\n" + get_corpus() + "last line";
+
+	const auto path = std::filesystem::temp_directory_path() / "bpe_corpus_vocabulary.txt";
+	{
+		std::ofstream output(path, std::ios::binary);
+		output << corpus;
+	}
+
+	// Words of the lines of the first symbols_count bytes, the line crossing the limit is counted whole.
+	const auto count_words = [&](size_t symbols_count) {
+		std::unordered_map<std::string, u64> counts;
+		size_t begin = 0;
+		while (begin < corpus.size() && (symbols_count == 0 || begin < symbols_count)) {
+			const size_t end = std::min(corpus.find('\n', begin), corpus.size());
+			for (const auto word : split_by_words(std::string_view{ corpus }.substr(begin, end - begin))) {
+				counts[std::string{ word }]++;
+			}
+			begin = end + 1;
+		}
+		return counts;
+	};
+
+	for (const size_t symbols_count : { size_t{ 0 }, size_t{ 100001 }, corpus.size() - 3 }) {
+		const auto expected = count_words(symbols_count);
+		for (const u32 max_worker : { 1u, 2u, 3u, 7u, 64u }) {
+			TokenizerTrainer::Config config;
+			config.max_worker = max_worker;
+			TokenizerTrainer trainer{ config };
+			trainer.train_on_corpus(path.string(), symbols_count);
+			std::unordered_map<std::string, u64> counts;
+			trainer.get_word_vocab().for_each([&](std::string_view word, u64 count) { counts.emplace(word, count); });
+			EXPECT_EQ(counts, expected) << "symbols_count " << symbols_count << ", max_worker " << max_worker;
+		}
+	}
+	std::filesystem::remove(path);
+}
+
+TEST(BpeTest, word_runs)
+{
+	const auto directory = std::filesystem::temp_directory_path() / "bpe_word_runs";
+	std::filesystem::remove_all(directory);
+	std::filesystem::create_directory(directory);
+
+	// The small budget limits the merge to 3 runs at once.
+	WordRunSpiller spiller{ directory, 16 << 10 };
+	ASSERT_EQ(spiller.get_merge_fan_in(), 3);
+
+	std::mt19937 generator{ 3 };
+	std::unordered_map<std::string, u64> counts;
+	for (size_t run = 0; run < 20; run++) {
+		ShardedWordCounter counter{ 2 };
+		for (size_t i = 0; i < 500; i++) {
+			const std::string word = std::to_string(generator() % 3000);
+			const u64 count = 1 + generator() % 2;
+			counter.add(word, count);
+			counts[word] += count;
+		}
+		spiller.spill(counter);
+		ASSERT_TRUE(counter.empty());
+	}
+	ASSERT_EQ(spiller.get_run_count(), 20);
+
+	constexpr u64 min_count = 4;
+	std::unordered_map<std::string, u64> expected;
+	for (const auto& [word, count] : counts) {
+		if (count >= min_count) {
+			expected.emplace(word, count);
+		}
+	}
+	std::unordered_map<std::string, u64> merged;
+	std::string previous;
+	spiller.merge(min_count, [&](std::string_view word, u64 count) {
+		EXPECT_LT(previous, word);
+		previous = word;
+		merged.emplace(word, count);
+	});
+	EXPECT_EQ(merged, expected);
+	ASSERT_EQ(spiller.get_run_count(), 0);
+	ASSERT_TRUE(std::filesystem::is_empty(directory));
+	std::filesystem::remove_all(directory);
+}
+
+TEST(BpeTest, spilled_vocabulary)
+{
+	// The budget is checked every 64 KB of the text, the copies give enough runs to a single worker.
+	const auto path = std::filesystem::temp_directory_path() / "bpe_spilled_vocabulary.txt";
+	{
+		std::ofstream output(path, std::ios::binary);
+		for (size_t i = 0; i < 4; i++) {
+			output << get_corpus();
+		}
+	}
+	const std::string text = "Hello, spilled world! Hello again.";
+
+	TokenizerTrainer::Config config;
+	config.min_count = 2;
+	TokenizerTrainer reference{ config };
+	reference.train_on_corpus(path.string(), 0);
+	reference.train_on_text(text);
+	std::unordered_map<std::string, u64> expected;
+	reference.get_word_vocab().for_each([&](std::string_view word, u64 count) {
+		if (count >= config.min_count) {
+			expected.emplace(word, count);
+		}
+	});
+
+	const auto directory = std::filesystem::temp_directory_path() / "bpe_spilled_vocabulary";
+	std::filesystem::remove_all(directory);
+	std::filesystem::create_directory(directory);
+	const auto run_count = [&] {
+		return std::distance(std::filesystem::directory_iterator{ directory }, std::filesystem::directory_iterator{});
+	};
+
+	for (const u32 max_worker : { 1u, 3u }) {
+		config.max_worker = max_worker;
+		// The budget is exceeded many times by the test corpus. It allows merging 3 runs at once,
+		// so the runs are merged in several passes.
+		config.memory_budget = 16 << 10;
+		config.spill_directory = directory;
+		config.size = 256 + 100;
+		TokenizerTrainer trainer{ config };
+		trainer.train_on_corpus(path.string(), 0);
+		trainer.train_on_text(text);
+		ASSERT_GT(run_count(), 3);
+
+		trainer.build_bpe();
+		ASSERT_EQ(run_count(), 0);
+		std::unordered_map<std::string, u64> counts;
+		trainer.get_word_vocab().for_each([&](std::string_view word, u64 count) { counts.emplace(word, count); });
+		EXPECT_EQ(counts, expected) << "max_worker " << max_worker;
+		ASSERT_EQ(trainer.get_id_to_seq().size(), config.size);
+	}
+
+	// Runs which were not merged are removed with the trainer.
+	{
+		TokenizerTrainer trainer{ config };
+		trainer.train_on_corpus(path.string(), 0);
+		ASSERT_GT(run_count(), 0);
+	}
+	ASSERT_EQ(run_count(), 0);
+	std::filesystem::remove_all(directory);
+	std::filesystem::remove(path);
+}
+
+TEST(BpeTest, word_sketch)
+{
+	// Zipf distributed words, the long tail does not fit into the table.
+	std::mt19937 generator{ 7 };
+	std::vector<double> weights;
+	for (size_t i = 1; i <= 20000; i++) {
+		weights.push_back(1.0 / static_cast<double>(i));
+	}
+	std::discrete_distribution<size_t> distribution{ weights.begin(), weights.end() };
+
+	std::unordered_map<std::string, u64> expected;
+	WordSketch sketch{ 500, 4096, 8 };
+	WordSketch other{ 500, 4096, 8 };
+	for (size_t i = 0; i < 300000; i++) {
+		const std::string word = "w" + std::to_string(distribution(generator));
+		const u64 count = 1 + generator() % 2;
+		expected[word] += count;
+		(i < 200000 ? sketch : other).add(word, count);
+	}
+	sketch.merge(other);
+
+	ASSERT_EQ(sketch.size(), 500);
+	ASSERT_EQ(sketch.get_width(), 4096);
+	u64 total = 0;
+	for (const auto& [word, count] : expected) {
+		total += count;
+	}
+	ASSERT_EQ(sketch.get_total(), total);
+	ASSERT_EQ(sketch.get_error_bound(), static_cast<u64>(std::ceil(std::numbers::e * static_cast<double>(total) / 4096)));
+
+	// The counts are never below the true ones and stay within the error bound.
+	sketch.for_each([&](std::string_view word, u64 count) {
+		const u64 true_count = expected.at(std::string{ word });
+		ASSERT_GE(count, true_count) << word;
+		ASSERT_LE(count, true_count + sketch.get_error_bound()) << word;
+		ASSERT_EQ(sketch.get(word), count);
+		ASSERT_GE(sketch.estimate(word), count);
+	});
+	// The most frequent words are kept.
+	for (size_t i = 1; i <= 100; i++) {
+		ASSERT_GT(sketch.get("w" + std::to_string(i)), 0) << i;
+	}
+	ASSERT_EQ(sketch.get("missing"), 0);
+	ASSERT_GE(sketch.get_memory_usage(), 4096 * 8 * sizeof(u64));
+}
+
+TEST(BpeTest, sketch_vocabulary)
+{
+	const std::filesystem::path path = get_corpus_path();
+
+	TokenizerTrainer::Config config;
+	config.size = 256 + 300;
+	config.min_count = 3;
+	TokenizerTrainer exact{ config };
+	exact.train_on_corpus(path.string(), 0);
+	exact.build_bpe();
+
+	for (const u32 max_worker : { 1u, 3u }) {
+		// The table keeps about the third of the distinct words of the corpus.
+		config.max_worker = max_worker;
+		config.sketch_words = 2000;
+		config.sketch_width = 1 << 14;
+		TokenizerTrainer trainer{ config };
+		trainer.train_on_corpus(path.string(), 0);
+		trainer.build_bpe();
+
+		const WordSketch* sketch = trainer.get_word_sketch();
+		ASSERT_NE(sketch, nullptr);
+		ASSERT_EQ(sketch->size(), config.sketch_words);
+		const u64 error_bound = sketch->get_error_bound();
+		size_t word_count = 0;
+		trainer.get_word_vocab().for_each([&](std::string_view word, u64 count) {
+			const u64 true_count = exact.get_word_vocab().get(word);
+			ASSERT_GE(count, true_count) << word;
+			ASSERT_LE(count, true_count + error_bound) << word;
+			word_count += true_count >= config.min_count;
+		});
+		// Most of the words with min_count are found.
+		size_t exact_word_count = 0;
+		exact.get_word_vocab().for_each([&](std::string_view, u64 count) { exact_word_count += count >= config.min_count; });
+		EXPECT_GE(word_count * 100, exact_word_count * 95) << "max_worker " << max_worker;
+
+		// The merge list differs from the exact one only in the rare pairs, whose order depends on the ties.
+		const auto& merges = trainer.get_id_to_seq();
+		const auto& exact_merges = exact.get_id_to_seq();
+		ASSERT_EQ(merges.size(), exact_merges.size());
+		const size_t common_prefix = to<size_t>(
+			std::mismatch(merges.begin(), merges.end(), exact_merges.begin()).first - merges.begin());
+		EXPECT_GE(common_prefix, 256 + 25) << "max_worker " << max_worker;
+		const std::unordered_set<std::string> exact_tokens(exact_merges.begin(), exact_merges.end());
+		const size_t common_tokens = to<size_t>(std::ranges::count_if(merges,
+			[&](const std::string& token) { return exact_tokens.contains(token); }));
+		EXPECT_GE(common_tokens * 100, merges.size() * 95) << "max_worker " << max_worker;
+	}
+
+	config.memory_budget = 1 << 20;
+	EXPECT_THROW(TokenizerTrainer{ config }, std::invalid_argument);
+}
+
+TEST(BpeTest, load_mapped_file)
+{
+	TokenizerTrainer::Config config;
+	config.size = 256 + 10;
+	config.min_count = 1;
+	config.cache_size = 10;
+	config.max_worker = 1;
+
+	TokenizerTrainer trainer{ config };
+	trainer.train_on_text("Hello, world! Hello, mapped world!");
+	trainer.build_bpe();
+
+	const ByteBuffer buffer = trainer.save();
+	const auto path = std::filesystem::temp_directory_path() / "bpe_load_mapped_file.bin";
+	{
+		std::ofstream file(path, std::ios::binary);
+		file.write(reinterpret_cast<const char*>(buffer.data()), static_cast<std::streamsize>(buffer.size()));
+	}
+
+	Tokenizer attached;
+	attached.attach(buffer.data(), buffer.size());
+
+	MapOptions options;
+	options.populate = true;
+	options.will_need = true;
+	options.huge_pages = true;
+	Tokenizer loaded(path, options);
+	// The moved tokenizer keeps the mapping alive.
+	Tokenizer moved = std::move(loaded);
+
+	const std::string_view text = "Hello, mapped world! Hello again.";
+	const auto ids = moved.encode(text);
+	ASSERT_EQ(ids, attached.encode(text));
+	ASSERT_EQ(moved.decode(ids), text);
+
+	std::filesystem::remove(path);
+	ASSERT_THROW(MappedFile{ path }, std::system_error);
+}
+
+TEST(BpeTest, model_file)
+{
+	TokenizerTrainer::Config config;
+	config.size = 256 + 10;
+	config.min_count = 1;
+	config.cache_size = 10;
+	config.max_worker = 1;
+
+	TokenizerTrainer trainer{ config };
+	trainer.train_on_text("Hello, world! Hello, model world!");
+	trainer.build_bpe();
+
+	ByteBuffer buffer = trainer.save();
+	Tokenizer tokenizer;
+	ASSERT_TRUE(tokenizer.attach(buffer.data()));
+	ASSERT_TRUE(tokenizer.verify_checksum());
+	ASSERT_EQ(tokenizer.decode(tokenizer.encode("Hello, model world!")), "Hello, model world!");
+
+	// Truncated model.
+	ASSERT_FALSE(Tokenizer{}.attach(buffer.data(), buffer.size() - 1));
+
+	// Corrupted data.
+	buffer.back() ^= 1;
+	ASSERT_TRUE(tokenizer.attach(buffer.data(), buffer.size()));
+	ASSERT_FALSE(tokenizer.verify_checksum());
+
+	// Unknown magic.
+	buffer.front() ^= 1;
+	ASSERT_FALSE(tokenizer.attach(buffer.data(), buffer.size()));
+
+	config.checksum = false;
+	TokenizerTrainer no_checksum_trainer{ config };
+	no_checksum_trainer.train_on_text("Hello, world!");
+	no_checksum_trainer.build_bpe();
+	const ByteBuffer no_checksum_buffer = no_checksum_trainer.save();
+	ASSERT_TRUE(tokenizer.attach(no_checksum_buffer.data(), no_checksum_buffer.size()));
+	ASSERT_FALSE(tokenizer.verify_checksum());
+}
+
+TEST(BpeTest, cache_filter)
+{
+	std::vector<std::string> keys;
+	for (u32 i = 0; i < 20000; i++) {
+		keys.push_back("word" + std::to_string(i));
+	}
+	const std::vector<std::string_view> members(keys.begin(), keys.begin() + 10000);
+
+	ByteBuffer buffer;
+	MappedBloomFilter::write_to_buffer(members, 10, buffer);
+	MappedBloomFilter filter;
+	ASSERT_EQ(filter.attach(buffer.data()), buffer.size());
+
+	for (const auto word : members) {
+		ASSERT_TRUE(filter.may_contain(word));
+	}
+	size_t false_positives = 0;
+	for (size_t i = members.size(); i < keys.size(); i++) {
+		false_positives += filter.may_contain(keys[i]);
+	}
+	EXPECT_LT(false_positives, keys.size() / 50);
+
+	// The filter does not change the encoding.
+	TokenizerTrainer::Config config;
+	config.size = 1024;
+	config.cache_size = 100;
+	const ByteBuffer model = build_corpus_model(config);
+	config.cache_filter_bits = 10;
+	const ByteBuffer filter_model = build_corpus_model(config);
+	ASSERT_GT(filter_model.size(), model.size());
+
+	Tokenizer tokenizer;
+	tokenizer.attach(model.data(), model.size());
+	Tokenizer filter_tokenizer;
+	filter_tokenizer.attach(filter_model.data(), filter_model.size());
+	ASSERT_EQ(filter_tokenizer.encode(get_corpus()), tokenizer.encode(get_corpus()));
+}
+
+TEST(BpeTest, mapped_map_get_view)
+{
+	// Keys are padded, so the ids are aligned and read in place.
+	using Ids = MappedMap<std::string_view, std::vector<u32>, DefaultMapConfig<std::string_view, std::vector<u32>,
+		StringHash, std::equal_to<std::string_view>, PaddedStringSerializer, DataSerializer<std::vector<u32>>,
+		MapLayout::swiss>>;
+
+	std::unordered_map<std::string, std::vector<u32>> words;
+	for (u32 i = 0; i < 1000; i++) {
+		words.emplace(std::string(i % 7 + 1, 'a') + std::to_string(i), std::vector<u32>(i % 5 + 1, i));
+	}
+
+	ByteBuffer buffer;
+	Ids::write_to_buffer(words, buffer);
+	const Ids cache{ buffer.data() };
+	for (const auto& [word, ids] : words) {
+		const auto view = cache.get_view(word);
+		ASSERT_EQ(reinterpret_cast<uintptr_t>(view.data()) % alignof(u32), 0);
+		ASSERT_EQ(std::vector<u32>(view.begin(), view.end()), ids);
+	}
+	ASSERT_TRUE(cache.get_view("missing").empty());
+}
+
+TEST(BpeTest, cache_codec)
+{
+	// Small ids are stored as u16, the rest by group varint of all byte lengths and partial groups.
+	std::unordered_map<std::string, std::vector<u32>> words;
+	std::mt19937 random{ 7 };
+	for (u32 i = 0; i < 2000; i++) {
+		std::vector<u32> ids(i % 70);
+		const u32 max_id = std::array<u32, 4>{ 0xFF, 0xFFFF, 0x1000000, 0xFFFFFFFF }[i % 4];
+		for (u32& id : ids) {
+			id = static_cast<u32>(random()) % max_id + (i % 8 == 3 ? 1 : 0);
+		}
+		words.emplace("w" + std::to_string(i), ids);
+	}
+
+	ByteBuffer buffer;
+	Cache::write_to_buffer(words, buffer);
+	const Cache cache{ buffer.data() };
+	for (const auto& [word, ids] : words) {
+		std::vector<u32> decoded{ 42 };
+		ASSERT_TRUE(cache.get_append(word, decoded));
+		ASSERT_EQ(decoded.front(), 42);
+		ASSERT_EQ(std::vector<u32>(decoded.begin() + 1, decoded.end()), ids);
+		ASSERT_EQ(cache.get(word), ids);
+	}
+	std::vector<u32> decoded;
+	ASSERT_FALSE(cache.get_append("missing", decoded));
+	ASSERT_TRUE(decoded.empty());
+
+	// Every group varint byte length is decoded, including the ids of 3 bytes.
+	const std::vector<u32> lengths{ 0, 0xFF, 0x100, 0xFFFF, 0x10000, 0xFFFFFF, 0x1000000, 0xFFFFFFFF, 1 };
+	ByteBuffer value(CompactIdsSerializer{}.size(lengths));
+	BufferWriter writer{ value.data() };
+	CompactIdsSerializer{}.write(lengths, writer);
+	ASSERT_EQ(writer.ptr(), value.data() + value.size());
+	BufferReader reader{ value.data() };
+	ASSERT_EQ(CompactIdsSerializer{}.read(reader), lengths);
+	ASSERT_EQ(reader.ptr(), value.data() + value.size());
+}
+
+TEST(BpeTest, mapped_map_layouts)
+{
+	using Chained = MappedMap<std::string_view, u32, DefaultMapConfig<std::string_view, u32, StringHash>>;
+	using Swiss = MappedMap<std::string_view, u32, DefaultMapConfig<std::string_view, u32, StringHash,
+		std::equal_to<std::string_view>, DataSerializer<std::string_view>, DataSerializer<u32>, MapLayout::swiss>>;
+	using Perfect = MappedMap<std::string_view, u32, DefaultMapConfig<std::string_view, u32, StringHash,
+		std::equal_to<std::string_view>, DataSerializer<std::string_view>, DataSerializer<u32>, MapLayout::perfect>>;
+
+	ThreadPool pool{ 3 };
+	for (const u32 size : std::vector<u32>{ 0, 1, 14, 15, 16, 1000, 20000 }) {
+		std::unordered_map<std::string, u32> words;
+		for (u32 i = 0; i < size; i++) {
+			words.emplace("word" + std::to_string(i), i);
+		}
+
+		ByteBuffer chained_buffer;
+		Chained::write_to_buffer(words, chained_buffer);
+		const Chained chained{ chained_buffer.data() };
+		ByteBuffer swiss_buffer;
+		Swiss::write_to_buffer(words, swiss_buffer);
+		const Swiss swiss{ swiss_buffer.data() };
+		ByteBuffer perfect_buffer;
+		Perfect::write_to_buffer(words, perfect_buffer);
+		const Perfect perfect{ perfect_buffer.data() };
+		// The partitions built in parallel are the same.
+		ByteBuffer parallel_perfect_buffer;
+		Perfect::write_to_buffer(words, parallel_perfect_buffer, &pool);
+		ASSERT_EQ(parallel_perfect_buffer, perfect_buffer);
+
+		ASSERT_EQ(swiss.size(), words.size());
+		ASSERT_EQ(perfect.size(), words.size());
+		for (const auto& [word, value] : words) {
+			ASSERT_TRUE(swiss.contains(word));
+			ASSERT_EQ(swiss.get(word), value);
+			ASSERT_EQ(perfect.get(word), value);
+			ASSERT_EQ(chained.get(word), value);
+		}
+		for (u32 i = size; i < size + 1000; i++) {
+			const std::string word = "word" + std::to_string(i);
+			ASSERT_FALSE(swiss.contains(word));
+			ASSERT_FALSE(perfect.contains(word));
+			ASSERT_FALSE(chained.contains(word));
+		}
+
+		size_t count = 0;
+		for (auto pos = swiss.get_begin_position(); pos != swiss.get_end_position(); pos = swiss.get_next_position(pos)) {
+			const auto [word, value] = swiss.get_key_value(pos);
+			ASSERT_EQ(words.at(std::string{ word }), value);
+			count++;
+		}
+		ASSERT_EQ(count, words.size());
+	}
+
+	// The map written with another hash function is not attached.
+	ByteBuffer buffer;
+	Swiss::write_to_buffer(std::unordered_map<std::string, u32>{ { "word", 1 } }, buffer);
+	buffer[4 * sizeof(u32)] ^= 1;
+	ASSERT_EQ(Swiss{}.attach(buffer.data()), 0);
+	buffer.clear();
+	Perfect::write_to_buffer(std::unordered_map<std::string, u32>{ { "word", 1 } }, buffer);
+	buffer[4 * sizeof(u32)] ^= 1;
+	ASSERT_EQ(Perfect{}.attach(buffer.data()), 0);
+}
+
 TEST_F(BpeCorpusTest, encode_decode)
 {
 	auto encode_decode = [this](std::string_view text) -> bool {
@@ -119,4 +777,463 @@ TEST_F(BpeCorpusTest, encode_decode)
 	ASSERT_TRUE(encode_decode("Hello, world! "));
 	ASSERT_TRUE(encode_decode("Hello, world!  "));
 	ASSERT_TRUE(encode_decode("Hello, world!   "));
-}
\ No newline at end of file
+}
+
+// Reference bpe encoder: rescans all pairs after every merge.
+static std::vector<u32> reference_encode(const TokenizerTrainer& trainer, std::string_view text)
+{
+	const auto& merge_table = trainer.get_merge_table();
+
+	std::vector<u32> result;
+	for (const auto word : split_by_words(text)) {
+		std::vector<u32> ids;
+		for (char c : word) {
+			ids.push_back(static_cast<u8>(c));
+		}
+
+		while (ids.size() >= 2) {
+			std::optional<std::pair<u32, size_t>> best;
+			for (size_t i = 1; i < ids.size(); i++) {
+				const auto it = merge_table.find(Pair{ ids[i - 1], ids[i] });
+				if (it != merge_table.end() && (!best || it->second < best->first)) {
+					best = std::pair<u32, size_t>{ it->second, i - 1 };
+				}
+			}
+			if (!best) {
+				break;
+			}
+			ids[best->second] = best->first;
+			ids.erase(ids.begin() + static_cast<std::ptrdiff_t>(best->second) + 1);
+		}
+		result.insert(result.end(), ids.begin(), ids.end());
+	}
+	return result;
+}
+
+TEST(BpeTest, encode_matches_reference)
+{
+	TokenizerTrainer::Config config;
+	config.size = 4096;
+	config.min_count = 1;
+	config.cache_size = 0;
+	config.max_worker = 1;
+
+	// The trainer is the reference of the encoding.
+	TokenizerTrainer trainer{ config };
+	trainer.train_on_corpus(get_corpus_path().string(), 0);
+	trainer.build_bpe();
+
+	// Merge ranks table lookups.
+	const ByteBuffer ranks_buffer = trainer.save();
+	Tokenizer ranks_tokenizer;
+	ranks_tokenizer.attach(ranks_buffer.data(), ranks_buffer.size());
+
+	// Merge table lookups.
+	config.merge_ranks = false;
+	const ByteBuffer buffer = build_corpus_model(config);
+	Tokenizer tokenizer;
+	tokenizer.attach(buffer.data());
+
+	const std::string& corpus = get_corpus();
+
+	// Long words without spaces.
+	std::string glued;
+	for (char c : corpus) {
+		if (c != ' ' && c != '\n' && c != '\r' && c != '\t') {
+			glued.push_back(c);
+		}
+	}
+
+	std::mt19937 generator{ 42 };
+	std::uniform_int_distribution<int> byte_distribution{ 0, 255 };
+	std::string random_bytes;
+	for (size_t i = 0; i < 2048; i++) {
+		random_bytes.push_back(static_cast<char>(byte_distribution(generator)));
+	}
+
+	const std::vector<std::string> texts{
+		"",
+		"Hello, world!",
+		std::string(1000, 'e'),
+		corpus.substr(0, 20000),
+		glued.substr(0, 4000),
+		random_bytes,
+	};
+	for (const auto& text : texts) {
+		const auto expected = reference_encode(trainer, text);
+		EXPECT_EQ(tokenizer.encode(text), expected);
+		EXPECT_EQ(ranks_tokenizer.encode(text), expected);
+	}
+}
+
+TEST(ThreadPoolTest, run_all_tasks)
+{
+	ThreadPool pool{ 4 };
+
+	for (size_t task_count : std::vector<size_t>{ 0, 1, 3, 1000 }) {
+		std::vector<std::atomic<int>> runs(task_count);
+		std::vector<u64> weights(task_count);
+		for (size_t i = 0; i < task_count; i++) {
+			weights[i] = i % 7 == 0 ? 1000 : 1;
+		}
+
+		pool.run(task_count, weights, [&](size_t task, size_t worker) {
+			ASSERT_LT(worker, pool.thread_count());
+			runs[task]++;
+		});
+
+		for (const auto& count : runs) {
+			EXPECT_EQ(count.load(), 1);
+		}
+	}
+}
+
+TEST(ThreadPoolTest, rethrow_task_exception)
+{
+	ThreadPool pool{ 3 };
+	EXPECT_THROW(pool.run(10, [](size_t task, size_t) {
+		if (task == 5) {
+			throw std::runtime_error("task failed");
+		}
+	}), std::runtime_error);
+
+	// The pool is still usable.
+	std::atomic<size_t> count{ 0 };
+	pool.run(10, [&](size_t, size_t) { count++; });
+	EXPECT_EQ(count.load(), 10);
+}
+
+TEST_F(BpeCorpusTest, encode_batch)
+{
+	std::vector<std::string> lines = get_corpus_lines();
+
+	// One giant document among the short ones.
+	std::string giant;
+	for (const auto& item : lines) {
+		giant += item;
+		giant += "\n";
+	}
+	lines.insert(lines.begin() + 10, giant);
+	lines.emplace_back();
+
+	const std::vector<std::string_view> texts(lines.begin(), lines.end());
+
+	ThreadPool pool{ 4 };
+	const EncodedBatch batch = bpe.encode_batch(texts, pool);
+
+	ASSERT_EQ(batch.size(), texts.size());
+	ASSERT_EQ(batch.offsets.back(), batch.ids.size());
+	for (size_t i = 0; i < texts.size(); i++) {
+		const auto ids = batch[i];
+		EXPECT_EQ(std::vector<u32>(ids.begin(), ids.end()), bpe.encode(texts[i]));
+	}
+
+	EXPECT_EQ(bpe.encode_batch({}).size(), 0);
+}
+
+TEST_F(BpeCorpusTest, count_tokens_and_prefix)
+{
+	std::vector<std::string> texts{ "", " ", "Hello, world!  ", " the the of and", get_corpus() };
+
+	auto check = [this](std::string_view text) {
+		const std::vector<u32> ids = bpe.encode(text);
+		ASSERT_EQ(bpe.count_tokens(text), ids.size()) << text;
+		for (const size_t max_tokens : { size_t{ 0 }, size_t{ 1 }, size_t{ 7 }, ids.size() / 2, ids.size(), ids.size() + 5 }) {
+			const size_t size = std::min(max_tokens, ids.size());
+			ASSERT_EQ(bpe.encode_prefix(text, max_tokens), std::vector<u32>(ids.begin(), ids.begin() + to<std::ptrdiff_t>(size)));
+		}
+	};
+	for (const auto& text : texts) {
+		check(text);
+	}
+
+	// Words missing in the mapped cache are counted through the runtime cache as well.
+	bpe.enable_runtime_cache(WordCache::Config{});
+	for (const auto& text : texts) {
+		check(text);
+		check(text);
+	}
+}
+
+TEST_F(BpeCorpusTest, narrow_ids)
+{
+	const std::string& corpus = get_corpus();
+
+	ASSERT_TRUE(bpe.supports_ids<u16>());
+	const std::vector<u32> wide = bpe.encode(corpus);
+	const std::vector<u16> narrow(wide.begin(), wide.end());
+
+	ASSERT_EQ(bpe.encode<u16>(corpus), narrow);
+	ASSERT_EQ(bpe.decode(narrow), corpus);
+	ASSERT_EQ(bpe.encode_prefix<u16>(corpus, 100), std::vector<u16>(narrow.begin(), narrow.begin() + 100));
+
+	EncodeScratch scratch;
+	std::vector<u16> span_ids(narrow.size());
+	ASSERT_EQ(bpe.encode_into(corpus, std::span<u16>{ span_ids }, scratch), narrow.size());
+	ASSERT_EQ(span_ids, narrow);
+
+	ThreadPool pool{ 4 };
+	EncodeOptions options;
+	options.threads = 4;
+	options.pool = &pool;
+	options.min_parallel_size = 0;
+	ASSERT_EQ(bpe.encode<u16>(corpus, options), narrow);
+
+	const std::vector<std::string_view> texts{ corpus, "Hello, world!", "" };
+	const BasicEncodedBatch<u16> batch = bpe.encode_batch<u16>(texts, pool);
+	ASSERT_EQ(batch.size(), texts.size());
+	for (size_t i = 0; i < texts.size(); i++) {
+		const auto ids = batch[i];
+		EXPECT_EQ(std::vector<u16>(ids.begin(), ids.end()), bpe.encode<u16>(texts[i]));
+	}
+
+	std::vector<u16> streamed;
+	BasicStreamEncoder<u16> encoder{ bpe, [&streamed](std::span<const u16> part) {
+		streamed.insert(streamed.end(), part.begin(), part.end());
+	} };
+	std::istringstream stream{ corpus };
+	encoder.read(stream, 1000);
+	encoder.finish();
+	ASSERT_EQ(streamed, narrow);
+
+	// Words missing in the mapped cache go through the runtime cache of the wide ids.
+	bpe.enable_runtime_cache(WordCache::Config{});
+	ASSERT_EQ(bpe.encode<u16>(corpus), narrow);
+	ASSERT_EQ(bpe.encode<u16>(corpus), narrow);
+}
+
+TEST_F(BpeCorpusTest, token_shards)
+{
+	std::vector<std::string> lines = get_corpus_lines();
+	ASSERT_GT(lines.size(), 10);
+	lines.insert(lines.begin() + 3, "");
+
+	const auto prefix = std::filesystem::temp_directory_path() / "bpe_token_shards";
+	std::vector<std::vector<u16>> documents;
+	size_t shard_count = 0;
+	{
+		// The small shards to start the next one every few documents.
+		TokenShardWriter writer{ prefix, sizeof(u16), 100 };
+		for (const auto& line : lines) {
+			documents.push_back(bpe.encode<u16>(line));
+			writer.write(std::span<const u16>{ documents.back() });
+		}
+		writer.finish();
+		shard_count = writer.get_shard_count();
+		ASSERT_GT(shard_count, 1);
+		ASSERT_EQ(writer.get_document_count(), documents.size());
+	}
+
+	size_t document = 0;
+	for (size_t shard = 0; shard < shard_count; shard++) {
+		const TokenShard tokens{ prefix, shard };
+		ASSERT_EQ(tokens.get_id_size(), sizeof(u16));
+		ASSERT_GT(tokens.size(), 0);
+		u64 token_count = 0;
+		for (size_t i = 0; i < tokens.size(); i++, document++) {
+			const auto ids = tokens.document<u16>(i);
+			ASSERT_EQ(std::vector<u16>(ids.begin(), ids.end()), documents[document]);
+			token_count += ids.size();
+		}
+		ASSERT_EQ(tokens.get_token_count(), token_count);
+		ASSERT_EQ(tokens.ids<u16>().size(), token_count);
+		std::filesystem::remove(TokenShardFormat::get_path(prefix, shard, ".bin"));
+		std::filesystem::remove(TokenShardFormat::get_path(prefix, shard, ".idx"));
+	}
+	ASSERT_EQ(document, documents.size());
+
+	// The empty corpus has the single empty shard.
+	{
+		TokenShardWriter writer{ prefix, sizeof(u32), 100 };
+		writer.finish();
+		ASSERT_EQ(writer.get_shard_count(), 1);
+	}
+	const TokenShard empty{ prefix, 0 };
+	ASSERT_EQ(empty.size(), 0);
+	ASSERT_EQ(empty.get_id_size(), sizeof(u32));
+	ASSERT_TRUE(empty.ids<u32>().empty());
+	std::filesystem::remove(TokenShardFormat::get_path(prefix, 0, ".bin"));
+
+	// The truncated index is rejected.
+	std::filesystem::resize_file(TokenShardFormat::get_path(prefix, 0, ".idx"), TokenShardFormat::header_size);
+	ASSERT_THROW(TokenShard(prefix, 0), std::system_error);
+	{
+		std::ofstream data{ TokenShardFormat::get_path(prefix, 0, ".bin"), std::ios::binary };
+	}
+	ASSERT_THROW(TokenShard(prefix, 0), std::runtime_error);
+	std::filesystem::remove(TokenShardFormat::get_path(prefix, 0, ".bin"));
+	std::filesystem::remove(TokenShardFormat::get_path(prefix, 0, ".idx"));
+}
+
+TEST_F(BpeCorpusTest, decode_batch)
+{
+	std::vector<std::string> lines = get_corpus_lines();
+	lines.emplace_back();
+
+	std::vector<std::vector<u32>> encoded;
+	for (const auto& item : lines) {
+		encoded.push_back(bpe.encode(item));
+	}
+	const std::vector<std::span<const u32>> batch(encoded.begin(), encoded.end());
+	const DecodedBatch decoded = bpe.decode_batch(batch);
+
+	ASSERT_EQ(decoded.size(), lines.size());
+	ASSERT_EQ(decoded.offsets.back(), decoded.text.size());
+	std::string text = "prefix";
+	for (size_t i = 0; i < lines.size(); i++) {
+		EXPECT_EQ(decoded[i], lines[i]);
+		bpe.decode_into(encoded[i], text);
+	}
+	EXPECT_EQ(text, "prefix" + decoded.text);
+
+	EXPECT_EQ(bpe.decode_batch({}).size(), 0);
+}
+
+TEST_F(BpeCorpusTest, encode_parallel)
+{
+	const std::string& corpus = get_corpus();
+
+	ThreadPool pool{ 4 };
+	for (size_t threads : std::vector<size_t>{ 1, 2, 3, 8, 1000 }) {
+		EncodeOptions options;
+		options.threads = threads;
+		options.pool = &pool;
+		options.min_parallel_size = 0;
+
+		EXPECT_EQ(bpe.encode(corpus, options), bpe.encode(corpus));
+		EXPECT_EQ(bpe.encode("  Hello,   world!  ", options), bpe.encode("  Hello,   world!  "));
+	}
+}
+
+TEST_F(BpeCorpusTest, stream_encoder)
+{
+	const std::string& corpus = get_corpus();
+
+	std::vector<u32> ids;
+	StreamEncoder encoder{ bpe, [&ids](std::span<const u32> part) { ids.insert(ids.end(), part.begin(), part.end()); } };
+
+	std::mt19937 generator{ 3 };
+	const std::string_view alphabet = "  \n\t,.!Hello";
+	for (size_t iteration = 0; iteration < 200; iteration++) {
+		std::string text;
+		const size_t size = generator() % 64;
+		for (size_t i = 0; i < size; i++) {
+			text.push_back(alphabet[generator() % alphabet.size()]);
+		}
+		if (iteration == 0) {
+			text = corpus;
+		}
+
+		// Feed the text by chunks of the random size.
+		ids.clear();
+		size_t pos = 0;
+		while (pos < text.size()) {
+			const size_t chunk_size = 1 + generator() % 100;
+			encoder.write(std::string_view{ text }.substr(pos, chunk_size));
+			pos += chunk_size;
+		}
+		encoder.finish();
+		EXPECT_EQ(ids, bpe.encode(text)) << text;
+	}
+
+	ids.clear();
+	std::istringstream stream{ corpus };
+	encoder.read(stream, 1000);
+	encoder.finish();
+	EXPECT_EQ(ids, bpe.encode(corpus));
+}
+
+// Whether the text consists of the complete UTF-8 sequences.
+static bool is_complete_utf8(std::string_view text)
+{
+	for (size_t pos = 0; pos < text.size();) {
+		const u8 lead = static_cast<u8>(text[pos]);
+		const size_t length = lead < 0x80 ? 1 : lead < 0xE0 ? 2 : lead < 0xF0 ? 3 : 4;
+		for (size_t i = 1; i < length; i++) {
+			if (pos + i >= text.size() || (static_cast<u8>(text[pos + i]) & 0xC0) != 0x80) {
+				return false;
+			}
+		}
+		pos += length;
+	}
+	return true;
+}
+
+TEST_F(BpeCorpusTest, stream_decoder)
+{
+	const std::string text = get_corpus().substr(0, 10000)
+		+ " Привет, мир! Ελληνικά 日本語のテキスト 😀🚀 naïve café \xF0\x9F\x8C\x8D";
+	const std::vector<u32> ids = bpe.encode(text);
+
+	std::string decoded;
+	bool complete = true;
+	StreamDecoder decoder{ bpe, [&](std::string_view part) {
+		complete = complete && !part.empty() && is_complete_utf8(part);
+		decoded += part;
+	} };
+
+	for (const u32 id : ids) {
+		decoder.write(id);
+	}
+	decoder.finish();
+	EXPECT_TRUE(complete);
+	EXPECT_EQ(decoded, text);
+
+	// Small batches.
+	std::mt19937 generator{ 5 };
+	decoded.clear();
+	for (size_t pos = 0; pos < ids.size();) {
+		const size_t size = std::min<size_t>(generator() % 4, ids.size() - pos);
+		decoder.write(std::span<const u32>{ ids }.subspan(pos, size));
+		pos += size;
+	}
+	decoder.finish();
+	EXPECT_TRUE(complete);
+	EXPECT_EQ(decoded, text);
+
+	// Invalid sequences are passed as is, the incomplete tail is passed by finish().
+	decoded.clear();
+	for (const u32 id : { 0xF0u, u32{ 'a' }, 0x80u, u32{ 'b' }, 0xE6u, 0x97u }) {
+		decoder.write(id);
+	}
+	EXPECT_EQ(decoded, "\xF0" "a\x80" "b");
+	decoder.finish();
+	EXPECT_EQ(decoded, "\xF0" "a\x80" "b\xE6\x97");
+}
+
+TEST_F(BpeCorpusTest, runtime_cache)
+{
+	const std::string& corpus = get_corpus();
+
+	const std::vector<u32> expected = bpe.encode(corpus);
+	EXPECT_EQ(bpe.get_runtime_cache_stats().hits, 0);
+
+	WordCache::Config config;
+	config.byte_budget = 1 << 20;
+	config.shard_count = 4;
+	bpe.enable_runtime_cache(config);
+
+	EXPECT_EQ(bpe.encode(corpus), expected);
+	const WordCache::Stats first = bpe.get_runtime_cache_stats();
+	EXPECT_GT(first.misses, 0);
+	EXPECT_GT(first.insertions, 0);
+	EXPECT_EQ(first.words, first.insertions);
+
+	EXPECT_EQ(bpe.encode(corpus), expected);
+	const WordCache::Stats second = bpe.get_runtime_cache_stats();
+	EXPECT_EQ(second.misses, first.misses);
+	EXPECT_GT(second.hits, first.hits);
+
+	// Small budget evicts words and stays within the budget.
+	config.byte_budget = 16 << 10;
+	bpe.enable_runtime_cache(config);
+	ThreadPool pool{ 4 };
+	const std::vector<std::string_view> texts(4, corpus);
+	const EncodedBatch batch = bpe.encode_batch(texts, pool);
+	for (size_t i = 0; i < texts.size(); i++) {
+		EXPECT_TRUE(std::equal(batch[i].begin(), batch[i].end(), expected.begin(), expected.end()));
+	}
+	const WordCache::Stats small = bpe.get_runtime_cache_stats();
+	EXPECT_GT(small.evictions, 0);
+	EXPECT_LE(small.bytes, config.byte_budget);
+}
@@ -0,0 +1,400 @@
+// Bulk tokenization of the corpus into the memory mappable token shards, see token_shards.h.
+// The pipeline: the reader thread maps the inputs and cuts them into batches of the whole documents,
+// the batches are encoded in parallel on all cores, and the writer thread appends them to the shards.
+#include "bpe.h"
+#include "thread_pool.h"
+#include "token_shards.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+using namespace bpe;
+
+namespace {
+
+struct Options {
+	std::filesystem::path model;
+	std::filesystem::path output;
+	// Input files, "-" is stdin. Stdin if empty.
+	std::vector<std::string> inputs;
+	// Output ids type: "u16", "u32" or "auto" - u16 if the vocabulary fits.
+	std::string ids = "auto";
+	// Every line is the document, otherwise every input is the document.
+	bool lines = true;
+	u64 shard_tokens = u64{ 1 } << 28;
+	size_t threads = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+	size_t batch_bytes = size_t{ 16 } << 20;
+};
+
+void print_usage()
+{
+	std::cerr <<
+		"Usage: bpe_tokenize --model MODEL --output PREFIX [options] [INPUT...]\n"
+		"Tokenize the inputs (stdin if none or \"-\") into PREFIX_NNNNN.bin token shards\n"
+		"and PREFIX_NNNNN.idx document indexes.\n"
+		"Options:\n"
+		"  --ids u16|u32|auto      Output ids type, auto selects u16 if the vocabulary fits (auto)\n"
+		"  --documents lines|files Every non-empty line or every input is the document (lines)\n"
+		"  --shard-tokens N        Start the next shard after N tokens (268435456)\n"
+		"  --threads N             Encoding threads (all hardware threads)\n"
+		"  --batch-mb N            Text of the single encoded batch in megabytes (16)\n";
+}
+
+std::optional<Options> parse_options(int argc, char** argv)
+{
+	Options options;
+	for (int i = 1; i < argc; i++) {
+		const std::string_view arg = argv[i];
+		const auto value = [&]() -> std::optional<std::string> {
+			if (i + 1 >= argc) {
+				return std::nullopt;
+			}
+			return std::string{ argv[++i] };
+		};
+		const auto number = [&]() -> std::optional<u64> {
+			const auto text = value();
+			if (!text || text->empty() || text->size() > 18 || text->find_first_not_of("0123456789") != std::string::npos) {
+				return std::nullopt;
+			}
+			return std::stoull(*text);
+		};
+
+		if (arg == "--model" || arg == "--output" || arg == "--ids" || arg == "--documents") {
+			const auto text = value();
+			if (!text) {
+				return std::nullopt;
+			}
+			if (arg == "--model") {
+				options.model = *text;
+			} else if (arg == "--output") {
+				options.output = *text;
+			} else if (arg == "--ids") {
+				if (*text != "u16" && *text != "u32" && *text != "auto") {
+					return std::nullopt;
+				}
+				options.ids = *text;
+			} else {
+				if (*text != "lines" && *text != "files") {
+					return std::nullopt;
+				}
+				options.lines = *text == "lines";
+			}
+		} else if (arg == "--shard-tokens" || arg == "--threads" || arg == "--batch-mb") {
+			const auto count = number();
+			if (!count || *count == 0) {
+				return std::nullopt;
+			}
+			if (arg == "--shard-tokens") {
+				options.shard_tokens = *count;
+			} else if (arg == "--threads") {
+				options.threads = to<size_t>(*count);
+			} else {
+				options.batch_bytes = to<size_t>(*count) << 20;
+			}
+		} else if (arg.size() > 1 && arg[0] == '-') {
+			return std::nullopt;
+		} else {
+			options.inputs.emplace_back(arg);
+		}
+	}
+	if (options.model.empty() || options.output.empty()) {
+		return std::nullopt;
+	}
+	if (options.inputs.empty()) {
+		options.inputs.emplace_back("-");
+	}
+	return options;
+}
+
+// Bounded queue between the pipeline stages.
+template<typename T>
+class Channel {
+public:
+	explicit Channel(size_t _capacity) : capacity(_capacity), closed(false) {}
+
+	// Wait for the free place and push the item. Return false if the channel is closed.
+	bool push(T item)
+	{
+		std::unique_lock lock{ mutex };
+		condition.wait(lock, [this] { return closed || items.size() < capacity; });
+		if (closed) {
+			return false;
+		}
+		items.push_back(std::move(item));
+		condition.notify_all();
+		return true;
+	}
+
+	// Wait for the item. Return nullopt when the channel is closed and empty.
+	std::optional<T> pop()
+	{
+		std::unique_lock lock{ mutex };
+		condition.wait(lock, [this] { return closed || !items.empty(); });
+		if (items.empty()) {
+			return std::nullopt;
+		}
+		T item = std::move(items.front());
+		items.pop_front();
+		condition.notify_all();
+		return item;
+	}
+
+	// No more items are pushed, the rest are still popped.
+	void close()
+	{
+		std::lock_guard lock{ mutex };
+		closed = true;
+		condition.notify_all();
+	}
+
+private:
+	const size_t capacity;
+	std::mutex mutex;
+	std::condition_variable condition;
+	std::deque<T> items;
+	bool closed;
+};
+
+// Whole documents of the input. The owner keeps the text alive: the mapped file or the string read from stdin.
+struct TextBatch {
+	std::shared_ptr<const void> owner;
+	std::vector<std::string_view> documents;
+	size_t bytes = 0;
+};
+
+template<TokenId Id>
+struct IdsBatch {
+	BasicEncodedBatch<Id> ids;
+	size_t bytes = 0;
+};
+
+// Reader of the inputs, cuts them into the batches of about batch_bytes.
+class Reader {
+public:
+	Reader(const Options& _options, Channel<TextBatch>& _output) : options(_options), output(_output) {}
+
+	// Read all inputs, stop early if the output is closed.
+	void run()
+	{
+		try {
+			for (const auto& input : options.inputs) {
+				if (input == "-") {
+					read_stdin();
+				} else {
+					read_file(input);
+				}
+			}
+			flush();
+		} catch (const Stopped&) {
+		}
+	}
+
+private:
+	struct Stopped {};
+
+	const Options& options;
+	Channel<TextBatch>& output;
+	TextBatch batch;
+
+	void add_document(std::string_view document, size_t bytes)
+	{
+		if (!document.empty()) {
+			batch.documents.push_back(document);
+		}
+		batch.bytes += bytes;
+		if (batch.bytes >= options.batch_bytes) {
+			flush();
+		}
+	}
+
+	// Push the batch, the next one has the same owner.
+	void flush()
+	{
+		std::shared_ptr<const void> owner = batch.owner;
+		if (batch.bytes != 0 && !output.push(std::move(batch))) {
+			throw Stopped{};
+		}
+		batch = TextBatch{};
+		batch.owner = std::move(owner);
+	}
+
+	// Add the lines of the text, return the last line without the newline.
+	std::string_view add_lines(std::string_view text)
+	{
+		while (!text.empty()) {
+			const void* newline = std::memchr(text.data(), '\n', text.size());
+			if (newline == nullptr) {
+				break;
+			}
+			const size_t size = to<size_t>(static_cast<const char*>(newline) - text.data());
+			add_document(text.substr(0, size), size + 1);
+			text.remove_prefix(size + 1);
+		}
+		return text;
+	}
+
+	void add_text(std::shared_ptr<const void> owner, std::string_view text)
+	{
+		flush();
+		batch.owner = std::move(owner);
+		if (options.lines) {
+			text = add_lines(text);
+		}
+		add_document(text, text.size());
+	}
+
+	void read_file(const std::filesystem::path& path)
+	{
+		MapOptions map_options;
+		map_options.sequential = true;
+		auto file = std::make_shared<const MappedFile>(path, map_options);
+		const std::string_view text{ reinterpret_cast<const char*>(file->data()), file->size() };
+		add_text(std::move(file), text);
+	}
+
+	void read_stdin()
+	{
+		std::string pending;
+		std::vector<char> buffer(options.batch_bytes);
+		while (true) {
+			const size_t size = std::fread(buffer.data(), 1, buffer.size(), stdin);
+			if (size == 0) {
+				break;
+			}
+			pending.append(buffer.data(), size);
+			if (!options.lines) {
+				continue;
+			}
+
+			// Complete lines are added now, the incomplete last one waits for the next read.
+			const size_t end = pending.rfind('\n');
+			if (end == std::string::npos) {
+				continue;
+			}
+			auto lines = std::make_shared<const std::string>(pending, 0, end + 1);
+			pending.erase(0, end + 1);
+			const std::string_view text = *lines;
+			add_text(std::move(lines), text);
+		}
+		if (std::ferror(stdin)) {
+			throw std::system_error(errno, std::generic_category(), "fread stdin");
+		}
+
+		auto rest = std::make_shared<const std::string>(std::move(pending));
+		const std::string_view text = *rest;
+		add_text(std::move(rest), text);
+	}
+};
+
+// Encode the batches and write the shards, report the throughput.
+template<TokenId Id>
+void tokenize(const Options& options, const Tokenizer& tokenizer)
+{
+	using Clock = std::chrono::steady_clock;
+	const auto start = Clock::now();
+
+	ThreadPool pool{ options.threads };
+	TokenShardWriter writer{ options.output, sizeof(Id), options.shard_tokens };
+	// Two batches in flight on each side let reading and writing overlap with the encoding.
+	Channel<TextBatch> texts{ 2 };
+	Channel<IdsBatch<Id>> encoded{ 2 };
+
+	std::exception_ptr reader_error;
+	std::exception_ptr writer_error;
+	size_t bytes = 0;
+
+	std::thread reader_thread{ [&] {
+		try {
+			Reader{ options, texts }.run();
+		} catch (...) {
+			reader_error = std::current_exception();
+		}
+		texts.close();
+	} };
+	std::thread writer_thread{ [&] {
+		try {
+			while (auto batch = encoded.pop()) {
+				for (size_t i = 0; i < batch->ids.size(); i++) {
+					writer.write(batch->ids[i]);
+				}
+				bytes += batch->bytes;
+			}
+			writer.finish();
+		} catch (...) {
+			writer_error = std::current_exception();
+			// Unblock the encoding, the rest of the batches are dropped.
+			encoded.close();
+		}
+	} };
+
+	std::exception_ptr encode_error;
+	try {
+		while (auto batch = texts.pop()) {
+			IdsBatch<Id> ids{ tokenizer.encode_batch<Id>(batch->documents, pool), batch->bytes };
+			if (!encoded.push(std::move(ids))) {
+				break;
+			}
+		}
+	} catch (...) {
+		encode_error = std::current_exception();
+	}
+	texts.close();
+	encoded.close();
+	reader_thread.join();
+	writer_thread.join();
+
+	for (const auto& error : { reader_error, encode_error, writer_error }) {
+		if (error) {
+			std::rethrow_exception(error);
+		}
+	}
+
+	const double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+	std::printf("%llu documents, %llu tokens (u%zu) in %zu shards\n",
+		static_cast<unsigned long long>(writer.get_document_count()),
+		static_cast<unsigned long long>(writer.get_token_count()), 8 * sizeof(Id), writer.get_shard_count());
+	std::printf("%.1f MB in %.2f s: %.1f MB/s, %.0f tokens/s\n",
+		static_cast<double>(bytes) / 1e6, seconds, static_cast<double>(bytes) / 1e6 / seconds,
+		static_cast<double>(writer.get_token_count()) / seconds);
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+	const std::optional<Options> options = parse_options(argc, argv);
+	if (!options) {
+		print_usage();
+		return 2;
+	}
+
+	try {
+		MapOptions map_options;
+		map_options.will_need = true;
+		const Tokenizer tokenizer{ options->model, map_options };
+
+		const bool narrow = options->ids == "u16" || (options->ids == "auto" && tokenizer.supports_ids<u16>());
+		if (narrow) {
+			tokenize<u16>(*options, tokenizer);
+		} else {
+			tokenize<u32>(*options, tokenizer);
+		}
+	} catch (const std::exception& error) {
+		std::cerr << "bpe_tokenize: " << error.what() << "\n";
+		return 1;
+	}
+	return 0;
+}